@@ -0,0 +1,513 @@
+/**
+ * File              : bench.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/*
+ * kdata2 benchmark - no network needed
+ * usage: kdata2_bench [-r rows,rows,...] [-n ops] [-b blob_size] [-f dbfile]
+ *                     [-l latency_ms] [-w bandwidth] [-B] [-z level]
+ * table is filled with rows in one transaction, then each
+ * case runs ops calls against it; results are printed to
+ * stdout as JSON
+ * if built with Yandex Disk module - sync cycle of ops rows
+ * is measured once (not for each rows count) with local
+ * directory backend; latency_ms and
+ * bandwidth (bytes per second) are injected into backend,
+ * -B - upload changes in bundles, -z - compress with deflate
+ * level
+ */
+
+#include "kdata2.h"
+#include "str.h"
+#ifdef WITH_YANDEX_DISK
+#include "modules/yandexdisk/yandexdisk.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_VERSION "1.2"
+
+struct bench {
+	kdata2_t *d;
+	long rows;
+	int ops;
+	int blob_size;
+	int latency_ms;                // sync backend latency
+	long bandwidth;                // sync backend bytes per second
+	int bundle;                    // sync with bundles
+	int compression;               // sync deflate level
+	char **uuids;                  // ops uuids of existing rows
+	struct str out;
+	int first;
+};
+
+static void bench_on_err(void *data, const char *msg)
+{
+	fprintf(stderr, "E/: %s\n", msg);
+}
+
+static int bench_row_cb(
+		void *user_data, int ncols,
+		enum KDATA2_TYPE types[], const char *columns[],
+		void *values[], size_t sizes[])
+{
+	long *count = user_data;
+	(*count)++;
+	return 0;
+}
+
+static void bench_result(
+		struct bench *b, const char *name, enum KDATA2_STAT op,
+		int ops, long bytes, uint64_t ns)
+{
+	struct kdata2_stat_snapshot s;
+	memset(&s, 0, sizeof(s));
+	if (op < KDATA2_STAT_COUNT)
+		kdata2_stats_snapshot(b->d, op, &s);
+
+	str_appendf(&b->out,
+			"%s\n    {\"name\": \"%s\", \"rows\": %ld, \"ops\": %d, "
+			"\"ns_per_op\": %.1f, \"ops_per_sec\": %.1f, "
+			"\"bytes_per_sec\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f}",
+			b->first?"":",", name, b->rows, ops,
+			(double)ns / ops, ops * 1e9 / ns,
+			bytes * 1e9 / ns, s.p50_us, s.p99_us);
+	b->first = 0;
+
+	fprintf(stderr, "%-14s rows: %-9ld %12.1f ns/op\n",
+			name, b->rows, (double)ns / ops);
+}
+
+/* fill table with rows in one transaction */
+static int bench_fill(struct bench *b)
+{
+	char SQL[BUFSIZ];
+	sprintf(SQL,
+			"BEGIN; "
+			"WITH RECURSIVE c(x) AS "
+			"(SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < %ld) "
+			"INSERT INTO bench (%s, timestamp, number, real, text) "
+			"SELECT lower(hex(randomblob(16))), %ld, x, x * 0.5, "
+			"'text ' || x FROM c; "
+			"COMMIT;",
+			b->rows, UUIDCOLUMN, (long)time(NULL));
+	return kdata2_sqlite3_exec(b->d, SQL);
+}
+
+/* select uuids for ops rows spread over table */
+static int bench_uuids(struct bench *b)
+{
+	char SQL[BUFSIZ];
+	int i = 0, n;
+	long step = b->rows / b->ops;
+	if (step < 1)
+		step = 1;
+
+	b->uuids = calloc(b->ops, sizeof(char *));
+	if (!b->uuids)
+		return -1;
+
+	sprintf(SQL, "SELECT %s FROM bench WHERE rowid %% %ld = 0 LIMIT %d",
+			UUIDCOLUMN, step, b->ops);
+	do {
+		kdata2_sqlite3_for_each(b->d, SQL, stmt){
+			if (sqlite_step == SQLITE_ROW)
+				b->uuids[i++] = strdup(
+						(const char *)sqlite3_column_text(stmt, 0));
+		}
+	} while(0);
+	if (i == 0)
+		return -1;
+	// fewer rows then ops - repeat
+	for (n = i; i < b->ops; ++i)
+		b->uuids[i] = strdup(b->uuids[i % n]);
+
+	return 0;
+}
+
+static void bench_set_number(struct bench *b)
+{
+	int i;
+	uint64_t start;
+	kdata2_stats_reset(b->d);
+	start = kdata2_stats_now();
+	for (i = 0; i < b->ops; ++i)
+		kdata2_set_number_for_uuid(b->d, "bench", "number",
+				i, b->uuids[i]);
+	bench_result(b, "set_number", KDATA2_STAT_SET_NUMBER,
+			b->ops, 0, kdata2_stats_now() - start);
+}
+
+static void bench_set_text(struct bench *b)
+{
+	int i;
+	uint64_t start;
+	kdata2_stats_reset(b->d);
+	start = kdata2_stats_now();
+	for (i = 0; i < b->ops; ++i)
+		kdata2_set_text_for_uuid(b->d, "bench", "text",
+				"benchmark text value", b->uuids[i]);
+	bench_result(b, "set_text", KDATA2_STAT_SET_TEXT,
+			b->ops, 0, kdata2_stats_now() - start);
+}
+
+/* new row with all columns */
+static void bench_row_write(struct bench *b)
+{
+	int i;
+	uint64_t start;
+	kdata2_stats_reset(b->d);
+	start = kdata2_stats_now();
+	for (i = 0; i < b->ops; ++i) {
+		char *uuid = kdata2_set_number_for_uuid(
+				b->d, "bench", "number", i, NULL);
+		if (!uuid)
+			continue;
+		kdata2_set_float_for_uuid(b->d, "bench", "real", i * 0.5, uuid);
+		kdata2_set_text_for_uuid(b->d, "bench", "text", "new row", uuid);
+		free(uuid);
+	}
+	bench_result(b, "row_write", KDATA2_STAT_COUNT,
+			b->ops, 0, kdata2_stats_now() - start);
+}
+
+static void bench_point_read(struct bench *b)
+{
+	int i;
+	long count = 0;
+	uint64_t start;
+	char SQL[BUFSIZ];
+	kdata2_stats_reset(b->d);
+	start = kdata2_stats_now();
+	for (i = 0; i < b->ops; ++i) {
+		sprintf(SQL, "SELECT * FROM bench WHERE %s = '%s'",
+				UUIDCOLUMN, b->uuids[i]);
+		kdata2_get(b->d, SQL, &count, bench_row_cb);
+	}
+	bench_result(b, "point_read", KDATA2_STAT_GET,
+			b->ops, 0, kdata2_stats_now() - start);
+}
+
+static void bench_full_scan(struct bench *b)
+{
+	long count = 0;
+	uint64_t start;
+	kdata2_stats_reset(b->d);
+	start = kdata2_stats_now();
+	kdata2_get(b->d, "SELECT * FROM bench", &count, bench_row_cb);
+	bench_result(b, "full_scan", KDATA2_STAT_GET,
+			1, 0, kdata2_stats_now() - start);
+}
+
+static void bench_blob(struct bench *b)
+{
+	int i, ops = b->ops < 100?b->ops:100;
+	long count = 0;
+	uint64_t start;
+	char SQL[BUFSIZ];
+	void *data = malloc(b->blob_size);
+	if (!data)
+		return;
+	for (i = 0; i < b->blob_size; ++i)
+		((unsigned char *)data)[i] = rand();
+
+	kdata2_stats_reset(b->d);
+	start = kdata2_stats_now();
+	for (i = 0; i < ops; ++i)
+		kdata2_set_data_for_uuid(b->d, "bench", "data",
+				data, b->blob_size, b->uuids[i]);
+	bench_result(b, "blob_write", KDATA2_STAT_SET_DATA,
+			ops, (long)ops * b->blob_size, kdata2_stats_now() - start);
+
+	kdata2_stats_reset(b->d);
+	start = kdata2_stats_now();
+	for (i = 0; i < ops; ++i) {
+		sprintf(SQL, "SELECT data FROM bench WHERE %s = '%s'",
+				UUIDCOLUMN, b->uuids[i]);
+		kdata2_get(b->d, SQL, &count, bench_row_cb);
+	}
+	bench_result(b, "blob_read", KDATA2_STAT_GET,
+			ops, (long)ops * b->blob_size, kdata2_stats_now() - start);
+	free(data);
+}
+
+static void bench_remove(struct bench *b)
+{
+	int i;
+	uint64_t start;
+	kdata2_stats_reset(b->d);
+	start = kdata2_stats_now();
+	for (i = 0; i < b->ops; ++i)
+		kdata2_remove_for_uuid(b->d, "bench", b->uuids[i]);
+	bench_result(b, "remove", KDATA2_STAT_REMOVE,
+			b->ops, 0, kdata2_stats_now() - start);
+}
+
+#ifdef WITH_YANDEX_DISK
+/* remove file or directory with its files */
+static void bench_remove_path(kdbackend_t *backend, const char *path);
+
+static int bench_remove_cb(void *user_data, const char *name)
+{
+	void **p = user_data;
+	char path[BUFSIZ];
+	snprintf(path, BUFSIZ, "%s/%s", (char *)p[1], name);
+	bench_remove_path(p[0], path);
+	return 0;
+}
+
+static void bench_remove_path(kdbackend_t *backend, const char *path)
+{
+	void *p[2] = {backend, (void *)path};
+	// files can't be listed
+	backend->list_sorted(backend, path, p, bench_remove_cb, NULL);
+	backend->remove(backend, path, NULL);
+}
+
+/* remove all files in remote - flat folders of older
+ * versions, buckets of changes, blobs, snapshots and lease */
+static void bench_sync_clean(kdbackend_t *backend)
+{
+	const char *dirs[] = {
+		"updates", "deleted", "changes", "blobs", "snapshots",
+		"compaction.lease", NULL
+	}, **dir;
+	char path[BUFSIZ];
+	for (dir = dirs; *dir; dir++) {
+		snprintf(path, BUFSIZ, "app:/%s", *dir);
+		bench_remove_path(backend, path);
+	}
+}
+
+static kdata2_t * bench_sync_open(const char *filepath)
+{
+	kdata2_t *d;
+	struct kdata2_table *t;
+
+	unlink(filepath);
+	kdata2_table_init(&t, "bench",
+			KDATA2_TYPE_NUMBER, "number",
+			KDATA2_TYPE_FLOAT,  "real",
+			KDATA2_TYPE_TEXT,   "text",
+			KDATA2_TYPE_DATA,   "data",
+			NULL);
+	if (kdata2_init(&d, filepath, 
+				NULL, bench_on_err, NULL, NULL, t, NULL))
+		return NULL;
+	kdata2_set_log_level(d, KDATA2_LOG_ERROR);
+	kdata2_stats_enable(d, 1);
+	return d;
+}
+
+/* run one sync cycle of database through local directory
+ * backend */
+static uint64_t bench_sync_cycle(struct bench *b, const char *remote)
+{
+	kdydm_t *m;
+	uint64_t start;
+	kdbackend_t *backend = 
+		local_backend_new(remote, b->latency_ms, b->bandwidth);
+	if (!backend)
+		return 0;
+	m = yandex_disk_module_new(b->d, backend);
+	if (!m){
+		kdata_backend_free(backend);
+		return 0;
+	}
+	yandex_disk_set_bundle(m, b->bundle);
+	yandex_disk_set_compression(m, b->compression);
+
+	start = kdata2_stats_now();
+	yandex_disk_module_sync(m);
+	start = kdata2_stats_now() - start;
+
+	yandex_disk_module_unload(m);
+	return start;
+}
+
+/* upload ops new rows from one database and download them
+ * to another one through local directory backend - rows of
+ * results are rows of source database, download reports rows
+ * which are in destination database */
+static int bench_sync(struct bench *b, const char *filepath)
+{
+	char src[BUFSIZ], dst[BUFSIZ], remote[BUFSIZ];
+	kdbackend_t *backend;
+	uint64_t ns;
+	char *synced;
+	int i, count = 0;
+
+	snprintf(src,    BUFSIZ, "%s.src",    filepath);
+	snprintf(dst,    BUFSIZ, "%s.dst",    filepath);
+	snprintf(remote, BUFSIZ, "%s.remote", filepath);
+
+	backend = local_backend_new(remote, 0, 0);
+	if (!backend)
+		return -1;
+	bench_sync_clean(backend);
+
+	b->d = bench_sync_open(src);
+	if (!b->d){
+		kdata_backend_free(backend);
+		return -1;
+	}
+	b->rows = b->ops;
+	for (i = 0; i < b->rows; ++i) {
+		char *uuid = kdata2_set_number_for_uuid(
+				b->d, "bench", "number", i, NULL);
+		if (!uuid)
+			continue;
+		kdata2_set_text_for_uuid(b->d, "bench", "text", "sync row", uuid);
+		free(uuid);
+	}
+
+	kdata2_stats_reset(b->d);
+	ns = bench_sync_cycle(b, remote);
+	if (ns)
+		bench_result(b, "sync_upload", KDATA2_STAT_SYNC_UPLOAD,
+				b->rows, 0, ns);
+	kdata2_close(b->d);
+
+	b->d = bench_sync_open(dst);
+	if (b->d){
+		ns = bench_sync_cycle(b, remote);
+		synced = kdata2_get_string(b->d, "SELECT COUNT(*) FROM bench");
+		if (synced){
+			count = atoi(synced);
+			free(synced);
+		}
+		if (count != b->rows)
+			fprintf(stderr, "synced %d of %ld rows\n", count, b->rows);
+		if (ns && count)
+			bench_result(b, "sync_download", KDATA2_STAT_SYNC_DOWNLOAD,
+					count, 0, ns);
+		kdata2_close(b->d);
+		b->d = NULL;
+	}
+
+	bench_sync_clean(backend);
+	kdata_backend_free(backend);
+	remove(remote);
+	unlink(src);
+	unlink(dst);
+	return ns?0:-1;
+}
+#endif
+
+static int bench_run(struct bench *b, const char *filepath)
+{
+	int i;
+	struct kdata2_table *t;
+
+	unlink(filepath);
+	kdata2_table_init(&t, "bench",
+			KDATA2_TYPE_NUMBER, "number",
+			KDATA2_TYPE_FLOAT,  "real",
+			KDATA2_TYPE_TEXT,   "text",
+			KDATA2_TYPE_DATA,   "data",
+			NULL);
+
+	if (kdata2_init(&b->d, filepath, 
+				NULL, bench_on_err, NULL, NULL, t, NULL))
+		return -1;
+	kdata2_set_log_level(b->d, KDATA2_LOG_ERROR);
+	kdata2_stats_enable(b->d, 1);
+
+	fprintf(stderr, "fill %ld rows...\n", b->rows);
+	if (bench_fill(b) || bench_uuids(b)){
+		kdata2_close(b->d);
+		return -1;
+	}
+
+	bench_set_number(b);
+	bench_set_text(b);
+	bench_row_write(b);
+	bench_point_read(b);
+	bench_full_scan(b);
+	bench_blob(b);
+	bench_remove(b);
+
+	for (i = 0; i < b->ops; ++i)
+		free(b->uuids[i]);
+	free(b->uuids);
+	b->uuids = NULL;
+
+	kdata2_close(b->d);
+	unlink(filepath);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b;
+	const char *rows = "1000,10000,100000";
+	const char *filepath = "kdata2_bench.db";
+	char *list, *token, *p;
+	int opt;
+
+	memset(&b, 0, sizeof(b));
+	b.ops = 1000;
+	b.blob_size = 256 * 1024;
+	b.first = 1;
+
+	while ((opt = getopt(argc, argv, "r:n:b:f:l:w:Bz:h")) != -1) {
+		switch (opt) {
+			case 'r': rows = optarg; break;
+			case 'n': b.ops = atoi(optarg); break;
+			case 'b': b.blob_size = atoi(optarg); break;
+			case 'f': filepath = optarg; break;
+			case 'l': b.latency_ms = atoi(optarg); break;
+			case 'w': b.bandwidth = atol(optarg); break;
+			case 'B': b.bundle = 1; break;
+			case 'z': b.compression = atoi(optarg); break;
+			default:
+				fprintf(stderr,
+						"usage: %s [-r rows,rows,...] [-n ops] "
+						"[-b blob_size] [-f dbfile] "
+						"[-l latency_ms] [-w bandwidth] [-B] "
+						"[-z level]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (b.ops < 1)
+		b.ops = 1;
+
+	if (str_init(&b.out))
+		return 1;
+	str_appendf(&b.out,
+			"{\n  \"kdata2\": \"%s\",\n  \"sqlite\": \"%s\",\n"
+			"  \"results\": [",
+			BENCH_VERSION, sqlite3_libversion());
+
+	list = strdup(rows);
+	for (token = strtok_r(list, ",", &p); token;
+			token = strtok_r(NULL, ",", &p))
+	{
+		b.rows = atol(token);
+		if (b.rows < 1)
+			continue;
+		if (bench_run(&b, filepath)){
+			fprintf(stderr, "can't run benchmark for %ld rows\n", b.rows);
+			return 1;
+		}
+	}
+	free(list);
+
+#ifdef WITH_YANDEX_DISK
+	if (bench_sync(&b, filepath))
+		fprintf(stderr, "can't run sync benchmark\n");
+#endif
+
+	str_appendf(&b.out, "\n  ]\n}\n");
+	printf("%s", b.out.str);
+	free(b.out.str);
+
+	return 0;
+}
@@ -2,7 +2,7 @@
  * File              : kdata2.c
  * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
  * Date              : 10.03.2023
- * Last Modified Date: 25.04.2026
+ * Last Modified Date: 19.10.2026
  * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
  */
 
@@ -16,6 +16,7 @@
 #include "str.h"
 #include "alloc.h"
 #include <assert.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,9 +36,28 @@
 #endif // WIN32
 
 #define ON_ERR(ptr, msg) \
-	if (ptr->on_error) ptr->on_error(ptr->on_error_data, msg);
+	if (ptr->on_error && kdata2_log_enabled(ptr, KDATA2_LOG_ERROR)) \
+		kdata2_log(ptr, KDATA2_LOG_ERROR, msg);
 #define ON_LOG(ptr, msg) \
-	if (ptr->on_log) ptr->on_log(ptr->on_log_data, msg);
+	if (ptr->on_log && kdata2_log_enabled(ptr, KDATA2_LOG_INFO)) \
+		kdata2_log(ptr, KDATA2_LOG_INFO, msg);
+#define ON_DBG(ptr, msg) \
+	if (ptr->on_log && kdata2_log_enabled(ptr, KDATA2_LOG_DEBUG)) \
+		kdata2_log(ptr, KDATA2_LOG_DEBUG, msg);
+
+void _kdata2_log_close(kdata2_t *d);
+void _kdata2_stats_close(kdata2_t *d);
+void _kdata2_slow_queries_close(kdata2_t *d);
+uint64_t _kdata2_api_enter(kdata2_t *d, enum KDATA2_STAT op);
+void _kdata2_api_leave(kdata2_t *d, enum KDATA2_STAT op, uint64_t start);
+
+/* run expression as measured public API call */
+#define KDATA2_API(d, op, expr) \
+	do { \
+		uint64_t __start = _kdata2_api_enter(d, op); \
+		expr; \
+		_kdata2_api_leave(d, op, __start); \
+	} while(0)
 
 struct kdata2_update {
 	char table[128];
@@ -65,7 +85,7 @@ int kdata2_sqlite3_exec(
 
 	kdata2_do_in_database_lock(d)
 	{
-		ON_LOG(d, sql);
+		ON_DBG(d, sql);
 		sqlite3_exec(d->db, sql, NULL, NULL, &errmsg);
 		if (errmsg && strstr(errmsg, "duplicate column name") == NULL)
 		{
@@ -84,7 +104,7 @@ int kdata2_sqlite3_prepare(
 {
 	int res;
 	char *errmsg = NULL;
-	ON_LOG(d, sql);
+	ON_DBG(d, sql);
 
 	res = sqlite3_prepare_v2(d->db, sql, -1, stmt, NULL);
 	if (res != SQLITE_OK) {
@@ -159,7 +179,9 @@ int kdata2_init(
 		"uuid TEXT, "
 		"timestamp INT, "
 		"local INT, "
-		"deleted INT "
+		"deleted INT, "
+		"columns INT, "
+		"seq INT "
 		");"
 		;	
 
@@ -201,13 +223,14 @@ int kdata2_init(
 	d->on_error      = on_error;
 	d->on_log_data   = on_log_data;
 	d->on_log        = on_log;
+	d->log_level     = KDATA2_LOG_INFO;
 
 	strncpy(d->filepath, filepath, BUFSIZ-1);
 	d->filepath[BUFSIZ-1] = 0;
 	
 	/* init SQLIte database */
 	/* create database if needed */
-	ON_LOG(d, STR("sqlite3_open: %s", d->filepath));	
+	ON_DBG(d, STR("sqlite3_open: %s", d->filepath));	
 	/*err = sqlite3_open_v2(*/
 			/*d->filepath, */
 			/*&(d->db), */
@@ -298,6 +321,14 @@ int kdata2_init(
 							table->tablename);
 		kdata2_sqlite3_exec(d, SQL);
 
+		// rows are found by uuid
+		sprintf(SQL, 
+							"CREATE INDEX IF NOT EXISTS '%s_%s' "
+											"ON '%s' (%s);", 
+							table->tablename, UUIDCOLUMN,
+							table->tablename, UUIDCOLUMN);
+		kdata2_sqlite3_exec(d, SQL);
+
 		col_ptr = table->columns; // pointer to iterate
 		while (*col_ptr) {
 			/* for each column in table */
@@ -355,14 +386,42 @@ int kdata2_init(
 
 	/* create table to store updates */
 	/* run SQL command */
-	ON_LOG(d, SQL_updates);
 	kdata2_sqlite3_exec(d, SQL_updates);
+	// databases of older versions - NULL bitmap is all
+	// columns
+	kdata2_sqlite3_exec(d, 
+			"ALTER TABLE _kdata2_updates ADD COLUMN columns INT;");
+	// count of local changes of row - sync checks that row
+	// is not changed while it is uploaded
+	kdata2_sqlite3_exec(d, 
+			"ALTER TABLE _kdata2_updates ADD COLUMN seq INT;");
+	kdata2_sqlite3_exec(d, 
+			"CREATE INDEX IF NOT EXISTS _kdata2_updates_uuid "
+			"ON _kdata2_updates (uuid);");
 
 	return 0;
 }
 
-char *
-kdata2_set_number_for_uuid(
+/* bit of column in _kdata2_updates.columns */
+static int64_t _kdata2_column_mask(
+		kdata2_t *d, const char *tablename, const char *column)
+{
+	int i;
+	do {
+		kdata2_table_for_each(d) {
+			if (strcmp(table->tablename, tablename))
+				continue;
+			for (i = 0; table->columns[i]; ++i) {
+				if (strcmp(table->columns[i]->columnname, column) == 0)
+					return kdata2_column_bit(i);
+			}
+		}
+	} while(0);
+	return -1;
+}
+
+static char *
+_kdata2_set_number_for_uuid(
 		kdata2_t *d, 
 		const char *tablename, 
 		const char *column, 
@@ -398,29 +457,30 @@ kdata2_set_number_for_uuid(
 			tablename, UUIDCOLUMN, uuid,
 			tablename, timestamp, column, number, UUIDCOLUMN, uuid		
 	);
-	ON_LOG(d, SQL);
 	if (kdata2_sqlite3_exec(d, SQL))
 		return NULL;
 
 	/* update update table */
 	snprintf(SQL, BUFSIZ-1,
-			"INSERT INTO _kdata2_updates (uuid) "
-			"SELECT '%s' "
+			"INSERT INTO _kdata2_updates (uuid, columns) "
+			"SELECT '%s', 0 "
 			"WHERE NOT EXISTS (SELECT 1 FROM _kdata2_updates WHERE uuid = '%s'); "
-			"UPDATE _kdata2_updates SET timestamp = %ld, tablename = '%s', deleted = 0 WHERE uuid = '%s'"
+			"UPDATE _kdata2_updates SET seq = COALESCE(seq, 0) + 1, "
+			"timestamp = %ld, tablename = '%s', deleted = 0, "
+			"columns = columns | %lld WHERE uuid = '%s'"
 			,
 			uuid,
 			uuid,
-			timestamp, tablename, uuid		
+			timestamp, tablename, 
+			(long long)_kdata2_column_mask(d, tablename, column), uuid		
 	);
-	ON_LOG(d, SQL);
 	if (kdata2_sqlite3_exec(d, SQL))
 		return NULL;
 
 	return (char *)uuid;
 }
 
-char * kdata2_set_float_for_uuid(
+static char * _kdata2_set_float_for_uuid(
 		kdata2_t * d, 
 		const char *tablename, 
 		const char *column, 
@@ -456,29 +516,30 @@ char * kdata2_set_float_for_uuid(
 			tablename, UUIDCOLUMN, uuid,
 			tablename, timestamp, column, number, UUIDCOLUMN, uuid		
 	);
-	ON_LOG(d, SQL);
 	if (kdata2_sqlite3_exec(d, SQL))
 		return NULL;
 
 	/* update update table */
 	snprintf(SQL, BUFSIZ-1,
-			"INSERT INTO _kdata2_updates (uuid) "
-			"SELECT '%s' "
+			"INSERT INTO _kdata2_updates (uuid, columns) "
+			"SELECT '%s', 0 "
 			"WHERE NOT EXISTS (SELECT 1 FROM _kdata2_updates WHERE uuid = '%s'); "
-			"UPDATE _kdata2_updates SET timestamp = %ld, tablename = '%s', deleted = 0 WHERE uuid = '%s'"
+			"UPDATE _kdata2_updates SET seq = COALESCE(seq, 0) + 1, "
+			"timestamp = %ld, tablename = '%s', deleted = 0, "
+			"columns = columns | %lld WHERE uuid = '%s'"
 			,
 			uuid,
 			uuid,
-			timestamp, tablename, uuid		
+			timestamp, tablename, 
+			(long long)_kdata2_column_mask(d, tablename, column), uuid		
 	);
-	ON_LOG(d, SQL);
 	if (kdata2_sqlite3_exec(d, SQL))
 		return NULL;
 
 	return (char *)uuid;
 }
 
-char * kdata2_set_text_for_uuid(
+static char * _kdata2_set_text_for_uuid(
 		kdata2_t *d, 
 		const char *tablename, 
 		const char *column, 
@@ -521,29 +582,30 @@ char * kdata2_set_text_for_uuid(
 			tablename, UUIDCOLUMN, uuid,
 			tablename, timestamp, column, text, UUIDCOLUMN, uuid		
 	);
-	ON_LOG(d, SQL);
 	if (kdata2_sqlite3_exec(d, SQL))
 		return NULL;
 
 	/* update update table */
 	snprintf(SQL, BUFSIZ-1,
-			"INSERT INTO _kdata2_updates (uuid) "
-			"SELECT '%s' "
+			"INSERT INTO _kdata2_updates (uuid, columns) "
+			"SELECT '%s', 0 "
 			"WHERE NOT EXISTS (SELECT 1 FROM _kdata2_updates WHERE uuid = '%s'); "
-			"UPDATE _kdata2_updates SET timestamp = %ld, tablename = '%s', deleted = 0 WHERE uuid = '%s'"
+			"UPDATE _kdata2_updates SET seq = COALESCE(seq, 0) + 1, "
+			"timestamp = %ld, tablename = '%s', deleted = 0, "
+			"columns = columns | %lld WHERE uuid = '%s'"
 			,
 			uuid,
 			uuid,
-			timestamp, tablename, uuid		
+			timestamp, tablename, 
+			(long long)_kdata2_column_mask(d, tablename, column), uuid		
 	);
-	ON_LOG(d, SQL);
 	if (kdata2_sqlite3_exec(d, SQL))
 		return NULL;
 	
 	return (char *)uuid;
 }
 
-char * kdata2_set_data_for_uuid(
+static char * _kdata2_set_data_for_uuid(
 		kdata2_t *d, 
 		const char *tablename, 
 		const char *column, 
@@ -583,11 +645,11 @@ char * kdata2_set_data_for_uuid(
 			uuid,
 			tablename, UUIDCOLUMN, uuid
 	);	
-	ON_LOG(d, SQL);
 	if (kdata2_sqlite3_exec(d, SQL))
 		return NULL;
 	
-	sprintf(SQL, "UPDATE '%s' SET '%s' = (?) WHERE %s = '%s'", tablename, column, UUIDCOLUMN, uuid);
+	sprintf(SQL, "UPDATE '%s' SET timestamp = %ld, '%s' = (?) WHERE %s = '%s'", 
+			tablename, timestamp, column, UUIDCOLUMN, uuid);
 	
 	/*if (kdata2_sqlite3_prepare_v2(d, SQL, &stmt))*/
 	if (kdata2_sqlite3_prepare(d, SQL, &stmt))
@@ -610,23 +672,25 @@ char * kdata2_set_data_for_uuid(
 	
 	/* update update table */
 	snprintf(SQL, BUFSIZ-1,
-			"INSERT INTO _kdata2_updates (uuid) "
-			"SELECT '%s' "
+			"INSERT INTO _kdata2_updates (uuid, columns) "
+			"SELECT '%s', 0 "
 			"WHERE NOT EXISTS (SELECT 1 FROM _kdata2_updates WHERE uuid = '%s'); "
-			"UPDATE _kdata2_updates SET timestamp = %ld, tablename = '%s', deleted = 0 WHERE uuid = '%s'"
+			"UPDATE _kdata2_updates SET seq = COALESCE(seq, 0) + 1, "
+			"timestamp = %ld, tablename = '%s', deleted = 0, "
+			"columns = columns | %lld WHERE uuid = '%s'"
 			,
 			uuid,
 			uuid,
-			timestamp, tablename, uuid		
+			timestamp, tablename, 
+			(long long)_kdata2_column_mask(d, tablename, column), uuid		
 	);
-	ON_LOG(d, SQL);
 	if (kdata2_sqlite3_exec(d, SQL))
 		return NULL;
 
 	return (char *)uuid;
 }
 
-int kdata2_remove_for_uuid(
+static int _kdata2_remove_for_uuid(
 		kdata2_t *d, 
 		const char *tablename, 
 		const char *uuid)
@@ -644,7 +708,6 @@ int kdata2_remove_for_uuid(
 	snprintf(SQL, BUFSIZ-1,
 			"DELETE FROM '%s' WHERE %s = '%s'", 
 			tablename, UUIDCOLUMN, uuid);	
-	ON_LOG(d, SQL);
 	if (kdata2_sqlite3_exec(d, SQL))
 		return -1;
 
@@ -653,20 +716,20 @@ int kdata2_remove_for_uuid(
 			"INSERT INTO _kdata2_updates (uuid) "
 			"SELECT '%s' "
 			"WHERE NOT EXISTS (SELECT 1 FROM _kdata2_updates WHERE uuid = '%s'); "
-			"UPDATE _kdata2_updates SET timestamp = %ld, tablename = '%s', deleted = 1 WHERE uuid = '%s'"
+			"UPDATE _kdata2_updates SET seq = COALESCE(seq, 0) + 1, "
+			"timestamp = %ld, tablename = '%s', deleted = 1 WHERE uuid = '%s'"
 			,
 			uuid,
 			uuid,
 			time(NULL), tablename, uuid		
 	);
-	ON_LOG(d, SQL);
 	if (kdata2_sqlite3_exec(d, SQL))
 		return -1;
 	
 	return 0;
 }
 
-char * kdata2_get_string(
+static char * _kdata2_get_string(
 		kdata2_t *d, 
 		const char *SQL)
 {
@@ -690,15 +753,17 @@ char * kdata2_get_string(
 	sqlite3_step(stmt);
 	str = (const char *)
 		sqlite3_column_text(stmt, 0);
-	if (!str)
+	if (!str){
+		sqlite3_finalize(stmt);
 		return NULL;
+	}
 	
 	ret_str = strdup(str);
 	sqlite3_finalize(stmt);
 	return (char *)ret_str;
 }	
 
-void kdata2_get(
+static void _kdata2_get(
 		kdata2_t *d, 
 		const char *SQL, 
 		void *user_data,
@@ -713,7 +778,7 @@ void kdata2_get(
 		)
 {
 	sqlite3_stmt *stmt;
-	int num_cols;
+	int num_cols, stop = 0;
 
 	if (!d)
 		return;
@@ -794,27 +859,249 @@ void kdata2_get(
 		}
 		
 		// do callback
-		if (callback){
-			if (callback(user_data, num_cols, types, columns, values, sizes))
-			{
-			   sqlite3_finalize(stmt);
-			   return;
-			}
-		}
+		if (callback)
+			stop = callback(user_data, num_cols, types, columns, values, sizes);
 		
-		free(types);
-		free(columns);
 		for (i = 0; i < num_cols; ++i) {
 			if (types[i] == KDATA2_TYPE_NUMBER || types[i] == KDATA2_TYPE_FLOAT)
 				free(values[i]);
 		}
+		free(types);
+		free(columns);
 		free(values);
 		free(sizes);
+
+		if (stop)
+			break;
 	}
 
 	sqlite3_finalize(stmt);
 }
 
+/* Conception:
+ * listeners array is copied on add and remove and published
+ * atomically - callers read it without lock and are counted
+ * in d->listeners_calls. Old array is freed when there are
+ * no callers, so removed callback is not called after
+ * kdata2_remove_on_change returns */
+static void _listeners_lock(kdata2_t *d)
+{
+	while (__atomic_exchange_n(&d->listeners_lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void _listeners_unlock(kdata2_t *d)
+{
+	__atomic_store_n(&d->listeners_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* publish listeners and free old array - call in lock */
+static void _listeners_publish(
+		kdata2_t *d, struct kdata2_listener *listeners)
+{
+	struct kdata2_listener *old;
+
+	old = __atomic_exchange_n(
+			&d->listeners, listeners, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&d->listeners_calls, __ATOMIC_SEQ_CST))
+		sched_yield();
+	free(old);
+}
+
+int kdata2_add_on_change(
+		kdata2_t *d,
+		void *on_change_data,
+		void (*on_change)(
+			void *on_change_data, const char *tablename))
+{
+	struct kdata2_listener *listeners;
+	int n = 0;
+
+	if (!d || !on_change)
+		return -1;
+
+	_listeners_lock(d);
+	while (d->listeners && d->listeners[n].on_change)
+		n++;
+	listeners = MALLOC((n + 2) * sizeof(struct kdata2_listener));
+	if (listeners == NULL){
+		_listeners_unlock(d);
+		ON_ERR(d, "memory allocation error");
+		return -1;
+	}
+	if (n)
+		memcpy(listeners, d->listeners,
+				n * sizeof(struct kdata2_listener));
+	listeners[n].on_change_data = on_change_data;
+	listeners[n].on_change = on_change;
+	listeners[n + 1].on_change_data = NULL;
+	listeners[n + 1].on_change = NULL;
+	_listeners_publish(d, listeners);
+	_listeners_unlock(d);
+
+	return 0;
+}
+
+int kdata2_remove_on_change(
+		kdata2_t *d,
+		void *on_change_data,
+		void (*on_change)(
+			void *on_change_data, const char *tablename))
+{
+	struct kdata2_listener *listeners, *l;
+	int n = 0, found = 0;
+
+	if (!d)
+		return -1;
+
+	_listeners_lock(d);
+	while (d->listeners && d->listeners[n].on_change)
+		n++;
+	listeners = MALLOC((n + 1) * sizeof(struct kdata2_listener));
+	if (listeners == NULL){
+		_listeners_unlock(d);
+		ON_ERR(d, "memory allocation error");
+		return -1;
+	}
+	n = 0;
+	for (l = d->listeners; l && l->on_change; l++) {
+		if (!found && l->on_change == on_change &&
+				l->on_change_data == on_change_data)
+		{
+			found = 1;
+			continue;
+		}
+		listeners[n++] = *l;
+	}
+	listeners[n].on_change_data = NULL;
+	listeners[n].on_change = NULL;
+	if (found)
+		_listeners_publish(d, listeners);
+	else
+		free(listeners);
+	_listeners_unlock(d);
+
+	return found?0:-1;
+}
+
+static void _kdata2_changed(kdata2_t *d, const char *tablename)
+{
+	struct kdata2_listener *l;
+
+	__atomic_fetch_add(&d->listeners_calls, 1, __ATOMIC_SEQ_CST);
+	l = __atomic_load_n(&d->listeners, __ATOMIC_SEQ_CST);
+	for (; l && l->on_change; l++)
+		l->on_change(l->on_change_data, tablename);
+	__atomic_fetch_sub(&d->listeners_calls, 1, __ATOMIC_SEQ_CST);
+}
+
+/* public API - each call is measured with kdata2 stats */
+char * kdata2_set_number_for_uuid(
+		kdata2_t *d, 
+		const char *tablename, 
+		const char *column, 
+		long number, 
+		const char *uuid)
+{
+	char *ret;
+	KDATA2_API(d, KDATA2_STAT_SET_NUMBER,
+		ret = _kdata2_set_number_for_uuid(
+			d, tablename, column, number, uuid));
+	if (ret)
+		_kdata2_changed(d, tablename);
+	return ret;
+}
+
+char * kdata2_set_float_for_uuid(
+		kdata2_t *d, 
+		const char *tablename, 
+		const char *column, 
+		double number, 
+		const char *uuid)
+{
+	char *ret;
+	KDATA2_API(d, KDATA2_STAT_SET_FLOAT,
+		ret = _kdata2_set_float_for_uuid(
+			d, tablename, column, number, uuid));
+	if (ret)
+		_kdata2_changed(d, tablename);
+	return ret;
+}
+
+char * kdata2_set_text_for_uuid(
+		kdata2_t *d, 
+		const char *tablename, 
+		const char *column, 
+		const char *text, 
+		const char *uuid)
+{
+	char *ret;
+	KDATA2_API(d, KDATA2_STAT_SET_TEXT,
+		ret = _kdata2_set_text_for_uuid(
+			d, tablename, column, text, uuid));
+	if (ret)
+		_kdata2_changed(d, tablename);
+	return ret;
+}
+
+char * kdata2_set_data_for_uuid(
+		kdata2_t *d, 
+		const char *tablename, 
+		const char *column, 
+		void *data, 
+		int len,
+		const char *uuid)
+{
+	char *ret;
+	KDATA2_API(d, KDATA2_STAT_SET_DATA,
+		ret = _kdata2_set_data_for_uuid(
+			d, tablename, column, data, len, uuid));
+	if (ret)
+		_kdata2_changed(d, tablename);
+	return ret;
+}
+
+int kdata2_remove_for_uuid(
+		kdata2_t *d, 
+		const char *tablename, 
+		const char *uuid)
+{
+	int ret;
+	KDATA2_API(d, KDATA2_STAT_REMOVE,
+		ret = _kdata2_remove_for_uuid(d, tablename, uuid));
+	if (ret == 0)
+		_kdata2_changed(d, tablename);
+	return ret;
+}
+
+char * kdata2_get_string(
+		kdata2_t *d, 
+		const char *SQL)
+{
+	char *ret;
+	KDATA2_API(d, KDATA2_STAT_GET_STRING,
+		ret = _kdata2_get_string(d, SQL));
+	return ret;
+}
+
+void kdata2_get(
+		kdata2_t *d, 
+		const char *SQL, 
+		void *user_data,
+		int (*callback)(
+			void *user_data,
+			int num_cols,
+			enum KDATA2_TYPE types[],
+			const char *columns[], 
+			void *values[],
+			size_t sizes[]
+			)
+		)
+{
+	KDATA2_API(d, KDATA2_STAT_GET,
+		_kdata2_get(d, SQL, user_data, callback));
+}
+
 int kdata2_close(kdata2_t *d){
 	if (!d)
 		return -1;
@@ -822,6 +1109,13 @@ int kdata2_close(kdata2_t *d){
 	if (d->db)
 		sqlite3_close(d->db);
 
+	_kdata2_slow_queries_close(d);
+	_kdata2_stats_close(d);
+	_kdata2_log_close(d);
+
+	free(d->listeners);
+	d->listeners = NULL;
+
 	//free(d);
 	return 0;
 }
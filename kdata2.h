@@ -2,7 +2,7 @@
  * File              : kdata2.h
  * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
  * Date              : 10.03.2023
- * Last Modified Date: 25.04.2026
+ * Last Modified Date: 19.10.2026
  * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
  */
 
@@ -26,6 +26,7 @@ extern "C" {
 #endif
 	
 #include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 #include <pthread.h>
 #include <sqlite3.h>
@@ -34,6 +35,17 @@ extern "C" {
 #define UUIDCOLUMN "ZRECORDNAME"
 #endif /* ifndef UUIDCOLUMN */
 
+/* _kdata2_updates.columns - bitmap of columns changed since
+ * last upload, bit i is column with index i in table
+ * definition. Columns with index KDATA2_COLUMN_BITS and more
+ * set all bits (as NULL bitmap of older versions) */
+#define KDATA2_COLUMN_BITS 62
+#define kdata2_column_bit(i) \
+	((i) < KDATA2_COLUMN_BITS ? (int64_t)1 << (i) : (int64_t)-1)
+#define kdata2_column_in(columns, i) \
+	((i) < KDATA2_COLUMN_BITS ? \
+	 (((columns) >> (i)) & 1) : (columns) == (int64_t)-1)
+
 int uuid_new(char uuid[37]);
 
 enum KDATA2_TYPE {
@@ -59,6 +71,46 @@ struct kdata2_table {
 /* allocate table structure with allocated columns; va_args: type, columnname, ... NULL */
 int EXPORTDLL kdata2_table_init(struct kdata2_table **t, const char * tablename, ...); 
 
+/* log levels - messages with level above database log_level 
+ * are not formatted and not delivered */
+enum KDATA2_LOG_LEVEL {
+	KDATA2_LOG_NONE,           // no messages
+	KDATA2_LOG_ERROR,          // errors (on_error callback)
+	KDATA2_LOG_INFO,           // state messages (on_log callback)
+	KDATA2_LOG_DEBUG           // each SQL statement (on_log callback)
+};
+
+struct kdata2_log_queue;
+
+/* operations measured with kdata2 stats */
+enum KDATA2_STAT {
+	KDATA2_STAT_SET_NUMBER,    // kdata2_set_number_for_uuid
+	KDATA2_STAT_SET_FLOAT,     // kdata2_set_float_for_uuid
+	KDATA2_STAT_SET_TEXT,      // kdata2_set_text_for_uuid
+	KDATA2_STAT_SET_DATA,      // kdata2_set_data_for_uuid
+	KDATA2_STAT_REMOVE,        // kdata2_remove_for_uuid
+	KDATA2_STAT_GET,           // kdata2_get
+	KDATA2_STAT_GET_STRING,    // kdata2_get_string
+	KDATA2_STAT_SYNC_COUNT,    // sync: count local changes
+	KDATA2_STAT_SYNC_LIST,     // sync: list remote changes
+	KDATA2_STAT_SYNC_UPLOAD,   // sync: upload one change
+	KDATA2_STAT_SYNC_DOWNLOAD, // sync: download one change
+	KDATA2_STAT_SYNC_APPLY,    // sync: apply one change
+	KDATA2_STAT_COUNT
+};
+
+struct kdata2_stats;
+
+/* statement span reported by tracing */
+struct kdata2_span {
+	const char *api;               // name of kdata2 API call which 
+	                               // ran statement (or NULL)
+	const char *sql;               // statement SQL
+	uint64_t duration_ns;          // statement wall time
+	int vm_steps;                  // SQLite virtual machine steps
+	int rows;                      // number of rows returned
+};
+
 /* this is kdata2 database */
 typedef struct kdata2 {
 	sqlite3 *db;                   // sqlite3 database pointer
@@ -73,6 +125,20 @@ typedef struct kdata2 {
 			void *on_log_data,
 			const char *message    // log message
 			);
+	int log_level;                 // enum KDATA2_LOG_LEVEL
+	struct kdata2_log_queue *log_queue; // async log delivery
+	int log_producers;             // threads which push to log_queue
+	int stats_enabled;             // collect stats
+	struct kdata2_stats *stats;    // per-operation counters
+	void *trace_data;              // pointer to transfer through on_trace
+	void (*on_trace)(              // callback on each finished statement
+			void *trace_data,
+			const struct kdata2_span *span);
+	int slow_query_ms;             // slow query threshold (0 - off)
+	struct kdata2_slow_queries *slow_queries; // slow query log
+	struct kdata2_listener *listeners; // on_change callbacks
+	int listeners_lock;            // serializes add and remove
+	int listeners_calls;           // threads which call listeners
 } kdata2_t;
 
 /* init function */
@@ -87,6 +153,143 @@ kdata2_init(
 		...							  // kdata2_table, NULL
 );
 
+/* set log level (KDATA2_LOG_INFO by default). Each executed SQL
+ * statement is passed to on_log with KDATA2_LOG_DEBUG only - older
+ * versions passed all of them, set KDATA2_LOG_DEBUG to keep them */
+int EXPORTDLL 
+kdata2_set_log_level(kdata2_t *database, enum KDATA2_LOG_LEVEL level);
+
+/* deliver on_log and on_error messages from background thread 
+ * through lock-free ring buffer with capacity of messages (rounded
+ * up to power of 2); set capacity to 0 to deliver messages 
+ * synchronously (default) */
+int EXPORTDLL 
+kdata2_set_log_async(kdata2_t *database, int capacity);
+
+/* deliver log message with level to on_log/on_error callback */
+void EXPORTDLL
+kdata2_log(kdata2_t *database, enum KDATA2_LOG_LEVEL level, 
+		const char *message);
+
+/* snapshot of operation counters, latency in microseconds */
+struct kdata2_stat_snapshot {
+	enum KDATA2_STAT op;
+	const char *name;              // operation name
+	uint64_t count;                // number of calls
+	double sum_us;
+	double min_us;
+	double max_us;
+	double p50_us;
+	double p90_us;
+	double p99_us;
+	double p999_us;
+};
+
+enum KDATA2_STATS_FORMAT {
+	KDATA2_STATS_JSON,
+	KDATA2_STATS_PROMETHEUS        // text exposition format
+};
+
+/* start (enable = 1) or stop (enable = 0) collecting stats.
+ * Threads write to a fixed number of shards assigned on first
+ * use, so with many threads some of them share a shard - the
+ * counters of a shared shard are updated with atomics and stay
+ * exact, only the writers contend */
+int EXPORTDLL
+kdata2_stats_enable(kdata2_t *database, int enable);
+
+/* clear all counters */
+void EXPORTDLL
+kdata2_stats_reset(kdata2_t *database);
+
+/* fill snapshot of counters for operation */
+int EXPORTDLL
+kdata2_stats_snapshot(
+		kdata2_t *database, 
+		enum KDATA2_STAT op,
+		struct kdata2_stat_snapshot *snapshot);
+
+/* return allocated string with all counters in format */
+char EXPORTDLL *
+kdata2_stats_export(
+		kdata2_t *database, enum KDATA2_STATS_FORMAT format);
+
+/* return name of operation */
+const char EXPORTDLL *
+kdata2_stat_name(enum KDATA2_STAT op);
+
+/* trace each SQL statement with sqlite3_trace_v2: on_trace 
+ * is called in thread which ran statement after it finished;
+ * set on_trace to NULL to stop tracing */
+int EXPORTDLL
+kdata2_set_trace(
+		kdata2_t *database,
+		void *trace_data,
+		void (*on_trace)(
+			void *trace_data, const struct kdata2_span *span));
+
+/* callback after row is changed */
+struct kdata2_listener {
+	void *on_change_data;          // pointer to transfer through on_change
+	void (*on_change)(             // NULL ends list
+			void *on_change_data,
+			const char *tablename);
+};
+
+/* add on_change to listeners which are called after row is
+ * changed with set or remove function (in thread which
+ * changed row) - sync module uploads changes without
+ * polling */
+int EXPORTDLL
+kdata2_add_on_change(
+		kdata2_t *database,
+		void *on_change_data,
+		void (*on_change)(
+			void *on_change_data, const char *tablename));
+
+/* remove listener added with the same data and callback -
+ * return when no thread calls it (do not call from
+ * on_change). Return -1 if listener is not found */
+int EXPORTDLL
+kdata2_remove_on_change(
+		kdata2_t *database,
+		void *on_change_data,
+		void (*on_change)(
+			void *on_change_data, const char *tablename));
+
+/* slow query aggregated by normalized SQL */
+struct kdata2_slow_query {
+	const char *sql;               // SQL with literals replaced by '?'
+	const char *plan;              // EXPLAIN QUERY PLAN output or NULL
+	uint64_t count;                // number of slow runs
+	double total_ms;
+	double max_ms;
+	uint64_t rows;                 // total rows returned
+};
+
+/* log statements which run longer then ms milliseconds with
+ * EXPLAIN QUERY PLAN (on_log callback) and aggregate them by
+ * normalized SQL; set ms to 0 to stop */
+int EXPORTDLL
+kdata2_set_slow_query_threshold(kdata2_t *database, int ms);
+
+/* iterate aggregated slow queries; return non zero in callback
+ * to stop; do not call kdata2 functions from callback */
+void EXPORTDLL
+kdata2_slow_queries(
+		kdata2_t *database,
+		void *user_data,
+		int (*callback)(
+			void *user_data, const struct kdata2_slow_query *query));
+
+/* monotonic time in nanoseconds */
+uint64_t EXPORTDLL kdata2_stats_now(void);
+
+/* record operation which started at kdata2_stats_now() */
+void EXPORTDLL
+kdata2_stats_record(
+		kdata2_t *database, enum KDATA2_STAT op, uint64_t start);
+
 /* close database and free memory */
 int EXPORTDLL kdata2_close(kdata2_t *dataset);
 
@@ -175,6 +378,10 @@ char * EXPORTDLL
 kdata2_sql_select_table_request(
 		kdata2_t *d, const char *tablename);
 
+/* cheap check before formatting log message */
+#define kdata2_log_enabled(d, level) \
+	((d)->log_level >= (int)(level))
+
 #define kdata2_sqlite3_for_each(d, sql, stmt) \
 sqlite3_stmt *stmt;\
 int sqlite_step;\
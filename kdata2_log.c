@@ -0,0 +1,287 @@
+/**
+ * File              : kdata2_log.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/*
+ * log levels and async log delivery for kdata2
+ */
+
+/* Conception:
+ * Every ON_LOG/ON_ERR first checks database log_level, so
+ * messages which are not wanted are never formatted.
+ * With kdata2_set_log_async messages are copied into bounded
+ * multi-producer ring buffer (slot sequence numbers, no locks)
+ * and background thread drains it to on_log/on_error
+ * callbacks. If ring is full - log message is dropped and
+ * counted, error message is delivered in caller thread.
+ * Thread sleeps on condition variable when ring is empty -
+ * producer takes mutex only if thread is waiting. Producers
+ * are counted in d->log_producers while they use ring, so
+ * ring is unpublished and freed when no producer holds it */
+
+#include "kdata2.h"
+#include "alloc.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#ifndef KDATA2_LOG_MSG_MAX
+#define KDATA2_LOG_MSG_MAX 1024
+#endif
+
+struct kdata2_log_slot {
+	size_t seq;
+	int level;
+	char message[KDATA2_LOG_MSG_MAX];
+};
+
+struct kdata2_log_queue {
+	struct kdata2_log_slot *slots;
+	size_t mask;
+	size_t head;                   // next slot to write (producers)
+	size_t tail;                   // next slot to read (drain thread)
+	int stop;
+	int waiting;                   // drain thread sleeps
+	unsigned long dropped;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t tid;
+	kdata2_t *d;
+};
+
+static void _deliver(
+		kdata2_t *d, int level, const char *message)
+{
+	if (level == KDATA2_LOG_ERROR){
+		if (d->on_error)
+			d->on_error(d->on_error_data, message);
+	} else {
+		if (d->on_log)
+			d->on_log(d->on_log_data, message);
+	}
+}
+
+static int _queue_push(
+		struct kdata2_log_queue *q, int level, const char *message)
+{
+	struct kdata2_log_slot *slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &q->slots[pos & q->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(
+						&q->head, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return -1; // full
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->level = level;
+	strncpy(slot->message, message, KDATA2_LOG_MSG_MAX - 1);
+	slot->message[KDATA2_LOG_MSG_MAX - 1] = 0;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	// wake drain thread - it checks ring after it sets waiting
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->waiting, __ATOMIC_RELAXED)){
+		pthread_mutex_lock(&q->mutex);
+		pthread_cond_signal(&q->cond);
+		pthread_mutex_unlock(&q->mutex);
+	}
+	return 0;
+}
+
+static int _queue_empty(struct kdata2_log_queue *q)
+{
+	struct kdata2_log_slot *slot = &q->slots[q->tail & q->mask];
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->tail + 1;
+}
+
+/* deliver all messages in queue - return number of delivered */
+static int _queue_drain(kdata2_t *d, struct kdata2_log_queue *q)
+{
+	int count = 0;
+	for (;;) {
+		struct kdata2_log_slot *slot = &q->slots[q->tail & q->mask];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq != q->tail + 1)
+			break; // empty
+		_deliver(d, slot->level, slot->message);
+		__atomic_store_n(&slot->seq, q->tail + q->mask + 1,
+				__ATOMIC_RELEASE);
+		q->tail++;
+		count++;
+	}
+	return count;
+}
+
+static void * _queue_thread(void *data)
+{
+	struct kdata2_log_queue *q = data;
+	kdata2_t *d = q->d;
+
+	while (!__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE)) {
+		if (_queue_drain(d, q))
+			continue;
+		pthread_mutex_lock(&q->mutex);
+		__atomic_store_n(&q->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (_queue_empty(q) && 
+				!__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&q->cond, &q->mutex);
+		__atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&q->mutex);
+	}
+	// flush
+	_queue_drain(d, q);
+
+	pthread_exit(0);
+}
+
+static void _queue_free(kdata2_t *d)
+{
+	struct kdata2_log_queue *q = d->log_queue;
+	if (q == NULL)
+		return;
+
+	// new producers deliver in their threads - wait for
+	// producers which hold ring
+	__atomic_store_n(&d->log_queue, NULL, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&d->log_producers, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	pthread_mutex_lock(&q->mutex);
+	__atomic_store_n(&q->stop, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	pthread_join(q->tid, NULL);
+
+	if (q->dropped && d->on_log &&
+			kdata2_log_enabled(d, KDATA2_LOG_INFO))
+	{
+		char message[64];
+		snprintf(message, sizeof(message),
+				"log queue dropped %lu messages", q->dropped);
+		d->on_log(d->on_log_data, message);
+	}
+
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->mutex);
+	free(q->slots);
+	free(q);
+}
+
+int kdata2_set_log_level(
+		kdata2_t *d, enum KDATA2_LOG_LEVEL level)
+{
+	if (!d)
+		return -1;
+	d->log_level = level;
+	return 0;
+}
+
+int kdata2_set_log_async(kdata2_t *d, int capacity)
+{
+	struct kdata2_log_queue *q;
+	size_t i, size = 1;
+
+	if (!d)
+		return -1;
+
+	// stop running queue
+	_queue_free(d);
+	if (capacity <= 0)
+		return 0;
+
+	while (size < (size_t)capacity)
+		size <<= 1;
+
+	q = NEW(struct kdata2_log_queue);
+	if (q == NULL)
+		return -1;
+
+	q->slots = malloc(size * sizeof(struct kdata2_log_slot));
+	if (q->slots == NULL){
+		free(q);
+		return -1;
+	}
+	for (i = 0; i < size; ++i)
+		q->slots[i].seq = i;
+	q->mask = size - 1;
+
+	if (pthread_mutex_init(&q->mutex, NULL)){
+		free(q->slots);
+		free(q);
+		return -1;
+	}
+	if (pthread_cond_init(&q->cond, NULL)){
+		pthread_mutex_destroy(&q->mutex);
+		free(q->slots);
+		free(q);
+		return -1;
+	}
+
+	q->d = d;
+	d->log_queue = q;
+	if (pthread_create(&q->tid, NULL, _queue_thread, q)){
+		d->log_queue = NULL;
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->mutex);
+		free(q->slots);
+		free(q);
+		return -1;
+	}
+
+	return 0;
+}
+
+void kdata2_log(
+		kdata2_t *d, enum KDATA2_LOG_LEVEL level, const char *message)
+{
+	struct kdata2_log_queue *q;
+
+	if (!d || !message || !kdata2_log_enabled(d, level))
+		return;
+
+	if (__atomic_load_n(&d->log_queue, __ATOMIC_RELAXED) == NULL){
+		_deliver(d, level, message);
+		return;
+	}
+
+	// ring is not freed while producer is counted
+	__atomic_fetch_add(&d->log_producers, 1, __ATOMIC_SEQ_CST);
+	q = __atomic_load_n(&d->log_queue, __ATOMIC_SEQ_CST);
+	if (q && _queue_push(q, level, message) == 0){
+		__atomic_fetch_sub(&d->log_producers, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+	if (q && level != KDATA2_LOG_ERROR){
+		__atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&d->log_producers, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+	__atomic_fetch_sub(&d->log_producers, 1, __ATOMIC_SEQ_CST);
+
+	_deliver(d, level, message);
+}
+
+void _kdata2_log_close(kdata2_t *d)
+{
+	_queue_free(d);
+}
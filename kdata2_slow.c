@@ -0,0 +1,422 @@
+/**
+ * File              : kdata2_slow.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/*
+ * slow query log with EXPLAIN QUERY PLAN capture
+ */
+
+/* Conception:
+ * Statement end is reported by sqlite3_trace_v2 (see
+ * kdata2_trace.c). Statements which run longer then
+ * slow_query_ms are aggregated by normalized SQL (literals
+ * replaced with '?'). SQLite holds database mutex while
+ * trace callback runs - so EXPLAIN QUERY PLAN can not be
+ * done there: new queries are marked as pending and plan is
+ * captured (and aggregated queries are logged) when
+ * outermost kdata2 API call returns or when
+ * kdata2_slow_queries is called */
+
+#include "kdata2.h"
+#include "alloc.h"
+#include "log.h"
+#include "str.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define SLOW_BUCKETS 64
+#define SLOW_MAX     256
+
+struct slow_entry {
+	struct slow_entry *next;
+	uint32_t hash;
+	char *sql;                     // normalized SQL
+	char *sample;                  // first seen SQL
+	char *plan;                    // EXPLAIN QUERY PLAN or NULL
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t rows;
+	int last_rows;
+	int pending;                   // occurrences not logged yet
+	uint64_t pending_max_ns;
+};
+
+struct kdata2_slow_queries {
+	pthread_mutex_t mutex;
+	struct slow_entry *buckets[SLOW_BUCKETS];
+	int count;
+	int pending;
+	unsigned long dropped;
+};
+
+static LOG_THREAD_LOCAL int slow_capturing = 0;
+
+static uint32_t _hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* true if last word in SQL is keyword after which table name
+ * is expected - table names are quoted with '' in kdata2 */
+static int _is_table_keyword(const char *word, int len)
+{
+	static const char *keywords[] = {
+		"FROM", "INTO", "UPDATE", "JOIN", "TABLE", NULL
+	};
+	const char **k;
+	for (k = keywords; *k; k++) {
+		if ((int)strlen(*k) == len && strncasecmp(word, *k, len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* replace literals with '?' and collapse whitespace */
+static char * _normalize(const char *sql)
+{
+	struct str s;
+	const char *p = sql, *word = NULL;
+	int word_len = 0, space = 0;
+
+	if (str_init(&s))
+		return NULL;
+
+	while (*p) {
+		if (isspace((unsigned char)*p)) {
+			space = 1;
+			p++;
+			continue;
+		}
+		if (space && s.len)
+			str_append(&s, " ", 1);
+		space = 0;
+
+		if (*p == '\'') {
+			// string literal or table name
+			const char *start = p++;
+			while (*p) {
+				if (*p == '\'' && p[1] == '\'')
+					p += 2;
+				else if (*p == '\'') {
+					p++;
+					break;
+				}
+				else
+					p++;
+			}
+			if (word && _is_table_keyword(word, word_len))
+				str_append(&s, start, p - start);
+			else
+				str_append(&s, "?", 1);
+			word = NULL;
+			continue;
+		}
+
+		if (isdigit((unsigned char)*p) ||
+				(*p == '-' && isdigit((unsigned char)p[1]) &&
+				 (s.len == 0 || !isalnum((unsigned char)s.str[s.len-1]))))
+		{
+			// number literal
+			p++;
+			while (isalnum((unsigned char)*p) || *p == '.')
+				p++;
+			str_append(&s, "?", 1);
+			word = NULL;
+			continue;
+		}
+
+		if (isalpha((unsigned char)*p) || *p == '_') {
+			const char *start = p;
+			while (isalnum((unsigned char)*p) || *p == '_')
+				p++;
+			word = start;
+			word_len = p - start;
+			str_append(&s, start, word_len);
+			continue;
+		}
+
+		str_append(&s, p, 1);
+		p++;
+	}
+
+	return s.str;
+}
+
+static void _entry_free(struct slow_entry *e)
+{
+	free(e->sql);
+	free(e->sample);
+	free(e->plan);
+	free(e);
+}
+
+/* called from trace callback - must not run SQL */
+void _kdata2_slow_query_add(
+		kdata2_t *d, sqlite3_stmt *stmt, uint64_t ns, int rows)
+{
+	struct kdata2_slow_queries *q = d->slow_queries;
+	struct slow_entry *e;
+	const char *sql;
+	char *normalized;
+	uint32_t hash;
+
+	if (!q || slow_capturing)
+		return;
+
+	sql = sqlite3_sql(stmt);
+	if (!sql)
+		return;
+
+	normalized = _normalize(sql);
+	if (!normalized)
+		return;
+	hash = _hash(normalized);
+
+	pthread_mutex_lock(&q->mutex);
+	for (e = q->buckets[hash % SLOW_BUCKETS]; e; e = e->next) {
+		if (e->hash == hash && strcmp(e->sql, normalized) == 0)
+			break;
+	}
+	if (e == NULL){
+		if (q->count >= SLOW_MAX)
+			goto slow_query_add_drop;
+		e = NEW(struct slow_entry);
+		if (e == NULL)
+			goto slow_query_add_drop;
+		e->hash = hash;
+		e->sql = normalized;
+		e->sample = strdup(sql);
+		normalized = NULL;
+		e->next = q->buckets[hash % SLOW_BUCKETS];
+		q->buckets[hash % SLOW_BUCKETS] = e;
+		q->count++;
+	}
+
+	e->count++;
+	e->total_ns += ns;
+	if (ns > e->max_ns)
+		e->max_ns = ns;
+	e->rows += rows;
+	e->last_rows = rows;
+	if (ns > e->pending_max_ns)
+		e->pending_max_ns = ns;
+	if (e->pending++ == 0)
+		q->pending++;
+
+	pthread_mutex_unlock(&q->mutex);
+	free(normalized);
+	return;
+
+slow_query_add_drop:
+	q->dropped++;
+	pthread_mutex_unlock(&q->mutex);
+	free(normalized);
+}
+
+/* plan of statement - database lock is taken as for other
+ * statements on connection */
+static char * _explain(kdata2_t *d, const char *sql)
+{
+	sqlite3_stmt *stmt = NULL;
+	struct str s, request;
+	int res = SQLITE_ERROR;
+
+	if (str_init(&request))
+		return NULL;
+	str_appendf(&request, "EXPLAIN QUERY PLAN ");
+	str_append(&request, sql, strlen(sql));
+
+	if (str_init(&s)){
+		free(request.str);
+		return NULL;
+	}
+
+	slow_capturing = 1;
+	kdata2_do_in_database_lock(d)
+	{
+		res = sqlite3_prepare_v2(d->db, request.str, -1, &stmt, NULL);
+		while (res == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+			const char *detail =
+				(const char *)sqlite3_column_text(stmt, 3);
+			if (detail){
+				str_appendf(&s, "%s  %s", s.len?"\n":"", detail);
+			}
+		}
+		sqlite3_finalize(stmt);
+	}
+	slow_capturing = 0;
+	free(request.str);
+
+	if (res != SQLITE_OK){
+		free(s.str);
+		return strdup("(no plan)");
+	}
+	return s.str;
+}
+
+/* capture plans and log pending slow queries */
+void _kdata2_slow_queries_flush(kdata2_t *d)
+{
+	struct kdata2_slow_queries *q = d->slow_queries;
+	int i;
+
+	if (!q || slow_capturing ||
+			!__atomic_load_n(&q->pending, __ATOMIC_RELAXED))
+		return;
+
+	for (;;) {
+		struct slow_entry *e = NULL;
+		char *sample = NULL, *plan = NULL;
+		uint64_t max_ns = 0;
+		int count = 0, rows = 0;
+
+		// take one pending entry
+		pthread_mutex_lock(&q->mutex);
+		for (i = 0; i < SLOW_BUCKETS && !e; ++i) {
+			struct slow_entry *p;
+			for (p = q->buckets[i]; p; p = p->next) {
+				if (p->pending){
+					e = p;
+					break;
+				}
+			}
+		}
+		if (e){
+			if (!e->plan)
+				sample = strdup(e->sample);
+			count = e->pending;
+			max_ns = e->pending_max_ns;
+			rows = e->last_rows;
+			e->pending = 0;
+			e->pending_max_ns = 0;
+			q->pending--;
+		}
+		pthread_mutex_unlock(&q->mutex);
+
+		if (!e)
+			break;
+
+		// explain without lock
+		if (sample){
+			plan = _explain(d, sample);
+			free(sample);
+			pthread_mutex_lock(&q->mutex);
+			if (!e->plan){
+				e->plan = plan;
+				plan = NULL;
+			}
+			pthread_mutex_unlock(&q->mutex);
+			free(plan);
+		}
+
+		if (d->on_log && kdata2_log_enabled(d, KDATA2_LOG_INFO)) {
+			struct str s;
+			if (str_init(&s) == 0){
+				str_appendf(&s, "slow query: %.3f ms, %d rows, %d times: ",
+						max_ns / 1e6, rows, count);
+				// entries are never removed while database is open
+				str_append(&s, e->sql, strlen(e->sql));
+				if (e->plan){
+					str_append(&s, "\n", 1);
+					str_append(&s, e->plan, strlen(e->plan));
+				}
+				kdata2_log(d, KDATA2_LOG_INFO, s.str);
+				free(s.str);
+			}
+		}
+	}
+}
+
+int _kdata2_trace_update(kdata2_t *d);
+
+int kdata2_set_slow_query_threshold(kdata2_t *d, int ms)
+{
+	if (!d)
+		return -1;
+
+	if (ms > 0 && d->slow_queries == NULL){
+		struct kdata2_slow_queries *q =
+			NEW(struct kdata2_slow_queries);
+		if (q == NULL)
+			return -1;
+		if (pthread_mutex_init(&q->mutex, NULL)){
+			free(q);
+			return -1;
+		}
+		d->slow_queries = q;
+	}
+
+	d->slow_query_ms = ms > 0?ms:0;
+	return _kdata2_trace_update(d);
+}
+
+void kdata2_slow_queries(
+		kdata2_t *d,
+		void *user_data,
+		int (*callback)(
+			void *user_data, const struct kdata2_slow_query *query))
+{
+	struct kdata2_slow_queries *q;
+	int i;
+
+	if (!d || !callback || !d->slow_queries)
+		return;
+	q = d->slow_queries;
+
+	_kdata2_slow_queries_flush(d);
+
+	pthread_mutex_lock(&q->mutex);
+	for (i = 0; i < SLOW_BUCKETS; ++i) {
+		struct slow_entry *e;
+		for (e = q->buckets[i]; e; e = e->next) {
+			struct kdata2_slow_query query;
+			query.sql      = e->sql;
+			query.plan     = e->plan;
+			query.count    = e->count;
+			query.total_ms = e->total_ns / 1e6;
+			query.max_ms   = e->max_ns / 1e6;
+			query.rows     = e->rows;
+			if (callback(user_data, &query)){
+				pthread_mutex_unlock(&q->mutex);
+				return;
+			}
+		}
+	}
+	pthread_mutex_unlock(&q->mutex);
+}
+
+void _kdata2_slow_queries_close(kdata2_t *d)
+{
+	struct kdata2_slow_queries *q = d->slow_queries;
+	int i;
+
+	if (!q)
+		return;
+	d->slow_queries = NULL;
+	d->slow_query_ms = 0;
+
+	for (i = 0; i < SLOW_BUCKETS; ++i) {
+		struct slow_entry *e = q->buckets[i];
+		while (e) {
+			struct slow_entry *next = e->next;
+			_entry_free(e);
+			e = next;
+		}
+	}
+	pthread_mutex_destroy(&q->mutex);
+	free(q);
+}
@@ -0,0 +1,388 @@
+/**
+ * File              : kdata2_stats.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/*
+ * per-operation counters and latency histograms
+ */
+
+/* Conception:
+ * Threads are assigned to STATS_SHARDS shards round-robin on
+ * first use - writers are spread over shards, but with more
+ * threads then shards some threads share shard. Counters are
+ * updated with relaxed atomics, so no locks are taken on the
+ * hot path and shared shard is only contended.
+ * Histogram is log-linear (HDR-style): 16 sub-buckets for
+ * each power of two of nanoseconds - ~6% precision from
+ * 16 ns to ~4.8 hours. Snapshot sums all shards */
+
+#include "kdata2.h"
+#include "alloc.h"
+#include "log.h"
+#include "str.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define STATS_SHARDS   8
+#define STATS_SUB_BITS 4
+#define STATS_SUB      (1 << STATS_SUB_BITS)
+#define STATS_MAX_MSB  43
+#define STATS_BUCKETS  ((STATS_MAX_MSB - STATS_SUB_BITS + 2) * STATS_SUB)
+
+struct kdata2_stat_counter {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+struct kdata2_stats_shard {
+	struct kdata2_stat_counter ops[KDATA2_STAT_COUNT];
+};
+
+struct kdata2_stats {
+	struct kdata2_stats_shard *shards[STATS_SHARDS];
+};
+
+static const char *stat_names[KDATA2_STAT_COUNT] = {
+	"set_number",
+	"set_float",
+	"set_text",
+	"set_data",
+	"remove",
+	"get",
+	"get_string",
+	"sync_count",
+	"sync_list",
+	"sync_upload",
+	"sync_download",
+	"sync_apply",
+};
+
+void _kdata2_trace_push(enum KDATA2_STAT op);
+void _kdata2_trace_pop(void);
+int  _kdata2_trace_current(void);
+void _kdata2_slow_queries_flush(kdata2_t *d);
+
+static int next_shard = 0;
+static LOG_THREAD_LOCAL int thread_shard = -1;
+
+/* index of most significant bit of v (v > 0) */
+static int _msb(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return 63 - __builtin_clzll(v);
+#else
+	int msb = 0;
+	while (v >>= 1)
+		msb++;
+	return msb;
+#endif
+}
+
+static int _bucket_index(uint64_t v)
+{
+	int msb, shift;
+
+	if (v < STATS_SUB)
+		return (int)v;
+
+	msb = _msb(v);
+	if (msb > STATS_MAX_MSB)
+		return STATS_BUCKETS - 1;
+
+	shift = msb - STATS_SUB_BITS;
+	return (shift + 1) * STATS_SUB +
+		(int)((v >> shift) & (STATS_SUB - 1));
+}
+
+/* highest value in bucket */
+static uint64_t _bucket_value(int index)
+{
+	int shift, sub;
+
+	if (index < STATS_SUB)
+		return index;
+
+	shift = index / STATS_SUB - 1;
+	sub = index % STATS_SUB;
+	return (((uint64_t)(STATS_SUB + sub)) << shift) +
+		(((uint64_t)1) << shift) - 1;
+}
+
+uint64_t kdata2_stats_now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)((double)count.QuadPart * 1e9 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+int kdata2_stats_enable(kdata2_t *d, int enable)
+{
+	struct kdata2_stats *stats;
+	int i;
+
+	if (!d)
+		return -1;
+
+	if (!enable){
+		// keep allocated data - other threads may still write
+		d->stats_enabled = 0;
+		return 0;
+	}
+
+	if (d->stats == NULL){
+		stats = NEW(struct kdata2_stats);
+		if (stats == NULL)
+			return -1;
+		for (i = 0; i < STATS_SHARDS; ++i) {
+			stats->shards[i] = NEW(struct kdata2_stats_shard);
+			if (stats->shards[i] == NULL){
+				while (i--)
+					free(stats->shards[i]);
+				free(stats);
+				return -1;
+			}
+		}
+		d->stats = stats;
+	}
+
+	d->stats_enabled = 1;
+	return 0;
+}
+
+void kdata2_stats_record(
+		kdata2_t *d, enum KDATA2_STAT op, uint64_t start)
+{
+	struct kdata2_stat_counter *c;
+	uint64_t ns, old;
+
+	if (!d || !d->stats_enabled || !d->stats || !start)
+		return;
+	if (op < 0 || op >= KDATA2_STAT_COUNT)
+		return;
+
+	ns = kdata2_stats_now() - start;
+
+	if (thread_shard < 0)
+		thread_shard = __atomic_fetch_add(
+				&next_shard, 1, __ATOMIC_RELAXED) % STATS_SHARDS;
+	c = &d->stats->shards[thread_shard]->ops[op];
+
+	__atomic_fetch_add(&c->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->sum, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->buckets[_bucket_index(ns)], 1,
+			__ATOMIC_RELAXED);
+
+	old = __atomic_load_n(&c->max, __ATOMIC_RELAXED);
+	while (ns > old &&
+			!__atomic_compare_exchange_n(&c->max, &old, ns, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	old = __atomic_load_n(&c->min, __ATOMIC_RELAXED);
+	while ((old == 0 || ns < old) &&
+			!__atomic_compare_exchange_n(&c->min, &old, ns, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void kdata2_stats_reset(kdata2_t *d)
+{
+	int i;
+	if (!d || !d->stats)
+		return;
+	for (i = 0; i < STATS_SHARDS; ++i)
+		memset(d->stats->shards[i], 0,
+				sizeof(struct kdata2_stats_shard));
+}
+
+static uint64_t _percentile(
+		const uint64_t *buckets, uint64_t count, double p)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (count == 0)
+		return 0;
+
+	rank = (uint64_t)(p * count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < STATS_BUCKETS; ++i) {
+		seen += buckets[i];
+		if (seen >= rank)
+			return _bucket_value(i);
+	}
+	return _bucket_value(STATS_BUCKETS - 1);
+}
+
+int kdata2_stats_snapshot(
+		kdata2_t *d, enum KDATA2_STAT op,
+		struct kdata2_stat_snapshot *s)
+{
+	uint64_t *buckets, sum = 0;
+	int i, j;
+
+	if (!d || !s || op < 0 || op >= KDATA2_STAT_COUNT)
+		return -1;
+
+	memset(s, 0, sizeof(struct kdata2_stat_snapshot));
+	s->op = op;
+	s->name = stat_names[op];
+
+	if (!d->stats)
+		return 0;
+
+	buckets = MALLOC(STATS_BUCKETS * sizeof(uint64_t));
+	if (buckets == NULL)
+		return -1;
+
+	for (i = 0; i < STATS_SHARDS; ++i) {
+		struct kdata2_stat_counter *c = &d->stats->shards[i]->ops[op];
+		uint64_t min = __atomic_load_n(&c->min, __ATOMIC_RELAXED);
+		uint64_t max = __atomic_load_n(&c->max, __ATOMIC_RELAXED);
+		s->count += __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+		sum      += __atomic_load_n(&c->sum, __ATOMIC_RELAXED);
+		if (min && (s->min_us == 0 || min / 1000.0 < s->min_us))
+			s->min_us = min / 1000.0;
+		if (max / 1000.0 > s->max_us)
+			s->max_us = max / 1000.0;
+		for (j = 0; j < STATS_BUCKETS; ++j)
+			buckets[j] += __atomic_load_n(&c->buckets[j],
+					__ATOMIC_RELAXED);
+	}
+
+	s->sum_us  = sum / 1000.0;
+	s->p50_us  = _percentile(buckets, s->count, 0.50) / 1000.0;
+	s->p90_us  = _percentile(buckets, s->count, 0.90) / 1000.0;
+	s->p99_us  = _percentile(buckets, s->count, 0.99) / 1000.0;
+	s->p999_us = _percentile(buckets, s->count, 0.999) / 1000.0;
+
+	// bucket bound may be above real maximum
+	if (s->p50_us > s->max_us)  s->p50_us  = s->max_us;
+	if (s->p90_us > s->max_us)  s->p90_us  = s->max_us;
+	if (s->p99_us > s->max_us)  s->p99_us  = s->max_us;
+	if (s->p999_us > s->max_us) s->p999_us = s->max_us;
+
+	free(buckets);
+	return 0;
+}
+
+char * kdata2_stats_export(
+		kdata2_t *d, enum KDATA2_STATS_FORMAT format)
+{
+	struct str s;
+	int op, first = 1;
+
+	if (!d)
+		return NULL;
+
+	if (str_init(&s))
+		return NULL;
+
+	if (format == KDATA2_STATS_JSON)
+		str_appendf(&s, "{");
+	else
+		str_appendf(&s,
+				"# HELP kdata2_op_duration_seconds "
+				"kdata2 operation latency\n"
+				"# TYPE kdata2_op_duration_seconds summary\n");
+
+	for (op = 0; op < KDATA2_STAT_COUNT; ++op) {
+		struct kdata2_stat_snapshot ss;
+		if (kdata2_stats_snapshot(d, op, &ss))
+			continue;
+
+		if (format == KDATA2_STATS_JSON) {
+			str_appendf(&s,
+					"%s\"%s\":{\"count\":%llu,\"sum_us\":%.3f,"
+					"\"min_us\":%.3f,\"max_us\":%.3f,"
+					"\"p50_us\":%.3f,\"p90_us\":%.3f,"
+					"\"p99_us\":%.3f,\"p999_us\":%.3f}",
+					first?"":",", ss.name,
+					(unsigned long long)ss.count, ss.sum_us,
+					ss.min_us, ss.max_us, ss.p50_us, ss.p90_us,
+					ss.p99_us, ss.p999_us);
+			first = 0;
+		} else {
+			str_appendf(&s,
+					"kdata2_op_duration_seconds{op=\"%s\",quantile=\"0.5\"} %.9f\n"
+					"kdata2_op_duration_seconds{op=\"%s\",quantile=\"0.9\"} %.9f\n"
+					"kdata2_op_duration_seconds{op=\"%s\",quantile=\"0.99\"} %.9f\n"
+					"kdata2_op_duration_seconds{op=\"%s\",quantile=\"0.999\"} %.9f\n"
+					"kdata2_op_duration_seconds_sum{op=\"%s\"} %.9f\n"
+					"kdata2_op_duration_seconds_count{op=\"%s\"} %llu\n",
+					ss.name, ss.p50_us / 1e6,
+					ss.name, ss.p90_us / 1e6,
+					ss.name, ss.p99_us / 1e6,
+					ss.name, ss.p999_us / 1e6,
+					ss.name, ss.sum_us / 1e6,
+					ss.name, (unsigned long long)ss.count);
+		}
+	}
+
+	if (format == KDATA2_STATS_JSON)
+		str_appendf(&s, "}");
+
+	return s.str;
+}
+
+const char * kdata2_stat_name(enum KDATA2_STAT op)
+{
+	if (op < 0 || op >= KDATA2_STAT_COUNT)
+		return NULL;
+	return stat_names[op];
+}
+
+/* start measured API call - return 0 if nothing to measure */
+uint64_t _kdata2_api_enter(kdata2_t *d, enum KDATA2_STAT op)
+{
+	if (!d || (!d->stats_enabled && !d->on_trace && 
+				!d->slow_query_ms))
+		return 0;
+	_kdata2_trace_push(op);
+	return kdata2_stats_now();
+}
+
+void _kdata2_api_leave(
+		kdata2_t *d, enum KDATA2_STAT op, uint64_t start)
+{
+	if (!start)
+		return;
+	_kdata2_trace_pop();
+	kdata2_stats_record(d, op, start);
+
+	// outermost call - safe to run EXPLAIN for slow queries
+	if (_kdata2_trace_current() < 0)
+		_kdata2_slow_queries_flush(d);
+}
+
+void _kdata2_stats_close(kdata2_t *d)
+{
+	int i;
+	if (!d || !d->stats)
+		return;
+	d->stats_enabled = 0;
+	for (i = 0; i < STATS_SHARDS; ++i)
+		free(d->stats->shards[i]);
+	free(d->stats);
+	d->stats = NULL;
+}
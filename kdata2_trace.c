@@ -0,0 +1,182 @@
+/**
+ * File              : kdata2_trace.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/*
+ * per-statement tracing with sqlite3_trace_v2
+ */
+
+/* Conception:
+ * Each measured public API call pushes its operation to
+ * thread-local stack. SQLite reports rows (SQLITE_TRACE_ROW)
+ * and statement end (SQLITE_TRACE_PROFILE) in the thread
+ * which runs statement - so top of stack is kdata2 API which
+ * called statement. Start time (SQLITE_TRACE_STMT) and rows 
+ * are kept per statement in small thread-local table - SQLite
+ * profile time has only millisecond resolution. VM steps are
+ * taken from statement status. On statement end span is sent
+ * to on_trace and to slow query log (kdata2_slow.c) */
+
+#include "kdata2.h"
+#include "log.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void _kdata2_slow_query_add(
+		kdata2_t *d, sqlite3_stmt *stmt, uint64_t ns, int rows);
+
+#define TRACE_STACK 16
+#define TRACE_STMTS 16
+
+struct trace_rows {
+	sqlite3_stmt *stmt;
+	int rows;
+	uint64_t start;
+};
+
+static LOG_THREAD_LOCAL int trace_depth = 0;
+static LOG_THREAD_LOCAL int trace_stack[TRACE_STACK];
+static LOG_THREAD_LOCAL struct trace_rows trace_rows[TRACE_STMTS];
+
+void _kdata2_trace_push(enum KDATA2_STAT op)
+{
+	if (trace_depth < TRACE_STACK)
+		trace_stack[trace_depth] = op;
+	trace_depth++;
+}
+
+void _kdata2_trace_pop(void)
+{
+	if (trace_depth > 0)
+		trace_depth--;
+}
+
+/* operation of innermost kdata2 API call or -1 */
+int _kdata2_trace_current(void)
+{
+	if (trace_depth == 0)
+		return -1;
+	if (trace_depth > TRACE_STACK)
+		return trace_stack[TRACE_STACK - 1];
+	return trace_stack[trace_depth - 1];
+}
+
+static struct trace_rows * _rows_for_stmt(
+		sqlite3_stmt *stmt, int create)
+{
+	int i;
+	struct trace_rows *empty = NULL;
+
+	for (i = 0; i < TRACE_STMTS; ++i) {
+		if (trace_rows[i].stmt == stmt)
+			return &trace_rows[i];
+		if (!empty && trace_rows[i].stmt == NULL)
+			empty = &trace_rows[i];
+	}
+	if (!create)
+		return NULL;
+
+	// too many open statements - reuse first slot
+	if (!empty)
+		empty = &trace_rows[0];
+
+	empty->stmt = stmt;
+	empty->rows = 0;
+	empty->start = 0;
+	return empty;
+}
+
+static int _trace_callback(
+		unsigned type, void *ctx, void *p, void *x)
+{
+	kdata2_t *d = ctx;
+	sqlite3_stmt *stmt = p;
+
+	switch (type) {
+		case SQLITE_TRACE_STMT:
+			{
+				struct trace_rows *r = _rows_for_stmt(stmt, 1);
+				if (r->start == 0)
+					r->start = kdata2_stats_now();
+				break;
+			}
+		case SQLITE_TRACE_ROW:
+			{
+				struct trace_rows *r = _rows_for_stmt(stmt, 1);
+				r->rows++;
+				break;
+			}
+		case SQLITE_TRACE_PROFILE:
+			{
+				struct kdata2_span span;
+				struct trace_rows *r = _rows_for_stmt(stmt, 0);
+				int op = _kdata2_trace_current();
+
+				span.api = op < 0?NULL:kdata2_stat_name(op);
+				span.sql = sqlite3_sql(stmt);
+				span.duration_ns = *(sqlite3_int64 *)x;
+				span.vm_steps = sqlite3_stmt_status(
+						stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+				span.rows = 0;
+				if (r){
+					span.rows = r->rows;
+					if (r->start)
+						span.duration_ns = kdata2_stats_now() - r->start;
+					r->stmt = NULL;
+				}
+
+				if (d->slow_query_ms && 
+						span.duration_ns >= d->slow_query_ms * 1000000ULL)
+					_kdata2_slow_query_add(
+							d, stmt, span.duration_ns, span.rows);
+
+				if (d->on_trace)
+					d->on_trace(d->trace_data, &span);
+				break;
+			}
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+/* register trace callback if tracing or slow query log is on */
+int _kdata2_trace_update(kdata2_t *d)
+{
+	int res;
+
+	if (!d->db)
+		return -1;
+
+	if (d->on_trace || d->slow_query_ms)
+		res = sqlite3_trace_v2(d->db,
+				SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE | 
+				SQLITE_TRACE_ROW,
+				_trace_callback, d);
+	else
+		res = sqlite3_trace_v2(d->db, 0, NULL, NULL);
+
+	return res == SQLITE_OK?0:-1;
+}
+
+int kdata2_set_trace(
+		kdata2_t *d,
+		void *trace_data,
+		void (*on_trace)(
+			void *trace_data, const struct kdata2_span *span))
+{
+	if (!d)
+		return -1;
+
+	d->trace_data = trace_data;
+	d->on_trace   = on_trace;
+
+	return _kdata2_trace_update(d);
+}
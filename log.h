@@ -39,7 +39,15 @@ extern "C" {
 #include <string.h>
 #include <stdarg.h>
 
-static char __buf[BUFSIZ];
+/* STR() formats into per-thread buffer, so messages from
+ * different threads do not overwrite each other */
+#ifdef _MSC_VER
+#define LOG_THREAD_LOCAL __declspec(thread)
+#else
+#define LOG_THREAD_LOCAL __thread
+#endif
+
+static LOG_THREAD_LOCAL char __buf[BUFSIZ];
 
 static char *STR(const char *fmt, ...) {
 	va_list args;
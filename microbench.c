@@ -0,0 +1,242 @@
+/**
+ * File              : microbench.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 18.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/*
+ * micro-benchmarks for sync hot path kernels: base64, cJSON
+ * and uuid4
+ * usage: kdata2_microbench [-s size,size,...] [-t min_ms] [-w warmup]
+ * each kernel is run warmup times, then repeated until it
+ * takes at least min_ms (and at least 3 times); results are
+ * printed to stdout as JSON
+ */
+
+#include "kdata2.h"
+#include "cJSON.h"
+#include "uuid4.h"
+#include "str.h"
+#include "modules/yandexdisk/base64.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct mbench {
+	int warmup;
+	int min_ms;
+	struct str out;
+	int first;
+};
+
+/* keep results alive - compiler may drop malloc/free pairs */
+static volatile unsigned char sink;
+
+/* kernel runs once on data with size bytes */
+typedef void (*kernel_t)(void *data, size_t size);
+
+struct kernel_data {
+	unsigned char *raw;            // random bytes
+	char *base64;                  // base64 of raw
+	size_t base64_len;
+	char *json;                    // printed JSON object
+	size_t json_len;
+	cJSON *object;                 // parsed JSON object
+};
+
+static void k_base64_encode(void *data, size_t size)
+{
+	struct kernel_data *k = data;
+	size_t len;
+	char *out = base64_encode(k->raw, size, &len);
+	if (out)
+		sink = out[len - 1];
+	free(out);
+}
+
+static void k_base64_decode(void *data, size_t size)
+{
+	struct kernel_data *k = data;
+	size_t len;
+	unsigned char *out = base64_decode(k->base64, k->base64_len, &len);
+	if (out)
+		sink = out[len - 1];
+	free(out);
+}
+
+static void k_json_print(void *data, size_t size)
+{
+	struct kernel_data *k = data;
+	char *out = cJSON_Print(k->object);
+	if (out)
+		sink = out[0];
+	free(out);
+}
+
+static void k_json_print_unformatted(void *data, size_t size)
+{
+	struct kernel_data *k = data;
+	char *out = cJSON_PrintUnformatted(k->object);
+	if (out)
+		sink = out[0];
+	free(out);
+}
+
+static void k_json_parse(void *data, size_t size)
+{
+	struct kernel_data *k = data;
+	cJSON_Delete(cJSON_ParseWithLength(k->json, k->json_len));
+}
+
+static void k_uuid4(void *data, size_t size)
+{
+	char uuid[UUID4_LEN];
+	uuid4_generate(uuid);
+	sink = uuid[0];
+}
+
+/* row-like object: text and number columns with about size
+ * bytes of text */
+static cJSON * make_object(size_t size)
+{
+	cJSON *object = cJSON_CreateObject();
+	char name[32], text[101];
+	size_t i, n = size / 100 + 1;
+
+	memset(text, 'a', 100);
+	text[100] = 0;
+
+	for (i = 0; i < n; ++i) {
+		sprintf(name, "column%zu", i);
+		if (i % 2)
+			cJSON_AddItemToObject(object, name,
+					cJSON_CreateNumber((double)i));
+		else
+			cJSON_AddItemToObject(object, name,
+					cJSON_CreateString(text));
+	}
+	return object;
+}
+
+static void mbench_run(
+		struct mbench *m, const char *name,
+		kernel_t kernel, void *data, size_t size)
+{
+	int i, reps = 0;
+	uint64_t start, ns;
+
+	for (i = 0; i < m->warmup; ++i)
+		kernel(data, size);
+
+	start = kdata2_stats_now();
+	do {
+		kernel(data, size);
+		reps++;
+		ns = kdata2_stats_now() - start;
+	} while (reps < 3 || ns < (uint64_t)m->min_ms * 1000000ULL);
+
+	str_appendf(&m->out,
+			"%s\n    {\"name\": \"%s\", \"size\": %zu, \"reps\": %d, "
+			"\"ns_per_op\": %.1f, \"bytes_per_sec\": %.1f}",
+			m->first?"":",", name, size, reps,
+			(double)ns / reps, (double)size * reps * 1e9 / ns);
+	m->first = 0;
+
+	fprintf(stderr, "%-24s %10zu B %14.1f ns/op %10.1f MB/s\n",
+			name, size, (double)ns / reps,
+			(double)size * reps * 1e3 / ns);
+}
+
+static int mbench_size(struct mbench *m, size_t size)
+{
+	struct kernel_data k;
+	size_t i;
+
+	memset(&k, 0, sizeof(k));
+	k.raw = malloc(size);
+	if (!k.raw)
+		return -1;
+	for (i = 0; i < size; ++i)
+		k.raw[i] = rand();
+
+	k.base64 = base64_encode(k.raw, size, &k.base64_len);
+	k.object = make_object(size);
+	if (k.object)
+		k.json = cJSON_Print(k.object);
+	if (!k.base64 || !k.json){
+		free(k.raw);
+		free(k.base64);
+		cJSON_Delete(k.object);
+		return -1;
+	}
+	k.json_len = strlen(k.json);
+
+	mbench_run(m, "base64_encode", k_base64_encode, &k, size);
+	mbench_run(m, "base64_decode", k_base64_decode, &k, k.base64_len);
+	mbench_run(m, "cjson_print", k_json_print, &k, k.json_len);
+	mbench_run(m, "cjson_print_unformatted",
+			k_json_print_unformatted, &k, k.json_len);
+	mbench_run(m, "cjson_parse", k_json_parse, &k, k.json_len);
+
+	free(k.raw);
+	free(k.base64);
+	free(k.json);
+	cJSON_Delete(k.object);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct mbench m;
+	const char *sizes = "100,1000,10000,100000,1000000,10000000,50000000";
+	char *list, *token, *p;
+	int opt;
+
+	memset(&m, 0, sizeof(m));
+	m.warmup = 2;
+	m.min_ms = 200;
+	m.first = 1;
+
+	while ((opt = getopt(argc, argv, "s:t:w:h")) != -1) {
+		switch (opt) {
+			case 's': sizes = optarg; break;
+			case 't': m.min_ms = atoi(optarg); break;
+			case 'w': m.warmup = atoi(optarg); break;
+			default:
+				fprintf(stderr,
+						"usage: %s [-s size,size,...] [-t min_ms] "
+						"[-w warmup]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (str_init(&m.out))
+		return 1;
+	str_appendf(&m.out, "{\n  \"results\": [");
+
+	uuid4_init();
+	mbench_run(&m, "uuid4_generate", k_uuid4, NULL, UUID4_LEN - 1);
+
+	list = strdup(sizes);
+	for (token = strtok_r(list, ",", &p); token;
+			token = strtok_r(NULL, ",", &p))
+	{
+		size_t size = strtoul(token, NULL, 10);
+		if (size < 1)
+			continue;
+		if (mbench_size(&m, size)){
+			fprintf(stderr, "can't allocate data for size %zu\n", size);
+			return 1;
+		}
+	}
+	free(list);
+
+	str_appendf(&m.out, "\n  ]\n}\n");
+	printf("%s", m.out.str);
+	free(m.out.str);
+
+	return 0;
+}
@@ -0,0 +1,19 @@
+/**
+ * File              : backend.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 19.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/*
+ * functions of all remote storage backends
+ */
+
+#include "backend.h"
+
+void kdata_backend_free(kdbackend_t *b)
+{
+	if (b && b->free)
+		b->free(b);
+}
@@ -0,0 +1,112 @@
+/**
+ * File              : backend.h
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 18.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/**
+ * backend.h
+ * Copyright (c) 2026 Igor V. Sementsov <ig.kuzm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Remote storage backend for sync module */
+
+/* Conception:
+ * Sync algorithm (upload.c, download.c) does not call
+ * storage directly - it calls functions of backend. Paths
+ * are given in Yandex Disk form: "app:/updates/name".
+ * Backends:
+ * 1. Yandex Disk - yandex_disk_backend_new
+ * 2. local directory (or mounted LAN share) - app:/ is
+ * mapped to root directory. Latency and bandwidth may be
+ * injected to emulate network - local_backend_new
+ * Errors are returned as nonzero result and allocated
+ * string in error (if not NULL) - caller should free it
+ */
+
+#ifndef KDATA2_BACKEND_H
+#define KDATA2_BACKEND_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kdata_backend kdbackend_t;
+
+struct kdata_backend {
+	void *data;                    // backend private data
+
+	void *progressp;               // file progress
+	int (*progress)(
+			void *clientp,
+			double dltotal,
+			double dlnow,
+			double ultotal,
+			double ulnow);
+
+	// upload buffer to path (overwrite if exists)
+	int (*put)(
+			kdbackend_t *b, const char *path,
+			const void *buf, size_t size, char **error);
+
+	// download path to allocated buffer
+	int (*get)(
+			kdbackend_t *b, const char *path,
+			void **buf, size_t *size, char **error);
+
+	// list file names in directory sorted by name in
+	// descending order - callback returns nonzero to stop
+	int (*list_sorted)(
+			kdbackend_t *b, const char *path, void *user_data,
+			int (*callback)(void *user_data, const char *name),
+			char **error);
+
+	int (*mkdir)(kdbackend_t *b, const char *path, char **error);
+
+	int (*remove)(kdbackend_t *b, const char *path, char **error);
+
+	// optional - return 1 if path exists, 0 if not and -1 on
+	// error
+	int (*exists)(kdbackend_t *b, const char *path);
+
+	// optional - NULL if backend has no token
+	int (*set_token)(kdbackend_t *b, const char *token);
+
+	void (*free)(kdbackend_t *b);
+};
+
+/* Yandex Disk backend */
+kdbackend_t *
+yandex_disk_backend_new(const char *access_token);
+
+/* local directory backend
+ * latency_ms - delay added to each call
+ * bandwidth  - bytes per second for put/get (0 - unlimited) */
+kdbackend_t *
+local_backend_new(const char *root, int latency_ms, long bandwidth);
+
+void
+kdata_backend_free(kdbackend_t *b);
+
+#ifdef __cplusplus
+}  /* end of the 'extern "C"' block */
+#endif
+
+#endif /* ifndef KDATA2_BACKEND_H */
@@ -0,0 +1,380 @@
+/**
+ * File              : backend_local.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/*
+ * local directory remote storage backend with latency and
+ * bandwidth injection
+ */
+
+#include "backend.h"
+#include "cYandexDisk/alloc.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#else
+#include <unistd.h>
+#endif
+
+struct local_backend {
+	char root[BUFSIZ];
+	int latency_ms;
+	long bandwidth;                // bytes per second
+};
+
+static void _sleep_ms(long ms)
+{
+	if (ms <= 0)
+		return;
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+/* emulate network delay for transfer of size bytes */
+static void _delay(struct local_backend *l, size_t size)
+{
+	long ms = l->latency_ms;
+	if (l->bandwidth > 0)
+		ms += (long)((double)size * 1000 / l->bandwidth);
+	_sleep_ms(ms);
+}
+
+/* app:/dir/name -> root/dir/name (empty if too long - it
+ * is not opened) */
+static char * _local_path(
+		struct local_backend *l, const char *path, char out[BUFSIZ])
+{
+	int len;
+	if (strncmp(path, "app:/", 5) == 0)
+		path += 5;
+	while (*path == '/')
+		path++;
+	len = snprintf(out, BUFSIZ, "%s/%s", l->root, path);
+	if (len < 0 || len >= BUFSIZ)
+		out[0] = 0;
+	return out;
+}
+
+static char * _errno_error(const char *msg, const char *path)
+{
+	char error[BUFSIZ];
+	int len = snprintf(error, BUFSIZ, "%s: %s: %s", 
+			msg, path, strerror(errno));
+	// long path is cut
+	if (len < 0)
+		return strdup(msg);
+	return strdup(error);
+}
+
+/* create and open file with unique name from template
+ * (ends with XXXXXX) */
+static FILE * _tmpfile(char *template)
+{
+#ifdef _WIN32
+	if (_mktemp(template) == NULL)
+		return NULL;
+	return fopen(template, "wbx");
+#else
+	FILE *fp;
+	int fd = mkstemp(template);
+	if (fd < 0)
+		return NULL;
+	// mkstemp file is private - remote is shared
+	fchmod(fd, 0644);
+	fp = fdopen(fd, "wb");
+	if (fp == NULL){
+		close(fd);
+		remove(template);
+	}
+	return fp;
+#endif
+}
+
+static int _put(
+		kdbackend_t *b, const char *path,
+		const void *buf, size_t size, char **error)
+{
+	struct local_backend *l = b->data;
+	char filepath[BUFSIZ];
+	char tmppath[BUFSIZ];
+	const char *name;
+	FILE *fp;
+	int len;
+
+	_local_path(l, path, filepath);
+	_delay(l, size);
+
+	// write to unique temp file (hidden - not listed) in the
+	// same directory and rename - readers never see partial
+	// files and writers of the same file do not share temp
+	name = strrchr(filepath, '/');
+	name = name?name + 1:filepath;
+	len = snprintf(tmppath, BUFSIZ, "%.*s.%s.XXXXXX",
+			(int)(name - filepath), filepath, name);
+	if (len < 0 || len >= BUFSIZ){
+		if (error)
+			*error = strdup("path is too long");
+		return -1;
+	}
+	fp = _tmpfile(tmppath);
+	if (fp == NULL){
+		if (error)
+			*error = _errno_error("can't open file", tmppath);
+		return -1;
+	}
+	if (size && fwrite(buf, size, 1, fp) != 1){
+		if (error)
+			*error = _errno_error("can't write file", tmppath);
+		fclose(fp);
+		remove(tmppath);
+		return -1;
+	}
+	fclose(fp);
+
+#ifdef _WIN32
+	remove(filepath);
+#endif
+	if (rename(tmppath, filepath)){
+		if (error)
+			*error = _errno_error("can't rename file", tmppath);
+		remove(tmppath);
+		return -1;
+	}
+
+	if (b->progress)
+		b->progress(b->progressp, 0, 0, size, size);
+
+	return 0;
+}
+
+static int _get(
+		kdbackend_t *b, const char *path,
+		void **buf, size_t *size, char **error)
+{
+	struct local_backend *l = b->data;
+	char filepath[BUFSIZ];
+	void *data;
+	long len;
+	FILE *fp;
+
+	_local_path(l, path, filepath);
+	fp = fopen(filepath, "rb");
+	if (fp == NULL){
+		if (error)
+			*error = _errno_error("can't open file", filepath);
+		_delay(l, 0);
+		return -1;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (len < 0){
+		if (error)
+			*error = _errno_error("can't read file", filepath);
+		fclose(fp);
+		return -1;
+	}
+
+	// +1 - NULL-terminate for text parsers
+	data = MALLOC(len + 1);
+	if (data == NULL){
+		if (error)
+			*error = strdup("can't allocate memory");
+		fclose(fp);
+		return -1;
+	}
+	if (len && fread(data, len, 1, fp) != 1){
+		if (error)
+			*error = _errno_error("can't read file", filepath);
+		free(data);
+		fclose(fp);
+		return -1;
+	}
+	((char *)data)[len] = 0;
+	fclose(fp);
+
+	_delay(l, len);
+
+	if (b->progress)
+		b->progress(b->progressp, len, len, 0, 0);
+
+	*buf  = data;
+	*size = len;
+	return 0;
+}
+
+static int _name_cmp_desc(const void *a, const void *b)
+{
+	return strcmp(*(char **)b, *(char **)a);
+}
+
+static int _list_sorted(
+		kdbackend_t *b, const char *path, void *user_data,
+		int (*callback)(void *user_data, const char *name),
+		char **error)
+{
+	struct local_backend *l = b->data;
+	char dirpath[BUFSIZ];
+	char **names = NULL;
+	int i, count = 0, cap = 0, res = 0;
+	struct dirent *entry;
+	DIR *dir;
+
+	_local_path(l, path, dirpath);
+	_delay(l, 0);
+
+	dir = opendir(dirpath);
+	if (dir == NULL){
+		if (error)
+			*error = _errno_error("can't open directory", dirpath);
+		return -1;
+	}
+
+	while ((entry = readdir(dir))) {
+		// hidden files are unfinished uploads
+		if (entry->d_name[0] == '.')
+			continue;
+		if (count == cap){
+			char **p;
+			cap = cap?cap * 2:64;
+			p = realloc(names, cap * sizeof(char *));
+			if (p == NULL){
+				res = -1;
+				break;
+			}
+			names = p;
+		}
+		names[count] = strdup(entry->d_name);
+		if (names[count])
+			count++;
+	}
+	closedir(dir);
+
+	if (res && error)
+		*error = strdup("can't allocate memory");
+
+	if (count == 0){
+		free(names);
+		return res;
+	}
+	qsort(names, count, sizeof(char *), _name_cmp_desc);
+
+	for (i = 0; i < count; ++i) {
+		if (res == 0 && callback(user_data, names[i]))
+			res = 1;
+		free(names[i]);
+	}
+	free(names);
+
+	return res < 0?res:0;
+}
+
+static int _mkdir(kdbackend_t *b, const char *path, char **error)
+{
+	struct local_backend *l = b->data;
+	char dirpath[BUFSIZ];
+
+	_local_path(l, path, dirpath);
+	_delay(l, 0);
+
+	if (mkdir(dirpath, 0755) && errno != EEXIST){
+		if (error)
+			*error = _errno_error("can't create directory", dirpath);
+		return -1;
+	}
+	return 0;
+}
+
+static int _remove(kdbackend_t *b, const char *path, char **error)
+{
+	struct local_backend *l = b->data;
+	char filepath[BUFSIZ];
+
+	_local_path(l, path, filepath);
+	_delay(l, 0);
+
+	if (remove(filepath)){
+		if (error)
+			*error = _errno_error("can't remove", filepath);
+		return -1;
+	}
+	return 0;
+}
+
+static int _exists(kdbackend_t *b, const char *path)
+{
+	struct local_backend *l = b->data;
+	char filepath[BUFSIZ];
+	struct stat st;
+
+	_local_path(l, path, filepath);
+	_delay(l, 0);
+
+	if (stat(filepath, &st) == 0)
+		return 1;
+	return errno == ENOENT?0:-1;
+}
+
+static void _free(kdbackend_t *b)
+{
+	free(b->data);
+	free(b);
+}
+
+kdbackend_t *
+local_backend_new(const char *root, int latency_ms, long bandwidth)
+{
+	kdbackend_t *b;
+	struct local_backend *l;
+
+	if (root == NULL)
+		return NULL;
+
+	b = NEW(kdbackend_t);
+	if (b == NULL)
+		return NULL;
+
+	l = NEW(struct local_backend);
+	if (l == NULL){
+		free(b);
+		return NULL;
+	}
+	strncpy(l->root, root, sizeof(l->root) - 1);
+	l->latency_ms = latency_ms;
+	l->bandwidth  = bandwidth;
+
+	// create root directory if not exists
+	if (mkdir(l->root, 0755) && errno != EEXIST){
+		free(l);
+		free(b);
+		return NULL;
+	}
+
+	b->data        = l;
+	b->put         = _put;
+	b->get         = _get;
+	b->list_sorted = _list_sorted;
+	b->mkdir       = _mkdir;
+	b->remove      = _remove;
+	b->exists      = _exists;
+	b->free        = _free;
+
+	return b;
+}
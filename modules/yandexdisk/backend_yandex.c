@@ -0,0 +1,195 @@
+/**
+ * File              : backend_yandex.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/*
+ * Yandex Disk remote storage backend
+ */
+
+#include "backend.h"
+#include "cYandexDisk/alloc.h"
+#include "cYandexDisk/cYandexDisk.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct yandex_backend {
+	char access_token[64];         // Yandex Disk access token
+};
+
+struct yandex_get {
+	void *buf;
+	size_t size;
+	char *error;
+};
+
+struct yandex_list {
+	void *user_data;
+	int (*callback)(void *user_data, const char *name);
+	char *error;
+};
+
+static int _put(
+		kdbackend_t *b, const char *path,
+		const void *buf, size_t size, char **error)
+{
+	struct yandex_backend *y = b->data;
+	int res = c_yandex_disk_upload_data(
+			y->access_token,
+			(void *)buf,
+			size,
+			path,
+			true,
+			true,
+			NULL,
+			NULL,
+			b->progressp,
+			b->progress);
+	if (res && error)
+		*error = strdup("can't upload data");
+	return res;
+}
+
+static void _get_callback(
+		void *data, size_t size, void *user_data, const char *error)
+{
+	struct yandex_get *g = user_data;
+	if (error && !g->error)
+		g->error = strdup(error);
+	g->buf  = data;
+	g->size = size;
+}
+
+static int _get(
+		kdbackend_t *b, const char *path,
+		void **buf, size_t *size, char **error)
+{
+	struct yandex_backend *y = b->data;
+	struct yandex_get g;
+	memset(&g, 0, sizeof(g));
+
+	c_yandex_disk_download_data(
+			y->access_token,
+			path,
+			true,
+			&g,
+			_get_callback,
+			b->progressp,
+			b->progress);
+
+	if (g.buf == NULL){
+		if (error)
+			*error = g.error?g.error:strdup("can't download data");
+		else
+			free(g.error);
+		return -1;
+	}
+	free(g.error);
+
+	*buf  = g.buf;
+	*size = g.size;
+	return 0;
+}
+
+static int _list_callback(
+		const c_yd_file_t *file, void *user_data, const char *error)
+{
+	struct yandex_list *l = user_data;
+	if (error && !l->error)
+		l->error = strdup(error);
+	if (file)
+		return l->callback(l->user_data, file->name);
+	return 0;
+}
+
+static int _list_sorted(
+		kdbackend_t *b, const char *path, void *user_data,
+		int (*callback)(void *user_data, const char *name),
+		char **error)
+{
+	struct yandex_backend *y = b->data;
+	struct yandex_list l;
+	int res;
+
+	l.user_data = user_data;
+	l.callback  = callback;
+	l.error     = NULL;
+
+	res = c_yandex_disk_sort_ls(
+			y->access_token,
+			path,
+			"-name",
+			0,
+			&l,
+			_list_callback);
+
+	if (l.error){
+		if (error)
+			*error = l.error;
+		else
+			free(l.error);
+		return -1;
+	}
+	return res;
+}
+
+static int _mkdir(kdbackend_t *b, const char *path, char **error)
+{
+	struct yandex_backend *y = b->data;
+	return c_yandex_disk_mkdir(y->access_token, path, error);
+}
+
+static int _remove(kdbackend_t *b, const char *path, char **error)
+{
+	struct yandex_backend *y = b->data;
+	return c_yandex_disk_rm(y->access_token, path, error);
+}
+
+static int _set_token(kdbackend_t *b, const char *token)
+{
+	struct yandex_backend *y = b->data;
+	strncpy(y->access_token, token, sizeof(y->access_token) - 1);
+	return 0;
+}
+
+static void _free(kdbackend_t *b)
+{
+	free(b->data);
+	free(b);
+}
+
+kdbackend_t *
+yandex_disk_backend_new(const char *access_token)
+{
+	kdbackend_t *b;
+	struct yandex_backend *y;
+
+	b = NEW(kdbackend_t);
+	if (b == NULL)
+		return NULL;
+
+	y = NEW(struct yandex_backend);
+	if (y == NULL){
+		free(b);
+		return NULL;
+	}
+	if (access_token)
+		strncpy(y->access_token, access_token,
+				sizeof(y->access_token) - 1);
+
+	b->data        = y;
+	b->put         = _put;
+	b->get         = _get;
+	b->list_sorted = _list_sorted;
+	b->mkdir       = _mkdir;
+	b->remove      = _remove;
+	b->set_token   = _set_token;
+	b->free        = _free;
+
+	return b;
+}
@@ -2,7 +2,7 @@
  * File              : base64.h
  * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
  * Date              : 05.04.2022
- * Last Modified Date: 27.05.2024
+ * Last Modified Date: 18.10.2026
  * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
  */
 
@@ -81,9 +81,11 @@ char *base64_encode(const unsigned char *data, size_t input_length,
 
   *output_length = 4 * ((input_length + 2) / 3);
 
-  encoded_data = (char *)malloc(*output_length);
+  // +1 - NULL-terminated to use as string
+  encoded_data = (char *)malloc(*output_length + 1);
   if (encoded_data == NULL)
     return NULL;
+  encoded_data[*output_length] = 0;
 
   for (i = 0, j = 0; i < input_length;) {
 
@@ -0,0 +1,89 @@
+/**
+ * File              : chunker.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 18.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+#include "chunker.h"
+#include "cYandexDisk/alloc.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// 2 bits more then log2(CHUNK_AVG) before average size and
+// 2 bits less after - chunk sizes are close to average
+// (normalized chunking). High bits of gear hash depend on
+// last 64 bytes
+#define MASK_S (((1ULL << 18) - 1) << 46)
+#define MASK_L (((1ULL << 14) - 1) << 50)
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* fixed pseudo random table - splitmix64 */
+static void _gear_init()
+{
+	uint64_t x = 0x6b64617461320000ULL; // "kdata2"
+	int i;
+	for (i = 0; i < 256; ++i) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* length of next chunk */
+static size_t _cut(const unsigned char *p, size_t size)
+{
+	uint64_t h = 0;
+	size_t i, normal = CHUNK_AVG;
+
+	if (size <= CHUNK_MIN)
+		return size;
+	if (size > CHUNK_MAX)
+		size = CHUNK_MAX;
+	if (normal > size)
+		normal = size;
+
+	for (i = CHUNK_MIN; i < normal; ++i) {
+		h = (h << 1) + gear[p[i]];
+		if ((h & MASK_S) == 0)
+			return i + 1;
+	}
+	for (; i < size; ++i) {
+		h = (h << 1) + gear[p[i]];
+		if ((h & MASK_L) == 0)
+			return i + 1;
+	}
+	return size;
+}
+
+struct chunk * chunker_split(const void *data, size_t size, int *count)
+{
+	const unsigned char *p = data;
+	struct chunk *chunks;
+	size_t offset = 0;
+	int n = 0, cap;
+
+	pthread_once(&gear_once, _gear_init);
+
+	// each chunk (except last) is at least CHUNK_MIN
+	cap = size / CHUNK_MIN + 1;
+	chunks = MALLOC(cap * sizeof(struct chunk));
+	if (chunks == NULL)
+		return NULL;
+
+	do {
+		struct chunk *c = &chunks[n++];
+		c->offset = offset;
+		c->len = _cut(p + offset, size - offset);
+		sha256(p + offset, c->len, c->hash);
+		offset += c->len;
+	} while (offset < size);
+
+	*count = n;
+	return chunks;
+}
@@ -0,0 +1,41 @@
+/**
+ * File              : chunker.h
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 18.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/* Content-defined chunking of blobs */
+
+/* Conception:
+ * Blob is split where gear rolling hash of last bytes
+ * matches mask (FastCDC) - boundaries depend on content
+ * only, so edit in the middle of blob changes only chunks
+ * around it and other chunks keep their hashes. Chunks are
+ * not smaller then CHUNK_MIN (except last) and not larger
+ * then CHUNK_MAX, average size is about CHUNK_AVG. Gear
+ * table and masks are part of sync format - do not change
+ * them */
+
+#ifndef YANDEX_DISK_CHUNKER_H
+#define YANDEX_DISK_CHUNKER_H
+
+#include "sha256.h"
+#include <stddef.h>
+
+#define CHUNK_MIN (16 * 1024)
+#define CHUNK_AVG (64 * 1024)
+#define CHUNK_MAX (256 * 1024)
+
+struct chunk {
+	size_t offset;
+	size_t len;
+	unsigned char hash[SHA256_LEN];
+};
+
+/* split data to chunks and hash them - return allocated
+ * array of chunks or NULL on error */
+struct chunk * chunker_split(const void *data, size_t size, int *count);
+
+#endif /* ifndef YANDEX_DISK_CHUNKER_H */
@@ -0,0 +1,558 @@
+/**
+ * File              : compact.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+#include "internal.h"
+#include "payload.h"
+#include "rowcodec.h"
+#include "sha256.h"
+#include "yandexdisk.h"
+#include "../../kdata2.h"
+#include "../../str.h"
+#include "cYandexDisk/alloc.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Conception:
+ * Buckets older then compaction age are folded to snapshot of
+ * each table. Snapshot is made from local database of device
+ * which downloaded all changes before cutoff and has no not
+ * uploaded changes - it has last version of each row with
+ * versions of columns. Snapshots are uploaded before buckets
+ * are removed, so device which lists buckets while they are
+ * removed gets removed changes from snapshot. Uploads go to
+ * bucket of current hour - compacted buckets are not changed
+ * by other devices. Only one device compacts at a time: it
+ * writes lease with its id and expire time and checks lease
+ * again before removing files. Bucket is removed only when
+ * each table of its changes (and of its bundles) has
+ * snapshot - changes of tables which are not in local
+ * database are kept. Flat folders are never removed - they
+ * are read by devices in JSON mode */
+
+struct names {
+	char **names;
+	int count;
+};
+
+static int add_name(void *data, const char *name)
+{
+	struct names *n = data;
+	char **p;
+
+	p = realloc(n->names, (n->count + 1) * sizeof(char *));
+	if (p == NULL)
+		return 1;
+	n->names = p;
+	n->names[n->count] = strdup(name);
+	if (n->names[n->count])
+		n->count++;
+	return 0;
+}
+
+static void free_names(struct names *n)
+{
+	int i;
+	for (i = 0; i < n->count; ++i)
+		free(n->names[i]);
+	free(n->names);
+	n->names = NULL;
+	n->count = 0;
+}
+
+/* list names of folder - return nonzero on error */
+static int list_names(kdydm_t *d, const char *path, struct names *n)
+{
+	char *error = NULL;
+	int res;
+
+	res = d->backend->list_sorted(d->backend, path, n, add_name, &error);
+	if (error){
+		ON_ERR(d->database, error);
+		free(error);
+		res = -1;
+	}
+	return res;
+}
+
+static int lease_get(kdydm_t *d, char id[37], time_t *expires)
+{
+	char path[BUFSIZ], buf[64], *error = NULL;
+	void *data = NULL;
+	size_t size = 0;
+	long t = 0;
+	int res = -1;
+
+	snprintf(path, BUFSIZ, "app:/%s", LEASE);
+	d->backend->get(d->backend, path, &data, &size, &error);
+	free(error);
+
+	if (data && size < sizeof(buf)){
+		memcpy(buf, data, size);
+		buf[size] = 0;
+		if (sscanf(buf, "%36s %ld", id, &t) == 2){
+			*expires = t;
+			res = 0;
+		}
+	}
+	free(data);
+	return res;
+}
+
+/* return 0 if this device holds lease */
+static int lease_check(kdydm_t *d)
+{
+	char id[37];
+	time_t expires;
+
+	if (lease_get(d, id, &expires))
+		return -1;
+	return strcmp(id, d->device) || expires <= time(NULL);
+}
+
+static int lease_acquire(kdydm_t *d)
+{
+	char path[BUFSIZ], data[64], id[37], *error = NULL;
+	time_t expires, now = time(NULL);
+	int len, res;
+
+	if (lease_get(d, id, &expires) == 0 && expires > now &&
+			strcmp(id, d->device))
+	{
+		ON_LOG(d->database, "compaction lease is held by other device");
+		return -1;
+	}
+
+	len = snprintf(data, sizeof(data), "%s %ld\n",
+			d->device, (long)(now + LEASE_SEC));
+	snprintf(path, BUFSIZ, "app:/%s", LEASE);
+	res = d->backend->put(d->backend, path, data, len, &error);
+	if (res){
+		ON_ERR(d->database, STR("can't write lease: %s",
+					error?error:""));
+		free(error);
+		return res;
+	}
+
+	// other device could write lease at the same time
+	return lease_check(d);
+}
+
+static void lease_release(kdydm_t *d)
+{
+	char path[BUFSIZ], *error = NULL;
+	snprintf(path, BUFSIZ, "app:/%s", LEASE);
+	d->backend->remove(d->backend, path, &error);
+	free(error);
+}
+
+/* chunks which are on remote are referenced by snapshot,
+ * other blobs are encoded in snapshot */
+static int snapshot_blob_ref(
+		void *user_data, const unsigned char hash[SHA256_LEN],
+		const void *data, size_t size)
+{
+	kdydm_t *d = user_data;
+	char SQL[BUFSIZ], hex[SHA256_LEN*2+1], *known;
+
+	sha256_hex(hash, hex);
+	snprintf(SQL, BUFSIZ,
+			"SELECT 1 FROM %s WHERE hash = '%s';", BLOBS, hex);
+	known = kdata2_get_string(d->database, SQL);
+	if (known == NULL)
+		return 1;
+	free(known);
+	return 0;
+}
+
+/* rows with versions of columns and tombstones of table */
+static int snapshot_entries(
+		kdydm_t *d, struct kdata2_table *table,
+		struct str *index, struct str *body)
+{
+	sqlite3_stmt *stmt;
+	struct str s;
+	time_t tombstones = time(NULL) - YANDEX_DISK_TOMBSTONE_AGE;
+	int count = 0, res;
+
+	if (str_init(&s))
+		return -1;
+
+	str_appendf(&s, "SELECT t.%s, ", UUIDCOLUMN);
+	do {
+		kdata2_column_for_each(table) {
+			str_appendf(&s, "t.\"%s\", ", column->columnname);
+		}
+	} while(0);
+	str_appendf(&s,
+			"t.timestamp, u.YANDEX_DISK_COLUMNS FROM '%s' t "
+			"LEFT JOIN _kdata2_updates u ON u.uuid = t.%s;",
+			table->tablename, UUIDCOLUMN);
+
+	res = kdata2_sqlite3_prepare(d->database, s.str, &stmt);
+	free(s.str);
+	if (res)
+		return -1;
+
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		int num_cols = sqlite3_column_count(stmt);
+		const char *uuid = (const char *)sqlite3_column_text(stmt, 0);
+		size_t size = 0, versions_size;
+		void *data;
+
+		if (uuid == NULL)
+			continue;
+
+		data = row_encode_stmt(table, stmt, -1,
+				d, snapshot_blob_ref, &size);
+		if (data == NULL){
+			res = SQLITE_NOMEM;
+			break;
+		}
+		versions_size = sqlite3_column_bytes(stmt, num_cols - 1);
+
+		str_appendf(index, "0 %ld %s %zu %zu %zu\n",
+				(long)sqlite3_column_int64(stmt, num_cols - 2),
+				uuid, body->len, size, versions_size);
+		str_append(body, data, size);
+		if (versions_size)
+			str_append(body,
+					sqlite3_column_blob(stmt, num_cols - 1),
+					versions_size);
+		free(data);
+		count++;
+	}
+	sqlite3_finalize(stmt);
+	if (res != SQLITE_DONE){
+		ON_ERR(d->database, STR("can't read table: %s",
+					table->tablename));
+		return -1;
+	}
+
+	// tombstones of rows which are deleted not long ago
+	if (str_init(&s))
+		return -1;
+	str_appendf(&s,
+			"SELECT uuid, timestamp FROM _kdata2_updates "
+			"WHERE tablename = '%s' AND deleted = 1 "
+			"AND timestamp > %ld;",
+			table->tablename, (long)tombstones);
+	res = kdata2_sqlite3_prepare(d->database, s.str, &stmt);
+	free(s.str);
+	if (res)
+		return -1;
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *uuid = (const char *)sqlite3_column_text(stmt, 0);
+		if (uuid == NULL)
+			continue;
+		str_appendf(index, "1 %ld %s %zu 0 0\n",
+				(long)sqlite3_column_int64(stmt, 1),
+				uuid, body->len);
+		count++;
+	}
+	sqlite3_finalize(stmt);
+
+	return count;
+}
+
+static int put_snapshot(
+		kdydm_t *d, struct kdata2_table *table, long cutoff,
+		long last_update)
+{
+	char path[BUFSIZ], uuid[37], *error = NULL;
+	struct str index, body, s;
+	void *payload = NULL;
+	size_t payload_size;
+	int count, res = -1;
+
+	if (str_init(&index))
+		return -1;
+	if (str_init(&body)){
+		free(index.str);
+		return -1;
+	}
+
+	count = snapshot_entries(d, table, &index, &body);
+	if (count >= 0 && str_init(&s) == 0){
+		str_append(&s, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC));
+		// changes downloaded before last update are in local
+		// database - high-water mark of snapshot
+		str_appendf(&s, "%d %ld\n", count, last_update);
+		str_append(&s, index.str, index.len);
+		str_append(&s, "\n", 1);
+		str_append(&s, body.str, body.len);
+
+		if (d->compression)
+			payload = payload_encode(
+					s.str, s.len, d->compression, &payload_size);
+
+		uuid_new(uuid);
+		snprintf(path, BUFSIZ, "app:/%s/%010ld.%s.%s",
+				SNAPSHOTS, cutoff, table->tablename, uuid);
+		ON_LOG(d->database, STR("upload snapshot of %d rows to: %s",
+					count, path));
+		res = d->backend->put(d->backend, path,
+				payload?payload:s.str,
+				payload?payload_size:s.len,
+				&error);
+		if (res){
+			ON_ERR(d->database, STR("can't upload snapshot: %s: %s",
+						path, error?error:""));
+		}
+		free(error);
+		free(payload);
+		free(s.str);
+	}
+
+	free(index.str);
+	free(body.str);
+	return res;
+}
+
+/* return 1 if table is in local database - it has snapshot */
+static int table_known(kdydm_t *d, const char *tablename)
+{
+	kdata2_table_for_each(d->database) {
+		if (strcmp(table->tablename, tablename) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* return 1 if each table of bundle has snapshot */
+static int bundle_known(kdydm_t *d, const char *path)
+{
+	char *error = NULL, *data = NULL, *header, *line, *p;
+	char tablename[128];
+	size_t size = 0;
+	int i, count = 0, known = 0;
+
+	d->backend->get(d->backend, path, (void **)&data, &size, &error);
+	if (error){
+		ON_ERR(d->database, error);
+		free(error);
+	}
+	if (payload_is_encoded(data, size)){
+		const char *message = NULL;
+		char *decoded = payload_decode(data, size, &size, &message);
+		free(data);
+		data = decoded;
+		if (data == NULL)
+			ON_ERR(d->database, message);
+	}
+	if (data == NULL ||
+			size < strlen(BUNDLE_MAGIC) ||
+			strncmp(data, BUNDLE_MAGIC, strlen(BUNDLE_MAGIC)))
+	{
+		free(data);
+		return 0;
+	}
+
+	// index ends with empty line
+	header = data;
+	for (i = strlen(BUNDLE_MAGIC); i + 1 < size; ++i) {
+		if (data[i] == '\n' && data[i + 1] == '\n'){
+			data[i] = 0;
+			break;
+		}
+	}
+	if (i + 1 >= size){
+		free(data);
+		return 0;
+	}
+
+	line = strtok_r(header + strlen(BUNDLE_MAGIC), "\n", &p);
+	if (line)
+		count = atoi(line);
+	for (i = 0; i < count; ++i) {
+		line = strtok_r(NULL, "\n", &p);
+		if (line == NULL ||
+				sscanf(line, "%*d %*ld %127s", tablename) != 1 ||
+				!table_known(d, tablename))
+			break;
+	}
+	known = (i == count);
+	free(data);
+	return known;
+}
+
+/* return 1 if changes of bucket are in snapshots */
+static int bucket_known(
+		kdydm_t *d, const char *bucket, struct names *n)
+{
+	char path[BUFSIZ], tablename[128];
+	int i;
+
+	for (i = 0; i < n->count; ++i) {
+		if (strcmp(n->names[i], MANIFEST) == 0)
+			continue;
+		// <upload time>.<row timestamp>.<kind>.<tablename>.<uuid>
+		if (sscanf(n->names[i], "%*[^.].%*[^.].%*[^.].%127[^.]",
+					tablename) != 1)
+			break;
+		if (strcmp(tablename, BUNDLE) == 0){
+			snprintf(path, BUFSIZ, "app:/%s/%s/%s",
+					CHANGES, bucket, n->names[i]);
+			if (!bundle_known(d, path))
+				break;
+		} else if (!table_known(d, tablename))
+			break;
+	}
+	if (i < n->count){
+		ON_LOG(d->database, STR("keep bucket %s: no snapshot for: %s",
+					bucket, n->names[i]));
+		return 0;
+	}
+	return 1;
+}
+
+/* remove files of bucket and bucket if its changes are in
+ * snapshots */
+static void remove_bucket(kdydm_t *d, const char *bucket)
+{
+	char path[BUFSIZ], *error = NULL;
+	struct names n = {NULL, 0};
+	int i;
+
+	snprintf(path, BUFSIZ, "app:/%s/%s", CHANGES, bucket);
+	if (list_names(d, path, &n) == 0 && bucket_known(d, bucket, &n)){
+		for (i = 0; i < n.count; ++i) {
+			snprintf(path, BUFSIZ, "app:/%s/%s/%s",
+					CHANGES, bucket, n.names[i]);
+			if (d->backend->remove(d->backend, path, &error)){
+				ON_ERR(d->database, STR("can't remove: %s: %s",
+							path, error?error:""));
+			}
+			free(error);
+			error = NULL;
+		}
+		snprintf(path, BUFSIZ, "app:/%s/%s", CHANGES, bucket);
+		d->backend->remove(d->backend, path, &error);
+		free(error);
+	}
+	free_names(&n);
+}
+
+/* remove files of folder which names start with time older
+ * then cutoff */
+static void remove_older(kdydm_t *d, const char *folder, long cutoff)
+{
+	char path[BUFSIZ], *error = NULL;
+	struct names n = {NULL, 0};
+	int i;
+
+	snprintf(path, BUFSIZ, "app:/%s", folder);
+	if (list_names(d, path, &n) == 0){
+		for (i = 0; i < n.count; ++i) {
+			if (atol(n.names[i]) >= cutoff)
+				continue;
+			snprintf(path, BUFSIZ, "app:/%s/%s", folder, n.names[i]);
+			d->backend->remove(d->backend, path, &error);
+			free(error);
+			error = NULL;
+		}
+	}
+	free_names(&n);
+}
+
+void compact_yandex_disk(kdydm_t *d)
+{
+	char SQL[BUFSIZ], path[BUFSIZ], *str;
+	struct names buckets = {NULL, 0};
+	time_t now = time(NULL);
+	long cutoff, last_update = 0;
+	int i, pending = 0, old = 0;
+
+	assert(d);
+	assert(d->database);
+
+	if (d->compact_age == 0 || now - d->compacted < COMPACT_INTERVAL)
+		return;
+	d->compacted = now;
+	cutoff = CHANGES_BUCKET(now - d->compact_age);
+
+	// device should have all changes before cutoff
+	str = kdata2_get_string(d->database,
+			"SELECT YANDEX_DISK_UPLOADED FROM _yandexdisk_updates");
+	if (str){
+		last_update = atol(str);
+		free(str);
+	}
+	snprintf(SQL, BUFSIZ,
+			"SELECT COUNT(*) FROM _kdata2_updates "
+			"WHERE (YANDEX_DISK_UPLOADED IS NULL "
+			"OR YANDEX_DISK_UPLOADED != timestamp)");
+	str = kdata2_get_string(d->database, SQL);
+	if (str){
+		pending = atoi(str);
+		free(str);
+	}
+	if (last_update < cutoff || pending)
+		return;
+
+	snprintf(path, BUFSIZ, "app:/%s", CHANGES);
+	if (list_names(d, path, &buckets))
+		return;
+	for (i = 0; i < buckets.count; ++i) {
+		if (atol(buckets.names[i]) < cutoff)
+			old++;
+	}
+	if (old == 0 || lease_acquire(d)){
+		free_names(&buckets);
+		return;
+	}
+
+	ON_LOG(d->database, STR("compact %d buckets older then %010ld",
+				old, cutoff));
+
+	// snapshots first - changes are removed only when all
+	// tables are in snapshots
+	do {
+		kdata2_table_for_each(d->database) {
+			if (SYNC_CANCELLED(d) ||
+					put_snapshot(d, table, cutoff, last_update))
+				break;
+		}
+		if (table){
+			lease_release(d);
+			free_names(&buckets);
+			return;
+		}
+	} while(0);
+
+	if (SYNC_CANCELLED(d)){
+		lease_release(d);
+		free_names(&buckets);
+		return;
+	}
+
+	if (lease_check(d)){
+		ON_ERR(d->database, "compaction lease is lost");
+		free_names(&buckets);
+		return;
+	}
+
+	// snapshots have changes of removed buckets - stop at
+	// any bucket
+	for (i = 0; i < buckets.count && !SYNC_CANCELLED(d); ++i) {
+		if (atol(buckets.names[i]) < cutoff)
+			remove_bucket(d, buckets.names[i]);
+	}
+	free_names(&buckets);
+
+	// older snapshots are removed by next compaction if
+	// cancelled. Flat folders are not compacted - they are
+	// read by devices in JSON mode
+	if (!SYNC_CANCELLED(d))
+		remove_older(d, SNAPSHOTS, cutoff);
+
+	lease_release(d);
+}
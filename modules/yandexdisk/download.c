@@ -1,28 +1,76 @@
 #include "cYandexDisk/alloc.h"
 #include "internal.h"
 #include "base64.h"
-#include "list.h"
+#include "payload.h"
+#include "retry.h"
+#include "rowcodec.h"
+#include "uuidmap.h"
 #include "yandexdisk.h"
 #include "../../kdata2.h"
-#include "cYandexDisk/cYandexDisk.h"
 #include "cYandexDisk/cJSON.h"
 #include "strtok_foreach.h"
 #include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+/* recently downloaded chunks (not more then CHUNK_MAX each)
+ * - rows often share blobs */
+#define BLOB_CACHE 64
+
+/* changes applied in one savepoint */
+#define APPLY_BATCH 256
+
+/* chunks of blobs prefetched for batch (batch has at least
+ * one change) */
+#define APPLY_BATCH_BYTES (16 * 1024 * 1024)
+
+/* uuids in one lookup of local timestamps */
+#define LOOKUP_BATCH 256
+
+struct blob_cache {
+	unsigned char hash[SHA256_LEN];
+	void *data;
+	size_t size;
+};
+
+struct snapshot_name {
+	long cutoff;
+	char tablename[128];
+	char uuid[37];
+};
+
 struct ddata_t {
 	kdydm_t *d;
+	struct blob_cache blobs[BLOB_CACHE];
+	int next_blob;
 	//char tablename[128];
 	/*char uuid[37];*/
 	/*time_t timestamp;*/
 	time_t start_of_update;
 	time_t last_update;
 	int deleted;
-	list_t *to_download;
+	struct uuidmap plan;           // newest change of rows
+	int planned;                   // changes in plan
+	long *buckets;                 // buckets with changes
+	int nbuckets;
+	long bucket;                   // listed bucket
+	struct snapshot_name *snapshots; // newest snapshot of tables
+	int nsnapshots;
+	struct uuidmap local;          // local timestamps of rows
+	sqlite3_stmt *delete;          // delete row of delete_table
+	char delete_table[128];
+	sqlite3_stmt *tombstone_insert;
+	sqlite3_stmt *tombstone_update;
+	int staged;                    // chunks of failed downloads
+	struct blob_cache *prefetched; // chunks of blobs of batch
+	int nprefetched;
+	size_t prefetched_size;
+	int offline;                   // batch is applied - no downloads
 	int ret;
 };
 
@@ -32,263 +80,1582 @@ struct ddata_node {
 	char uuid[37];
 	time_t timestamp;
 	int deleted;
+	long bucket;                   // 0 for flat folders
+	time_t uploaded;               // upload time (in bucket)
+	char kind[40];                 // kind of change in bucket
+	int64_t columns;               // columns in row file
+	int columns_known;             // kind has columns
+	struct ddata_node *next;       // older change of row in plan
+	int seq;                       // position in listing
+	void *data;                    // downloaded data
+	size_t size;
+	char *error;
+	int ready;                     // downloaded
+};
+
+/* Conception:
+ * Files are fetched by download_threads fetchers and applied
+ * by one writer (sync thread) in order of timestamp - so
+ * last writer wins as in serial sync. Writer waits for files
+ * of batch (not more then APPLY_BATCH), prefetches chunks of
+ * their rows and applies batch in one savepoint (see
+ * prefetch_blob). Fetchers may be not more then window files
+ * ahead of writer - they fetch next batch while writer
+ * applies current and memory for downloaded but not applied
+ * files is bounded */
+struct fetch_queue {
+	struct ddata_node **nodes;     // sorted by timestamp
+	int count;
+	int next;                      // next node to fetch
+	int applied;                   // nodes applied by writer
+	int window;
+	int cancelled;                 // writer stopped
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static int apply_bundle(struct ddata_node *node);
+static int prefetch_bundle(struct ddata_node *node);
+static int delete_node(struct ddata_node *node);
+
+/* Conception:
+ * Change which is not applied (file is not downloaded, it is
+ * broken or row is not written) is counted in retry table
+ * with path of file (see retry.h) - it is listed only once,
+ * so it is added to plan of sync after next try. Chunks of
+ * blobs downloaded for failed change (recent chunks in cache)
+ * are kept in _yandexdisk_chunks table and are not downloaded
+ * again - download of large blob is resumed from chunks
+ * which are not downloaded yet. Chunks are removed when
+ * there are no failed changes */
+
+/* remote path of change file */
+static void node_path(struct ddata_node *node, char path[BUFSIZ])
+{
+	if (node->bucket)
+		snprintf(path, BUFSIZ, "app:/%s/%010ld/%ld.%ld.%s.%s.%s",
+				CHANGES, node->bucket, (long)node->uploaded, 
+				node->timestamp, node->kind,
+				node->tablename, node->uuid);
+	else
+		snprintf(path, BUFSIZ, "app:/%s/%ld.%s.%s",
+				node->deleted?DELETED:UPDATES, 
+				node->timestamp,
+				node->tablename, node->uuid);
+}
+
+/* get chunk of failed download - NULL if not staged */
+static void * staged_chunk(
+		struct ddata_t *t, const char *hex, size_t size)
+{
+	kdata2_t *d = t->d->database;
+	char SQL[BUFSIZ];
+	sqlite3_stmt *stmt;
+	void *data = NULL;
+
+	snprintf(SQL, BUFSIZ, 
+			"SELECT data FROM %s WHERE hash = ?;", CHUNKS);
+	if (kdata2_sqlite3_prepare(d, SQL, &stmt))
+		return NULL;
+	sqlite3_bind_text(stmt, 1, hex, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW &&
+			(size_t)sqlite3_column_bytes(stmt, 0) == size)
+	{
+		data = MALLOC(size);
+		if (data)
+			memcpy(data, sqlite3_column_blob(stmt, 0), size);
+	}
+	sqlite3_finalize(stmt);
+	return data;
+}
+
+/* keep chunks downloaded since first chunk of cache and
+ * prefetched chunks of batch */
+static void stage_chunks(struct ddata_t *t, int first)
+{
+	kdata2_t *d = t->d->database;
+	char SQL[BUFSIZ], hex[SHA256_LEN*2+1];
+	sqlite3_stmt *stmt;
+	int i;
+
+	if (first < t->next_blob - BLOB_CACHE)
+		first = t->next_blob - BLOB_CACHE;
+	if (first >= t->next_blob && t->nprefetched == 0)
+		return;
+
+	snprintf(SQL, BUFSIZ, 
+			"INSERT OR IGNORE INTO %s (hash, data) VALUES (?, ?);",
+			CHUNKS);
+	if (kdata2_sqlite3_prepare(d, SQL, &stmt))
+		return;
+	for (i = first; i < t->next_blob + t->nprefetched; ++i) {
+		struct blob_cache *cache = i < t->next_blob?
+			&t->blobs[i % BLOB_CACHE]:&t->prefetched[i - t->next_blob];
+		if (cache->data == NULL)
+			continue;
+		sha256_hex(cache->hash, hex);
+		sqlite3_reset(stmt);
+		sqlite3_bind_text(stmt, 1, hex, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_blob(stmt, 2, cache->data, cache->size, 
+				SQLITE_STATIC);
+		if (sqlite3_step(stmt) != SQLITE_DONE){
+			ON_ERR(d, STR("sqlite3_step: %s", sqlite3_errmsg(d->db)));
+			break;
+		}
+		t->staged++;
+	}
+	sqlite3_finalize(stmt);
+}
+
+/* count failed attempt of change */
+static void retry_node(struct ddata_node *node, int first_blob)
+{
+	struct ddata_t *t = node->t;
+	char path[BUFSIZ];
+	struct str s;
+
+	node_path(node, path);
+	ON_LOG(t->d->database, STR("change is retried later: %s", path));
+
+	if (str_init(&s)){
+		ON_ERR(t->d->database, "can't allocate memory");
+		return;
+	}
+	retry_sql_failed(&s, path, 1, time(NULL));
+	kdata2_sqlite3_exec(t->d->database, s.str);
+	free(s.str);
+
+	stage_chunks(t, first_blob);
+}
+
+/* download content-addressed blob (or copy from cache) */
+static void * get_blob(
+		void *user_data, const unsigned char hash[SHA256_LEN], 
+		size_t size)
+{
+	struct ddata_t *t = user_data;
+	kdydm_t *d = t->d;
+	struct blob_cache *cache;
+	char path[BUFSIZ], hex[SHA256_LEN*2+1], *error = NULL;
+	void *data = NULL;
+	size_t len = 0;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < BLOB_CACHE; ++i) {
+		cache = &t->blobs[i];
+		if (cache->data && cache->size == size &&
+				memcmp(cache->hash, hash, SHA256_LEN) == 0)
+		{
+			data = MALLOC(size);
+			if (data)
+				memcpy(data, cache->data, size);
+			return data;
+		}
+	}
+
+	for (i = 0; i < t->nprefetched; ++i) {
+		cache = &t->prefetched[i];
+		if (cache->size == size &&
+				memcmp(cache->hash, hash, SHA256_LEN) == 0)
+		{
+			data = MALLOC(size);
+			if (data)
+				memcpy(data, cache->data, size);
+			return data;
+		}
+	}
+
+	sha256_hex(hash, hex);
+	if (t->staged){
+		data = staged_chunk(t, hex, size);
+		if (data)
+			return data;
+	}
+
+	if (t->offline){
+		ON_ERR(d->database, STR("blob is not prefetched: %s", hex));
+		return NULL;
+	}
+
+	snprintf(path, BUFSIZ, "app:/%s/%s", BLOBS_DIR, hex);
+	ON_DBG(d->database, STR("download blob: %s", path));
+
+	start = kdata2_stats_now();
+	d->backend->get(d->backend, path, &data, &len, &error);
+	kdata2_stats_record(d->database, KDATA2_STAT_SYNC_DOWNLOAD, start);
+
+	if (error){
+		ON_ERR(d->database, error);
+		free(error);
+	}
+	if (data == NULL)
+		return NULL;
+	if (len != size){
+		ON_ERR(d->database, STR("wrong size of blob: %s", path));
+		free(data);
+		return NULL;
+	}
+
+	cache = &t->blobs[t->next_blob++ % BLOB_CACHE];
+	free(cache->data);
+	cache->data = MALLOC(size);
+	if (cache->data){
+		memcpy(cache->hash, hash, SHA256_LEN);
+		memcpy(cache->data, data, size);
+		cache->size = size;
+	}
+
+	return data;
+}
+
+/* Conception:
+ * Database connection is shared with application - changes
+ * are applied in short savepoints under database lock, so
+ * application does not write inside of them and rolled back
+ * savepoint does not discard its writes. Savepoint nests in
+ * transaction of application if it is open. Chunks of blobs
+ * which rows of batch need are downloaded (see row_prefetch)
+ * before savepoint - there is no network I/O while database
+ * is locked, get_blob fails if chunk is not prefetched */
+static int prefetch_blob(
+		void *user_data, const unsigned char hash[SHA256_LEN], 
+		size_t size)
+{
+	struct ddata_t *t = user_data;
+	struct blob_cache *p;
+	unsigned char check[SHA256_LEN];
+	char hex[SHA256_LEN*2+1];
+	void *data;
+	int i;
+
+	for (i = 0; i < t->nprefetched; ++i) {
+		if (t->prefetched[i].size == size &&
+				memcmp(t->prefetched[i].hash, hash, SHA256_LEN) == 0)
+			return 0;
+	}
+
+	data = get_blob(t, hash, size);
+	if (data == NULL)
+		return -1;
+
+	sha256(data, size, check);
+	if (memcmp(check, hash, SHA256_LEN)){
+		sha256_hex(hash, hex);
+		ON_ERR(t->d->database, STR("broken blob: %s", hex));
+		free(data);
+		return -1;
+	}
+
+	p = realloc(t->prefetched, 
+			(t->nprefetched + 1) * sizeof(struct blob_cache));
+	if (p == NULL){
+		ON_ERR(t->d->database, "memory allocation error"); 
+		free(data);
+		return -1;
+	}
+	t->prefetched = p;
+	memcpy(p[t->nprefetched].hash, hash, SHA256_LEN);
+	p[t->nprefetched].data = data;
+	p[t->nprefetched].size = size;
+	t->nprefetched++;
+	t->prefetched_size += size;
+
+	return 0;
+}
+
+/* free chunks of applied batch */
+static void prefetch_free(struct ddata_t *t)
+{
+	int i;
+	for (i = 0; i < t->nprefetched; ++i)
+		free(t->prefetched[i].data);
+	free(t->prefetched);
+	t->prefetched = NULL;
+	t->nprefetched = 0;
+	t->prefetched_size = 0;
+}
+
+/* apply binary (or JSON from older versions) row - columns
+ * are compared with local versions, JSON row has no versions
+ * of columns and is encoded to binary row first */
+static int apply_row(
+		struct ddata_node *node, const void *data, size_t size)
+{
+	int err = 0;
+	void *encoded = NULL;
+	uint64_t start = kdata2_stats_now();
+
+	if (!row_is_encoded(data, size)){
+		encoded = row_encode_json(
+				node->t->d->database,
+				node->tablename,
+				data,
+				size,
+				&size);
+		if (encoded == NULL)
+			return -1;
+		data = encoded;
+	}
+
+	err = row_apply(
+			node->t->d->database,
+			node->tablename, 
+			node->uuid, 
+			node->timestamp,
+			data, 
+			size,
+			NULL,
+			0,
+			node->t,
+			get_blob);
+	free(encoded);
+
+	kdata2_stats_record(node->t->d->database, 
+			KDATA2_STAT_SYNC_APPLY, start);
+	return err;
+}
+
+static int parse_row(
+		void *data, size_t size, struct ddata_node *node, 
+		const char *error)
+{
+	ON_DBG(node->t->d->database, 
+		STR("parsing row with path: app:/%s/%s/%s/%ld",
+		node->deleted?DELETED:UPDATES, 
+		node->tablename, node->uuid, node->timestamp));
+
+	if (error)
+		ON_ERR(node->t->d->database, error);
+
+	if (data)
+	{
+		int err = apply_row(node, data, size);
+		free(data);
+		if (err == 0)
+			return 0;
+	}
+		
+	ON_ERR(node->t->d->database, 
+		STR("ERROR parsing row with path: app:/%s/%s/%s/%ld",
+		node->deleted?DELETED:UPDATES, 
+		node->tablename, node->uuid, node->timestamp));
+	return -1;
+}
+
+/* download file to node - called from fetcher threads */
+static void fetch_node(struct ddata_node *node)
+{	
+	char path[BUFSIZ];
+	uint64_t start;
+
+	assert(node);
+	assert(node->t);
+	assert(node->t->d);
+	assert(node->t->d->database);
+
+	ON_DBG(node->t->d->database, 
+			STR("Making %s for uuid: %s timestamp: %ld", 
+				"downloads",
+				node->uuid, node->timestamp));
+
+	node_path(node, path);
+	
+	start = kdata2_stats_now();
+	node->t->d->backend->get(
+		node->t->d->backend, 
+		path, 
+		&node->data, 
+		&node->size, 
+		&node->error);
+	kdata2_stats_record(node->t->d->database, 
+			KDATA2_STAT_SYNC_DOWNLOAD, start);
+
+	// decompress here - fetchers run in parallel
+	if (payload_is_encoded(node->data, node->size)){
+		const char *error = NULL;
+		size_t size = 0;
+		void *data = payload_decode(
+				node->data, node->size, &size, &error);
+		free(node->data);
+		node->data = data;
+		node->size = size;
+		if (data == NULL && node->error == NULL)
+			node->error = strdup(error);
+	}
+}
+
+/* apply downloaded file - called from writer */
+static int download_node(struct ddata_node *node)
+{	
+	int err, first_blob = node->t->next_blob;
+
+	if (strcmp(node->tablename, BUNDLE) == 0){
+		if (node->error)
+			ON_ERR(node->t->d->database, node->error);
+		err = apply_bundle(node);
+		free(node->data);
+	}
+	else
+		err = parse_row(node->data, node->size, node, node->error);
+	if (err)
+		retry_node(node, first_blob);
+	node->data = NULL;
+	free(node->error);
+	node->error = NULL;
+
+	return 0;
+}
+
+/* download chunks of rows of fetched file - row which
+ * chunks are not prefetched fails when it is applied */
+static void prefetch_node(struct ddata_node *node)
+{
+	if (node->data == NULL)
+		return;
+
+	if (strcmp(node->tablename, BUNDLE) == 0)
+		prefetch_bundle(node);
+	else
+		row_prefetch(
+				node->t->d->database,
+				node->tablename,
+				node->uuid,
+				node->timestamp,
+				node->data,
+				node->size,
+				NULL,
+				0,
+				node->t,
+				prefetch_blob);
+}
+
+/* apply prefetched batch in savepoint - rows which are not
+ * applied are counted in retry table, so savepoint is always
+ * released */
+static void apply_nodes(
+		struct ddata_t *t, struct ddata_node **nodes, int count,
+		pphase phase)
+{
+	kdata2_t *d = t->d->database;
+	int i, savepoint;
+
+	kdata2_do_in_database_lock(d)
+	{
+		t->offline = 1;
+		savepoint = 
+			kdata2_sqlite3_exec(d, "SAVEPOINT apply_batch;") == 0;
+
+		for (i = 0; i < count; ++i) {
+			if (nodes[i]->deleted)
+				delete_node(nodes[i]);
+			else
+				download_node(nodes[i]);
+		}
+
+		if (savepoint)
+			kdata2_sqlite3_exec(d, "RELEASE apply_batch;");
+		t->offline = 0;
+	}
+	prefetch_free(t);
+
+	t->d->current += count;
+	if (t->d->progress)
+		t->d->progress(
+				t->d->progressp, 
+				phase, 
+				t->d->current, 
+				t->d->total);
+}
+
+static void * fetcher(void *data)
+{
+	struct fetch_queue *q = data;
+	
+	pthread_mutex_lock(&q->mutex);
+	for (;;) {
+		struct ddata_node *node;
+		while (q->next < q->count && !q->cancelled &&
+				q->next >= q->applied + q->window)
+			pthread_cond_wait(&q->cond, &q->mutex);
+		if (q->next >= q->count || q->cancelled)
+			break;
+		node = q->nodes[q->next++];
+		pthread_mutex_unlock(&q->mutex);
+
+		fetch_node(node);
+
+		pthread_mutex_lock(&q->mutex);
+		node->ready = 1;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->mutex);
+
+	return NULL;
+}
+
+static int node_timestamp_cmp(const void *a, const void *b)
+{
+	const struct ddata_node *n1 = *(struct ddata_node **)a;
+	const struct ddata_node *n2 = *(struct ddata_node **)b;
+	if (n1->timestamp != n2->timestamp)
+		return n1->timestamp < n2->timestamp?-1:1;
+	return n1->seq - n2->seq;
+}
+
+/* fetch nodes concurrently and apply them in order */
+static void download_nodes(
+		struct ddata_t *t, struct ddata_node **nodes, int count)
+{
+	pthread_t tids[YANDEX_DISK_DOWNLOAD_THREADS_MAX];
+	int i, nthreads = t->d->download_threads, started = 0;
+	struct fetch_queue q;
+
+	if (count == 0)
+		return;
+
+	qsort(nodes, count, sizeof(struct ddata_node *), 
+			node_timestamp_cmp);
+
+	memset(&q, 0, sizeof(q));
+	q.nodes  = nodes;
+	q.count  = count;
+
+	if (nthreads > count)
+		nthreads = count;
+	if (nthreads > YANDEX_DISK_DOWNLOAD_THREADS_MAX)
+		nthreads = YANDEX_DISK_DOWNLOAD_THREADS_MAX;
+	q.window = 2 * APPLY_BATCH;
+
+	if (pthread_mutex_init(&q.mutex, NULL) == 0){
+		if (pthread_cond_init(&q.cond, NULL) == 0){
+			for (i = 0; i < nthreads; ++i) {
+				if (pthread_create(&tids[i], NULL, fetcher, &q))
+					break;
+				started++;
+			}
+			if (started == 0)
+				pthread_cond_destroy(&q.cond);
+		}
+		if (started == 0)
+			pthread_mutex_destroy(&q.mutex);
+	}
+
+	// no fetchers - download in this thread
+	if (started == 0)
+		ON_ERR(t->d->database, "can't start download threads");
+
+	for (i = 0; i < count && !SYNC_CANCELLED(t->d); ) {
+		int k;
+
+		// files and chunks of batch are downloaded before
+		// savepoint
+		for (k = 0; i + k < count && k < APPLY_BATCH &&
+				t->prefetched_size < APPLY_BATCH_BYTES; ++k) 
+		{
+			struct ddata_node *node = nodes[i + k];
+			if (started == 0)
+				fetch_node(node);
+			else {
+				pthread_mutex_lock(&q.mutex);
+				while (!node->ready)
+					pthread_cond_wait(&q.cond, &q.mutex);
+				pthread_mutex_unlock(&q.mutex);
+			}
+
+			// stop applying - fetchers finish current files
+			if (SYNC_CANCELLED(t->d))
+				break;
+
+			prefetch_node(node);
+		}
+
+		apply_nodes(t, &nodes[i], k, PPHASE_DOWNLOADING);
+		i += k;
+
+		if (started){
+			pthread_mutex_lock(&q.mutex);
+			q.applied = i;
+			pthread_cond_broadcast(&q.cond);
+			pthread_mutex_unlock(&q.mutex);
+		}
+	}
+
+	if (started){
+		int k;
+		pthread_mutex_lock(&q.mutex);
+		q.cancelled = 1;
+		pthread_cond_broadcast(&q.cond);
+		pthread_mutex_unlock(&q.mutex);
+
+		for (k = 0; k < started; ++k)
+			pthread_join(tids[k], NULL);
+
+		pthread_cond_destroy(&q.cond);
+		pthread_mutex_destroy(&q.mutex);
+	}
+
+	// fetched but not applied
+	for (; i < count; ++i) {
+		free(nodes[i]->data);
+		nodes[i]->data = NULL;
+		free(nodes[i]->error);
+		nodes[i]->error = NULL;
+	}
+}
+
+/* Conception:
+ * Downloaded changes are applied by the writer in batches of
+ * APPLY_BATCH changes - not a transaction (and fsync) for
+ * each row and column. Batch is applied in savepoint under
+ * database lock (see prefetch_blob) and is always released.
+ * Applied changes are marked as uploaded in _kdata2_updates
+ * - they are not uploaded back. Statements of deletes are
+ * prepared once for table */
+static void apply_free(struct ddata_t *t)
+{
+	sqlite3_finalize(t->delete);
+	sqlite3_finalize(t->tombstone_insert);
+	sqlite3_finalize(t->tombstone_update);
+	t->delete = NULL;
+	t->tombstone_insert = NULL;
+	t->tombstone_update = NULL;
+	t->delete_table[0] = 0;
+}
+
+static int delete_stmt_prepare(
+		struct ddata_t *t, const char *tablename)
+{
+	char SQL[BUFSIZ];
+	kdata2_t *d = t->d->database;
+
+	if (t->delete && strcmp(t->delete_table, tablename) == 0)
+		return 0;
+
+	sqlite3_finalize(t->delete);
+	t->delete = NULL;
+	t->delete_table[0] = 0;
+
+	snprintf(SQL, BUFSIZ,
+			"DELETE FROM '%s' WHERE %s = ?;",
+			tablename, UUIDCOLUMN);
+	if (kdata2_sqlite3_prepare(d, SQL, &t->delete))
+		return -1;
+	strncpy(t->delete_table, tablename, sizeof(t->delete_table) - 1);
+
+	if (t->tombstone_insert == NULL &&
+			kdata2_sqlite3_prepare(d,
+				"INSERT INTO _kdata2_updates "
+				"(uuid, tablename, timestamp, deleted, columns, "
+				"YANDEX_DISK_UPLOADED) "
+				"SELECT ?1, ?2, ?3, 1, 0, ?3 "
+				"WHERE NOT EXISTS "
+				"(SELECT 1 FROM _kdata2_updates WHERE uuid = ?1);",
+				&t->tombstone_insert))
+		return -1;
+
+	if (t->tombstone_update == NULL &&
+			kdata2_sqlite3_prepare(d,
+				"UPDATE _kdata2_updates SET "
+				"tablename = ?2, timestamp = ?3, deleted = 1, "
+				"columns = 0, YANDEX_DISK_UPLOADED = ?3, "
+				"YANDEX_DISK_COLUMNS = NULL "
+				"WHERE uuid = ?1 AND COALESCE(timestamp, 0) <= ?3;",
+				&t->tombstone_update))
+		return -1;
+
+	return 0;
+}
+
+static int delete_stmt_step(
+		kdata2_t *d, sqlite3_stmt *stmt, struct ddata_node *node)
+{
+	int res;
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	sqlite3_bind_text(stmt, 1, node->uuid, -1, SQLITE_TRANSIENT);
+	if (sqlite3_bind_parameter_count(stmt) > 1){
+		sqlite3_bind_text(stmt, 2, node->tablename, -1, 
+				SQLITE_TRANSIENT);
+		sqlite3_bind_int64(stmt, 3, node->timestamp);
+	}
+
+	res = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	if (res != SQLITE_DONE){
+		ON_ERR(d, STR("sqlite3_step: %s", 
+					sqlite3_errmsg(d->db)));
+		return -1;
+	}
+	return 0;
+}
+
+/* remove row and keep tombstone - row is not restored by
+ * older changes and deletion is not uploaded back */
+static int delete_row(struct ddata_node *node)
+{
+	int err = 0;
+	struct ddata_t *t = node->t;
+	kdata2_t *d = t->d->database;
+	uint64_t start = kdata2_stats_now();
+
+	ON_DBG(d, 
+			STR("Making %s for uuid: %s timestamp: %ld", 
+				"deleting",
+				node->uuid, node->timestamp));
+	
+	err = delete_stmt_prepare(t, node->tablename);
+	if (err == 0)
+		err = delete_stmt_step(d, t->delete, node);
+	if (err == 0)
+		err = delete_stmt_step(d, t->tombstone_insert, node);
+	if (err == 0)
+		err = delete_stmt_step(d, t->tombstone_update, node);
+
+	kdata2_stats_record(d, KDATA2_STAT_SYNC_APPLY, start);
+
+	return err;
+}
+
+/* apply downloaded delete - called from writer */
+static int delete_node(struct ddata_node *node)
+{
+	int err = delete_row(node);
+	if (err)
+		retry_node(node, node->t->next_blob);
+	return err;
+}
+
+/* Conception:
+ * Local timestamps of rows are not queried for each listed
+ * file - planner collects uuids of remote deletions and
+ * loads timestamps of them to t->local with batched IN
+ * lookups (uuid is indexed). Rows which are not in table
+ * have timestamp 0. Map is cleared before it may become
+ * stale - after planning, for each bundle and for each
+ * batch of snapshot */
+struct lookup {
+	const char *tablename;
+	const char *uuid;
+};
+
+static int lookup_cmp(const void *a, const void *b)
+{
+	return strcmp(((struct lookup *)a)->tablename, 
+			((struct lookup *)b)->tablename);
+}
+
+static int local_timestamps_query(
+		struct ddata_t *t, struct lookup *keys, int count)
+{
+	kdata2_t *d = t->d->database;
+	sqlite3_stmt *stmt;
+	struct str s;
+	int i, res;
+
+	if (str_init(&s))
+		return -1;
+	str_appendf(&s, "SELECT %s, timestamp FROM '%s' WHERE %s IN (",
+			UUIDCOLUMN, keys[0].tablename, UUIDCOLUMN);
+	for (i = 0; i < count; ++i)
+		str_append(&s, i?",?":"?", i?2:1);
+	str_append(&s, ");", 2);
+
+	res = kdata2_sqlite3_prepare(d, s.str, &stmt);
+	free(s.str);
+	if (res)
+		return -1;
+
+	for (i = 0; i < count; ++i) {
+		if (uuidmap_put(&t->local, keys[i].uuid) == NULL){
+			ON_ERR(d, STR("can't add to map: %s", keys[i].uuid)); 
+			sqlite3_finalize(stmt);
+			return -1;
+		}
+		sqlite3_bind_text(stmt, i + 1, keys[i].uuid, -1, SQLITE_STATIC);
+	}
+
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		struct uuidmap_entry *e = uuidmap_get(&t->local, 
+				(const char *)sqlite3_column_text(stmt, 0));
+		if (e && sqlite3_column_int64(stmt, 1) > e->value)
+			e->value = sqlite3_column_int64(stmt, 1);
+	}
+	if (res != SQLITE_DONE)
+		ON_ERR(d, STR("sqlite3_step: %s", sqlite3_errmsg(d->db)));
+	sqlite3_finalize(stmt);
+
+	return res == SQLITE_DONE?0:-1;
+}
+
+/* load local timestamps of rows which are not in t->local -
+ * keys are sorted by table */
+static int local_timestamps_load(
+		struct ddata_t *t, struct lookup *keys, int count)
+{
+	int i, n = 0, err = 0;
+
+	// skip loaded
+	for (i = 0; i < count; ++i)
+		if (uuidmap_get(&t->local, keys[i].uuid) == NULL)
+			keys[n++] = keys[i];
+
+	qsort(keys, n, sizeof(struct lookup), lookup_cmp);
+
+	for (i = 0; i < n && err == 0; ) {
+		int k = 1;
+		while (i + k < n && k < LOOKUP_BATCH &&
+				strcmp(keys[i + k].tablename, keys[i].tablename) == 0)
+			k++;
+		err = local_timestamps_query(t, &keys[i], k);
+		i += k;
+	}
+
+	return err;
+}
+
+static int local_remote_timestamp_cmp(
+		struct ddata_t *t, struct ddata_node *node)
+{
+	long timestamp_local = 0;
+	struct uuidmap_entry *e;
+	
+	e = uuidmap_get(&t->local, node->uuid);
+	if (e == NULL){
+		// not loaded with batch
+		struct lookup key = {node->tablename, node->uuid};
+		local_timestamps_load(t, &key, 1);
+		e = uuidmap_get(&t->local, node->uuid);
+	}
+	if (e)
+		timestamp_local = e->value;
+
+	ON_DBG(t->d->database, 
+			STR("Check %s timestamp: %ld(local): %ld(remote) for uuid: %s", 
+				node->deleted?"delete":"update",
+				timestamp_local,
+				node->timestamp, node->uuid));
+
+	return timestamp_local < node->timestamp?-1:
+		timestamp_local > node->timestamp;
+}
+
+/* Conception:
+ * Every local edit of row makes new remote file, so listing
+ * may have many versions of one row. Planner keeps changes
+ * of each uuid in hash map and drops superseded: delete
+ * supersedes any update (deletes were applied after updates)
+ * and update is superseded by newer update which has all its
+ * columns (bitmap of columns is in file name, rows of older
+ * versions have unknown columns and are superseded only by
+ * rows with all columns). Row edited many times is downloaded
+ * once */
+static int plan_node_cmp(
+		const struct ddata_node *n1, const struct ddata_node *n2)
+{
+	if (n1->timestamp != n2->timestamp)
+		return n1->timestamp < n2->timestamp?-1:1;
+	return n1->seq - n2->seq;
+}
+
+/* update n2 is newer then n1 and has all columns of it -
+ * updates with equal timestamps are both applied (values
+ * break tie, see rowcodec.c) */
+static int plan_covers(
+		const struct ddata_node *n2, const struct ddata_node *n1)
+{
+	if (!n2->columns_known || n1->timestamp >= n2->timestamp)
+		return 0;
+	if (n2->columns == -1)
+		return 1;
+	return n1->columns_known && (n1->columns & ~n2->columns) == 0;
+}
+
+/* free changes of row - return count of them */
+static int plan_free_chain(struct ddata_node *node)
+{
+	int count = 0;
+	while (node) {
+		struct ddata_node *next = node->next;
+		free(node);
+		node = next;
+		count++;
+	}
+	return count;
+}
+
+static void plan_add(struct ddata_t *t, struct ddata_node *node)
+{
+	struct uuidmap_entry *e;
+	struct ddata_node *head, **p;
+
+	node->seq = t->planned++;
+	node->next = NULL;
+
+	e = uuidmap_put(&t->plan, node->uuid);
+	if (e == NULL){
+		ON_ERR(t->d->database, STR("can't add to map: %s", node->uuid)); 
+		free(node);
+		return;
+	}
+	head = e->data;
+
+	// row is deleted - keep newest delete
+	if (head && head->deleted && 
+			(!node->deleted || plan_node_cmp(head, node) >= 0))
+	{
+		ON_DBG(t->d->database, 
+				STR("superseded change of uuid: %s", node->uuid));
+		free(node);
+		return;
+	}
+
+	if (node->deleted){
+		t->d->total -= plan_free_chain(head);
+		e->data = node;
+		t->d->total++;
+		return;
+	}
+
+	for (p = (struct ddata_node **)&e->data; *p; ) {
+		struct ddata_node *n = *p;
+		if (plan_covers(n, node)){
+			ON_DBG(t->d->database, 
+					STR("superseded change of uuid: %s", node->uuid));
+			free(node);
+			return;
+		}
+		if (plan_covers(node, n)){
+			ON_DBG(t->d->database, 
+					STR("superseded change of uuid: %s", n->uuid));
+			*p = n->next;
+			free(n);
+			t->d->total--;
+			continue;
+		}
+		p = &n->next;
+	}
+
+	node->next = e->data;
+	e->data = node;
+	t->d->total++;
+}
+
+/* take changes (deleted or not) from plan - return allocated
+ * array */
+static struct ddata_node ** plan_take(
+		struct ddata_t *t, int deleted, int *count)
+{
+	struct ddata_node **nodes, *node;
+	size_t i;
+	int n = 0;
+
+	*count = 0;
+	for (i = 0; i < t->plan.size; ++i) 
+		for (node = t->plan.entries[i].data; node; node = node->next)
+			n++;
+
+	nodes = MALLOC(n * sizeof(struct ddata_node *) + 1);
+	if (nodes == NULL){
+		ON_ERR(t->d->database, "memory allocation error"); 
+		return NULL;
+	}
+
+	// changes of uuid are all deleted or all not
+	n = 0;
+	for (i = 0; i < t->plan.size; ++i) {
+		node = t->plan.entries[i].data;
+		if (node == NULL || node->deleted != deleted)
+			continue;
+		for (; node; node = node->next)
+			nodes[n++] = node;
+		t->plan.entries[i].data = NULL;
+	}
+
+	*count = n;
+	return nodes;
+}
+
+static void plan_free(struct ddata_t *t)
+{
+	size_t i;
+	for (i = 0; i < t->plan.size; ++i)
+		plan_free_chain(t->plan.entries[i].data);
+	uuidmap_free(&t->plan);
+}
+
+/* remove deletions which are older then local rows from
+ * plan - delete of the same second wins as in row_apply */
+static void filter_deletes(struct ddata_t *t)
+{
+	struct lookup *keys;
+	size_t i;
+	int count = 0;
+
+	keys = MALLOC(t->plan.count * sizeof(struct lookup) + 1);
+	if (keys == NULL){
+		ON_ERR(t->d->database, "memory allocation error"); 
+		return;
+	}
+
+	for (i = 0; i < t->plan.size; ++i) {
+		struct ddata_node *node = t->plan.entries[i].data;
+		if (node == NULL || !node->deleted)
+			continue;
+		keys[count].tablename = node->tablename;
+		keys[count].uuid = node->uuid;
+		count++;
+	}
+	local_timestamps_load(t, keys, count);
+	free(keys);
+
+	for (i = 0; i < t->plan.size; ++i) {
+		struct ddata_node *node = t->plan.entries[i].data;
+		if (node == NULL || !node->deleted ||
+				local_remote_timestamp_cmp(t, node) <= 0)
+			continue;
+		free(node);
+		t->plan.entries[i].data = NULL;
+		t->d->total--;
+	}
+
+	uuidmap_clear(&t->local);
+}
+
+struct bundle_entry {
+	int deleted;
+	long timestamp;
+	char tablename[128];
+	char uuid[37];
+	size_t offset;
+	size_t length;
+};
+
+/* return allocated copy of index of bundle or snapshot (with
+ * magic line) and set body after it - index ends with empty
+ * line. Return NULL on error */
+static char * split_index(
+		kdata2_t *database, const char *data, size_t size,
+		const char *magic, const char **body, size_t *body_len)
+{
+	size_t header_len, magic_len;
+	char *header;
+
+	magic_len = strlen(magic);
+	if (data == NULL || size < magic_len ||
+			strncmp(data, magic, magic_len))
+		return NULL;
+
+	for (header_len = magic_len; header_len + 1 < size; header_len++) {
+		if (data[header_len] == '\n' && data[header_len + 1] == '\n')
+			break;
+	}
+	if (header_len + 1 >= size)
+		return NULL;
+	*body = data + header_len + 2;
+	*body_len = size - header_len - 2;
+
+	header = MALLOC(header_len + 1);
+	if (header == NULL){
+		ON_ERR(database, "memory allocation error");
+		return NULL;
+	}
+	memcpy(header, data, header_len);
+	header[header_len] = 0;
+
+	return header;
+}
+
+/* read index of bundle - return allocated entries (count
+ * may be 0) and set body or return NULL if bundle is broken */
+static struct bundle_entry * bundle_index(
+		struct ddata_node *node, const char **body, int *count)
+{
+	size_t body_len = 0;
+	char *header, *line, *p;
+	struct bundle_entry *entries = NULL;
+	int n = 0;
+
+	*count = 0;
+	header = split_index(node->t->d->database,
+			node->data, node->size, BUNDLE_MAGIC, body, &body_len);
+	if (header == NULL){
+		ON_ERR(node->t->d->database,
+			STR("ERROR broken bundle: %ld.%s.%s",
+				node->timestamp, node->tablename, node->uuid));
+		return NULL;
+	}
+
+	// skip magic line, read count and entries
+	line = strtok_r(header + strlen(BUNDLE_MAGIC), "\n", &p);
+	if (line)
+		*count = atoi(line);
+	entries = MALLOC((*count > 0?*count:0) * 
+			sizeof(struct bundle_entry) + 1);
+	if (entries){
+		while (n < *count && (line = strtok_r(NULL, "\n", &p))) {
+			struct bundle_entry *e = &entries[n];
+			if (sscanf(line, "%d %ld %127s %36s %zu %zu",
+						&e->deleted, &e->timestamp, e->tablename,
+						e->uuid, &e->offset, &e->length) != 6)
+				break;
+			if (e->offset > body_len || e->length > body_len - e->offset)
+				break;
+			n++;
+		}
+	}
+	free(header);
+
+	if (entries == NULL || n != *count){
+		ON_ERR(node->t->d->database, 
+			STR("ERROR broken bundle index: %ld.%s.%s",
+				node->timestamp, node->tablename, node->uuid));
+		free(entries);
+		return NULL;
+	}
+
+	return entries;
+}
+
+/* download chunks of rows of bundle */
+static int prefetch_bundle(struct ddata_node *node)
+{
+	const char *body = NULL;
+	struct bundle_entry *entries;
+	int i, count, err = 0;
+
+	entries = bundle_index(node, &body, &count);
+	if (entries == NULL)
+		return -1;
+
+	for (i = 0; i < count && err == 0; ++i) {
+		struct bundle_entry *e = &entries[i];
+		if (e->deleted)
+			continue;
+		err = row_prefetch(
+				node->t->d->database,
+				e->tablename,
+				e->uuid,
+				e->timestamp,
+				body + e->offset,
+				e->length,
+				NULL,
+				0,
+				node->t,
+				prefetch_blob);
+	}
+
+	free(entries);
+	return err;
+}
+
+/* apply rows of bundle - return -1 if bundle is broken or
+ * any row failed */
+static int apply_bundle(struct ddata_node *node)
+{
+	const char *body = NULL;
+	struct bundle_entry *entries;
+	struct lookup *keys;
+	int i, count, nkeys = 0, err = 0;
+
+	entries = bundle_index(node, &body, &count);
+	if (entries == NULL)
+		return -1;
+
+	ON_DBG(node->t->d->database, 
+			STR("apply bundle of %d rows", count));
+
+	// local timestamps of deleted rows in one lookup - uuid
+	// is not more then once in bundle
+	keys = MALLOC(count * sizeof(struct lookup) + 1);
+	if (keys){
+		for (i = 0; i < count; ++i) {
+			if (!entries[i].deleted)
+				continue;
+			keys[nkeys].tablename = entries[i].tablename;
+			keys[nkeys].uuid = entries[i].uuid;
+			nkeys++;
+		}
+		local_timestamps_load(node->t, keys, nkeys);
+		free(keys);
+	}
+
+	for (i = 0; i < count; ++i) {
+		struct bundle_entry *e = &entries[i];
+		struct ddata_node row;
+
+		memset(&row, 0, sizeof(row));
+		row.t = node->t;
+		row.deleted = e->deleted;
+		row.timestamp = e->timestamp;
+		strncpy(row.tablename, e->tablename, sizeof(row.tablename) - 1);
+		strncpy(row.uuid, e->uuid, sizeof(row.uuid) - 1);
+
+		if (row.deleted){
+			if (local_remote_timestamp_cmp(node->t, &row) <= 0 &&
+					delete_row(&row))
+				err = -1;
+		} else if (apply_row(&row, body + e->offset, e->length)){
+			ON_ERR(node->t->d->database, 
+				STR("ERROR parsing row in bundle for uuid: %s",
+					row.uuid));
+			err = -1;
+		}
+	}
+	uuidmap_clear(&node->t->local);
+
+	free(entries);
+	return err;
+}
+
+struct snapshot_entry {
+	int deleted;
+	long timestamp;
+	char uuid[37];
+	size_t offset;
+	size_t length;
+	size_t versions_length;
 };
 
-static int json_to_database_for_column(
-		struct ddata_node *node, cJSON *object, struct kdata2_column *column)
+/* apply count entries of snapshot in savepoint - loader
+ * is set for table which was empty when snapshot was
+ * listed (application adds rows with new uuids) */
+static int apply_snapshot_batch(
+		struct ddata_t *t, const struct snapshot_name *s,
+		struct row_loader *loader, const char *body,
+		struct snapshot_entry *entries, int count)
 {
-	char *uuid = NULL;
-	cJSON *item;
+	kdata2_t *d = t->d->database;
+	uint64_t start = kdata2_stats_now();
+	int i, err = 0, savepoint;
 
-	ON_LOG(node->t->d->database, 
-			STR("json to database for column: %s", column->columnname));
+	kdata2_do_in_database_lock(d)
+	{
+		t->offline = 1;
+
+		// local timestamps of tombstones in one lookup
+		if (loader == NULL){
+			struct lookup *keys = 
+				MALLOC(count * sizeof(struct lookup) + 1);
+			int nkeys = 0;
+			if (keys){
+				for (i = 0; i < count; ++i) {
+					if (!entries[i].deleted)
+						continue;
+					keys[nkeys].tablename = s->tablename;
+					keys[nkeys].uuid = entries[i].uuid;
+					nkeys++;
+				}
+				local_timestamps_load(t, keys, nkeys);
+				free(keys);
+			}
+		}
 
-	item = cJSON_GetObjectItem(object, column->columnname);
-	if (item == NULL)
-		return 1;
+		savepoint = 
+			kdata2_sqlite3_exec(d, "SAVEPOINT apply_snapshot;") == 0;
+		if (!savepoint)
+			err = -1;
 
-	switch (column->type) {
-		case KDATA2_TYPE_NUMBER:
-			{
-				long value = cJSON_GetNumberValue(item);
-				uuid = kdata2_set_number_for_uuid(
-						node->t->d->database, 
-						node->tablename, 
-						column->columnname, 
-						value, 
-						node->uuid);
-			}
-			break;
-	
-		case KDATA2_TYPE_FLOAT:
-			{
-				double value = cJSON_GetNumberValue(item);
-				uuid = kdata2_set_float_for_uuid(
-						node->t->d->database, 
-						node->tablename, 
-						column->columnname, 
-						value, 
-						node->uuid);
-			}
-			break;
-		
-		case KDATA2_TYPE_TEXT:
-			{
-				const char *value = cJSON_GetStringValue(item);
-				uuid = kdata2_set_text_for_uuid(
-						node->t->d->database, 
-						node->tablename, 
-						column->columnname, 
-						value, 
-						node->uuid);
+		for (i = 0; i < count && err == 0; ++i) {
+			struct snapshot_entry *e = &entries[i];
+			const void *row = body + e->offset;
+			const void *versions = NULL;
+			struct ddata_node node;
+
+			// applied rows are released - snapshot is applied
+			// again on next sync
+			if (SYNC_CANCELLED(t->d))
+				break;
+
+			if (e->versions_length)
+				versions = body + e->offset + e->length;
+
+			if (loader){
+				// nothing to delete in empty table
+				if (!e->deleted)
+					err = row_loader_add(loader, e->uuid, e->timestamp,
+							row, e->length, versions, e->versions_length,
+							t, get_blob);
+				continue;
 			}
-			break;
 
-		case KDATA2_TYPE_DATA:
-			{
-				size_t len = 0;
-				unsigned char *data = NULL;
-				const char *value = cJSON_GetStringValue(item);
-
-				data = base64_decode(
-						value, 
-						strlen(value), 
-						&len);
-
-				if (data)
-				{
-					uuid = kdata2_set_data_for_uuid(
-							node->t->d->database, 
-							node->tablename, 
-							column->columnname, 
-							data,
-						  len,	
-							node->uuid);
-				}
+			memset(&node, 0, sizeof(node));
+			node.t = t;
+			node.deleted = e->deleted;
+			node.timestamp = e->timestamp;
+			strncpy(node.tablename, s->tablename, 
+					sizeof(node.tablename) - 1);
+			strncpy(node.uuid, e->uuid, sizeof(node.uuid) - 1);
+
+			if (node.deleted){
+				if (local_remote_timestamp_cmp(t, &node) <= 0)
+					err = delete_row(&node);
+				continue;
 			}
-			break;
 
-		default:
-			break;
-			
+			err = row_apply(
+					d,
+					node.tablename,
+					node.uuid,
+					node.timestamp,
+					row,
+					e->length,
+					versions,
+					e->versions_length,
+					t,
+					get_blob);
+		}
+
+		if (savepoint && err){
+			kdata2_sqlite3_exec(d, 
+					"ROLLBACK TO apply_snapshot; "
+					"RELEASE apply_snapshot;");
+		} else if (savepoint)
+			kdata2_sqlite3_exec(d, "RELEASE apply_snapshot;");
+
+		uuidmap_clear(&t->local);
+		t->offline = 0;
 	}
+	kdata2_stats_record(d, KDATA2_STAT_SYNC_APPLY, start);
 
-	return uuid == NULL;
+	return err;
 }
 
-static void json_to_database(
-		struct ddata_node *node, cJSON *object)
+/* apply rows and tombstones of table snapshot in batches
+ * (see prefetch_blob) and set mark to time before which all
+ * changes are in snapshot - return 0 if snapshot is applied.
+ * Snapshot which is not applied is applied again on next
+ * sync - rows of applied batches are not changed then */
+static int apply_snapshot(
+		struct ddata_t *t, const struct snapshot_name *s, long *mark)
 {
-	int err = 0;
-	char SQL[BUFSIZ];
+	char path[BUFSIZ], *error = NULL, *header, *line, *p;
+	struct snapshot_entry *entries = NULL;
+	const char *body = NULL;
+	size_t size = 0, body_len = 0;
+	void *data = NULL;
+	struct row_loader *loader = NULL;
+	int i, count = 0, n = 0, err = 0;
+	char SQL[BUFSIZ], *local;
+	uint64_t start;
+
+	snprintf(path, BUFSIZ, "app:/%s/%010ld.%s.%s",
+			SNAPSHOTS, s->cutoff, s->tablename, s->uuid);
+	ON_LOG(t->d->database, STR("download snapshot: %s", path));
+
+	start = kdata2_stats_now();
+	t->d->backend->get(t->d->backend, path, &data, &size, &error);
+	kdata2_stats_record(t->d->database,
+			KDATA2_STAT_SYNC_DOWNLOAD, start);
+	if (error){
+		ON_ERR(t->d->database, error);
+		free(error);
+	}
 
-	do {
-		kdata2_table_for_each(node->t->d->database)
-		{
-			// find table
-			if (strcmp(table->tablename, node->tablename) == 0)
-			{
-				do {
-					kdata2_column_for_each(table)
-					{
-						json_to_database_for_column(node, object, column);
-					}
-				} while(0);
-
-				//if (err){
-					//ON_ERR(node->t->d->database, 
-							//STR("ERROR in tables while parsing JSON "
-								//"with path: app:/%s/%s/%s/%ld",
-							//node->deleted?DELETED:DATABASE, 
-							//node->tablename, node->uuid, node->timestamp));
-					//break;
-				//}
-
-				snprintf(SQL, BUFSIZ, 
-						"UPDATE _kdata2_updates SET "
-						"timestamp = %ld, "
-						"YANDEX_DISK_UPLOADED = %ld "
-						"WHERE uuid = '%s';",
-						node->timestamp, node->timestamp, node->uuid);
-				kdata2_sqlite3_exec(node->t->d->database, SQL);
-
-				snprintf(SQL, BUFSIZ, 
-						"UPDATE '%s' SET "
-						"timestamp = %ld, "
-						"YANDEX_DISK_UPLOADED = 1 "
-						"WHERE %s = '%s';",
-						node->tablename, 
-						node->timestamp, 
-						UUIDCOLUMN, node->uuid);
-				kdata2_sqlite3_exec(node->t->d->database, SQL);
+	if (payload_is_encoded(data, size)){
+		const char *message = NULL;
+		void *decoded = payload_decode(data, size, &size, &message);
+		free(data);
+		data = decoded;
+		if (data == NULL)
+			ON_ERR(t->d->database, message);
+	}
 
-			}
+	header = split_index(t->d->database,
+			data, size, SNAPSHOT_MAGIC, &body, &body_len);
+	if (header == NULL){
+		ON_ERR(t->d->database, STR("ERROR broken snapshot: %s", path));
+		free(data);
+		return -1;
+	}
+
+	// count and time of last download of device which made
+	// snapshot (not in snapshots of older versions)
+	*mark = s->cutoff - 1;
+	line = strtok_r(header + strlen(SNAPSHOT_MAGIC), "\n", &p);
+	if (line)
+		sscanf(line, "%d %ld", &count, mark);
+	if (count > 0)
+		entries = MALLOC(count * sizeof(struct snapshot_entry));
+	if (entries){
+		while (n < count && (line = strtok_r(NULL, "\n", &p))) {
+			struct snapshot_entry *e = &entries[n];
+			if (sscanf(line, "%d %ld %36s %zu %zu %zu",
+						&e->deleted, &e->timestamp, e->uuid,
+						&e->offset, &e->length, 
+						&e->versions_length) != 6)
+				break;
+			if (e->offset > body_len || 
+					e->length > body_len - e->offset ||
+					e->versions_length > 
+						body_len - e->offset - e->length)
+				break;
+			n++;
 		}
-	} while(0);
-}
+	}
+	free(header);
 
-static void parse_json(
-		void *json, size_t size, void *data, const char *error)
-{
-	struct ddata_node *node = data;
-	cJSON *object;
+	if (n != count){
+		ON_ERR(t->d->database, 
+				STR("ERROR broken snapshot index: %s", path));
+		free(entries);
+		free(data);
+		return -1;
+	}
 
-	ON_LOG(node->t->d->database, 
-		STR("parsing JSON with path: app:/%s/%s/%s/%ld",
-		node->deleted?DELETED:UPDATES, 
-		node->tablename, node->uuid, node->timestamp));
+	// table without rows and changes is loaded without
+	// comparing with local rows
+	snprintf(SQL, BUFSIZ,
+			"SELECT 1 FROM '%s' UNION ALL "
+			"SELECT 1 FROM _kdata2_updates WHERE tablename = '%s' "
+			"LIMIT 1;",
+			s->tablename, s->tablename);
+	local = kdata2_get_string(t->d->database, SQL);
+	if (local)
+		free(local);
+	else
+		loader = row_loader_new(t->d->database, s->tablename);
 
-	if (error)
-		ON_ERR(node->t->d->database, error);
+	ON_LOG(t->d->database, 
+			STR("apply snapshot of %d rows%s", count,
+				loader?" to empty table":""));
 
-	if (json)
-	{
-		object = cJSON_ParseWithLength(
-				(const char *)json, size);
-		free(json);
-		if (object){
-			json_to_database(node, object);
-			return;
+	// rows of batch are prefetched, then applied
+	for (i = 0; i < count && err == 0 && !SYNC_CANCELLED(t->d); ) {
+		int k;
+
+		for (k = 0; i + k < count && k < APPLY_BATCH &&
+				t->prefetched_size < APPLY_BATCH_BYTES &&
+				!SYNC_CANCELLED(t->d); ++k) 
+		{
+			struct snapshot_entry *e = &entries[i + k];
+			if (e->deleted)
+				continue;
+			err = row_prefetch(
+					t->d->database,
+					s->tablename,
+					e->uuid,
+					e->timestamp,
+					body + e->offset,
+					e->length,
+					body + e->offset + e->length,
+					e->versions_length,
+					t,
+					prefetch_blob);
+			if (err)
+				break;
 		}
+
+		if (err == 0)
+			err = apply_snapshot_batch(t, s, loader, body, &entries[i], k);
+		prefetch_free(t);
+		i += k;
 	}
-		
-	ON_ERR(node->t->d->database, 
-		STR("ERROR parsing JSON with path: app:/%s/%s/%s/%ld",
-		node->deleted?DELETED:UPDATES, 
-		node->tablename, node->uuid, node->timestamp));
+
+	if (err){
+		ON_ERR(t->d->database, 
+			STR("ERROR applying snapshot: %s", path));
+	} else if (SYNC_CANCELLED(t->d)){
+		ON_LOG(t->d->database, 
+			STR("snapshot is applied again on next sync: %s", path));
+		err = -1;
+	}
+
+	row_loader_free(loader);
+	free(entries);
+	free(data);
+	return err;
 }
 
-static int download_node(struct ddata_node *node)
-{	
-	int err = 0;
-	char path[BUFSIZ];
+static int for_each_snapshot(void *data, const char *filename)
+{
+	struct ddata_t *t = data;
+	struct snapshot_name s, *p;
+	char *token;
+	int i = 0;
 
-	assert(node);
-	assert(node->t);
-	assert(node->t->d);
-	assert(node->t->d->database);
+	memset(&s, 0, sizeof(s));
+	strtok_foreach(filename, ".", token) {
+		if (i == 0)
+			s.cutoff = atol(token);
+		else if (i == 1)
+			strncpy(s.tablename, token, sizeof(s.tablename) - 1);
+		else if (i == 2)
+			strncpy(s.uuid, token, sizeof(s.uuid) - 1);
+		i++;
+	}
+	if (i != 3 || s.cutoff <= 0)
+		return 0;
 
-	ON_LOG(node->t->d->database, 
-			STR("Making %s for uuid: %s timestamp: %ld", 
-				"downloads",
-				node->uuid, node->timestamp));
+	// snapshots are sorted - older snapshots have no new
+	// changes
+	if (s.cutoff <= t->last_update)
+		return 1;
 
-	snprintf(path, BUFSIZ, "app:/%s/%ld.%s.%s",
-			node->deleted?DELETED:UPDATES, 
-			node->timestamp,
-			node->tablename, node->uuid);
-	
-	err = c_yandex_disk_download_data(
-		node->t->d->access_token, 
-		path, 
-		true, 
-		node, 
-		parse_json,
-		node->t->d->file_progressp, 
-		node->t->d->file_progress);
-
-	if (node->t->d->progress)
-		node->t->d->progress(
-				node->t->d->progressp, 
-				PPHASE_DOWNLOADING, 
-				++node->t->d->current, 
-				node->t->d->total);
+	// newer snapshot of table is in list
+	for (i = 0; i < t->nsnapshots; ++i) {
+		if (strcmp(t->snapshots[i].tablename, s.tablename) == 0)
+			return 0;
+	}
+
+	p = realloc(t->snapshots, 
+			(t->nsnapshots + 1) * sizeof(struct snapshot_name));
+	if (p == NULL){
+		ON_ERR(t->d->database, "memory allocation error"); 
+		return 1;
+	}
+	t->snapshots = p;
+	t->snapshots[t->nsnapshots++] = s;
 
 	return 0;
 }
 
-
-static int delete_node(struct ddata_node *node)
+/* apply snapshots newer then last update - changes before
+ * high-water mark of snapshots are not listed then */
+static int apply_snapshots(struct ddata_t *t)
 {
-	// remove from database
-	int err = 0;
-	char SQL[BUFSIZ];
-
-	ON_LOG(node->t->d->database, 
-			STR("Making %s for uuid: %s timestamp: %ld", 
-				"deleting",
-				node->uuid, node->timestamp));
-	
-	sprintf(SQL, 
-			"DELETE FROM '%s' WHERE %s = '%s';",
-			node->tablename, UUIDCOLUMN, node->uuid);
+	char path[BUFSIZ], *error = NULL;
+	long high_water = 0, mark;
+	int i, err = 0;
+	uint64_t start;
 
-	err = kdata2_sqlite3_exec(node->t->d->database, SQL);
+	snprintf(path, BUFSIZ, "app:/%s", SNAPSHOTS);
 
-	if (node->t->d->progress)
-		node->t->d->progress(
-				node->t->d->progressp, 
-				PPHASE_DELETING, 
-				++node->t->d->current, 
-				node->t->d->total);
+	start = kdata2_stats_now();
+	t->d->backend->list_sorted(
+				t->d->backend, 
+				path, 
+				t, 
+				for_each_snapshot,
+				&error);
+	kdata2_stats_record(t->d->database, KDATA2_STAT_SYNC_LIST, start);
 
-	return err;
-}
+	if (error){
+		ON_ERR(t->d->database, error);
+		free(error);
+	}
 
-static int local_remote_timestamp_cmp(
-		struct ddata_t *t, struct ddata_node *node)
-{
-	int timestamp_local = 0;
-	char path[BUFSIZ]; char SQL[BUFSIZ], *timestamp_local_str;
-	
-	snprintf(SQL, BUFSIZ, 
-			"SELECT timestamp FROM '%s' "
-			"WHERE %s = '%s';",
-			node->tablename, UUIDCOLUMN, node->uuid);
+	for (i = 0; i < t->nsnapshots && !SYNC_CANCELLED(t->d); ++i) {
+		if (apply_snapshot(t, &t->snapshots[i], &mark))
+			err = -1;
+		if (high_water == 0 || mark < high_water)
+			high_water = mark;
+	}
+	if (i < t->nsnapshots)
+		err = -1;
 
-	timestamp_local_str = 
-		kdata2_get_string(t->d->database, SQL); 
-	
-	if (timestamp_local_str)
-		timestamp_local = atol(timestamp_local_str);
+	// buckets before cutoff are removed by compaction and
+	// changes before mark are in snapshots - continue from
+	// high-water mark of all tables
+	if (err == 0 && high_water > t->last_update)
+		t->last_update = high_water;
 
-	ON_LOG(t->d->database, 
-			STR("Check %s timestamp: %ld(local): %ld(remote) for uuid: %s", 
-				node->deleted?"delete":"update",
-				timestamp_local,
-				node->timestamp, node->uuid));
+	free(t->snapshots);
+	t->snapshots = NULL;
+	t->nsnapshots = 0;
 
-	return timestamp_local - node->timestamp;
+	return err;
 }
 
 static struct ddata_node *node_from_filename(
@@ -303,7 +1670,7 @@ static struct ddata_node *node_from_filename(
 	assert(t->d->database);
 
 
-	ON_LOG(t->d->database, 
+	ON_DBG(t->d->database, 
 		STR("check timestamp for filename: %s", filename));
 
 	node = NEW(struct ddata_node);
@@ -345,53 +1712,247 @@ static struct ddata_node *node_from_filename(
 	return node;
 }
 
-static int for_each_filename(
-		const c_yd_file_t *file, void *data, const char *error)
+static int for_each_filename(void *data, const char *filename)
 {
 	struct ddata_t *t = data;
 	char path[BUFSIZ];
 
-	if (error)
-		ON_ERR(t->d->database, error);
-
-	if (file)
+	if (filename)
 	{
 		struct ddata_node *node = 
-			node_from_filename(t, file->name);
+			node_from_filename(t, filename);
 		if (node == NULL)
 			return 0;
 
 		// check last update
-		ON_LOG(t->d->database, 
+		ON_DBG(t->d->database, 
 				STR("timestamps: %ld(last_update) %ld(remote)", 
 				t->last_update, node->timestamp));
 
 		if (node->timestamp <= t->last_update){
-			ON_LOG(t->d->database, "no need to download");
+			ON_DBG(t->d->database, "no need to download");
 			free(node);
 			return 1; // stop listing files
 		}
 
-		// check local timestamp
-		if (local_remote_timestamp_cmp(t, node) < 0){
-			ON_LOG(t->d->database, "add to download list");
-		} else {
-			ON_LOG(t->d->database, "skip from download list");
-			free(node);
-			return 0; // continue listing files
+		// local timestamps of deleted are checked after
+		// listing - columns of rows are checked when row is
+		// applied (local row may be newer but have older
+		// columns)
+		ON_DBG(t->d->database, "add to download list");
+
+		plan_add(t, node);
+	}
+
+	return 0;
+}
+
+/* node from file name in bucket:
+ * uploaded.timestamp.kind.tablename.uuid */
+static struct ddata_node *node_from_change(
+		struct ddata_t *t, const char *filename)
+{
+	int i = 0;
+	char *token = NULL;
+	struct ddata_node *node = NULL;
+
+	node = NEW(struct ddata_node);
+	if (node == NULL){
+		ON_ERR(t->d->database, "memory allocation error"); 
+		return NULL;
+	}
+
+	node->t = t;
+	node->bucket = t->bucket;
+
+	strtok_foreach(filename, ".", token){
+		switch (i) {
+			case 0:
+				node->uploaded = atol(token);
+				break;
+			case 1:
+				node->timestamp = atol(token);
+				break;
+			case 2:
+				node->deleted = token[0] == CHANGE_DELETE;
+				strncpy(node->kind, token, sizeof(node->kind) - 1);
+				// bitmap of columns after kind of update
+				if (!node->deleted && isxdigit((unsigned char)token[1])){
+					node->columns = strtoull(token + 1, NULL, 16);
+					node->columns_known = 1;
+				}
+				break;
+			case 3:
+				strncpy(node->tablename, token, sizeof(node->tablename) - 1);
+				break;
+			case 4:
+				strncpy(node->uuid, token, sizeof(node->uuid) - 1);
+				break;
+			
+			default:
+				break;
 		}
 
-		if (list_add(&t->to_download, node) == 0)
-			t->d->total++;
+		i++;
+	}
+
+	if (i != 5){
+		ON_ERR(t->d->database, 
+				STR("corrupted data for filename: %s", filename));
+		free(node);
+		return NULL;
+	}
+
+	return node;
+}
+
+static int for_each_change(void *data, const char *filename)
+{
+	struct ddata_t *t = data;
+	struct ddata_node *node;
+
+	if (filename == NULL || strcmp(filename, MANIFEST) == 0)
+		return 0;
+
+	node = node_from_change(t, filename);
+	if (node == NULL)
+		return 0;
+
+	// files are sorted by upload time - names of files in
+	// grace window may be stamped before last update
+	if (node->uploaded <= t->last_update - CHANGES_GRACE_SEC){
+		free(node);
+		return 1; // stop listing files
+	}
+
+	plan_add(t, node);
+
+	return 0;
+}
+
+static int for_each_bucket(void *data, const char *name)
+{
+	struct ddata_t *t = data;
+	char *end;
+	long bucket, *p;
+
+	bucket = strtol(name, &end, 10);
+	if (*end || bucket <= 0)
+		return 0;
+
+	// buckets are sorted - older buckets have no new files
+	if (bucket + CHANGES_BUCKET_SEC <= 
+			t->last_update - CHANGES_GRACE_SEC)
+		return 1;
+
+	p = realloc(t->buckets, (t->nbuckets + 1) * sizeof(long));
+	if (p == NULL){
+		ON_ERR(t->d->database, "memory allocation error"); 
+		return 1;
 	}
+	t->buckets = p;
+	t->buckets[t->nbuckets++] = bucket;
 
 	return 0;
 }
 
+/* last write time of bucket or 0 if unknown */
+static time_t read_manifest(struct ddata_t *t, long bucket)
+{
+	char path[BUFSIZ], *error = NULL;
+	void *data = NULL;
+	size_t size = 0;
+	time_t manifest = 0;
+
+	snprintf(path, BUFSIZ, "app:/%s/%010ld/%s", 
+			CHANGES, bucket, MANIFEST);
+	t->d->backend->get(t->d->backend, path, &data, &size, &error);
+	free(error);
+
+	if (data && size < 32){
+		char buf[32];
+		memcpy(buf, data, size);
+		buf[size] = 0;
+		manifest = atol(buf);
+	}
+	free(data);
+
+	return manifest;
+}
+
+/* list buckets newer then last update and files of buckets
+ * with manifest newer then last update (both overlapped by
+ * CHANGES_GRACE_SEC) */
+static int prepare_changes_list(struct ddata_t *t)
+{
+	int i, err = 0;
+	char path[BUFSIZ], *error = NULL;
+	uint64_t start;
+
+	snprintf(path, BUFSIZ, "app:/%s", CHANGES);
+
+	start = kdata2_stats_now();
+	err = t->d->backend->list_sorted(
+				t->d->backend, 
+				path, 
+				t, 
+				for_each_bucket,
+				&error);
+	kdata2_stats_record(t->d->database, KDATA2_STAT_SYNC_LIST, start);
+
+	if (error){
+		ON_ERR(t->d->database, error);
+		free(error);
+		error = NULL;
+	}
+
+	for (i = 0; i < t->nbuckets && !SYNC_CANCELLED(t->d); ++i) {
+		char bucket_path[BUFSIZ];
+		time_t manifest;
+
+		t->bucket = t->buckets[i];
+		start = kdata2_stats_now();
+		manifest = read_manifest(t, t->bucket);
+		if (manifest && 
+				manifest <= t->last_update - CHANGES_GRACE_SEC)
+		{
+			kdata2_stats_record(t->d->database, 
+					KDATA2_STAT_SYNC_LIST, start);
+			continue;
+		}
+
+		snprintf(bucket_path, BUFSIZ, "%s/%010ld", path, t->bucket);
+		ON_LOG(t->d->database, 
+				STR("search updates in: %s", bucket_path));
+
+		err = t->d->backend->list_sorted(
+					t->d->backend, 
+					bucket_path, 
+					t, 
+					for_each_change,
+					&error);
+		kdata2_stats_record(t->d->database, KDATA2_STAT_SYNC_LIST, start);
+
+		if (error){
+			ON_ERR(t->d->database, error);
+			free(error);
+			error = NULL;
+		}
+	}
+
+	free(t->buckets);
+	t->buckets = NULL;
+	t->nbuckets = 0;
+	t->bucket = 0;
+
+	return err;
+}
+
 static int prepare_updates_list(struct ddata_t *t)
 {
 	int err = 0;
-	char path[BUFSIZ];
+	char path[BUFSIZ], *error = NULL;
+	uint64_t start;
 
 	snprintf(path, BUFSIZ, "app:/%s",
 			t->deleted?DELETED:UPDATES);
@@ -399,22 +1960,86 @@ static int prepare_updates_list(struct ddata_t *t)
 	ON_LOG(t->d->database, 
 			STR("search updates in: %s", path));
 
-	err = c_yandex_disk_sort_ls(
-				t->d->access_token, 
+	start = kdata2_stats_now();
+	err = t->d->backend->list_sorted(
+				t->d->backend, 
 				path, 
-				"-name",
-				0,
 				t, 
-				for_each_filename);
+				for_each_filename,
+				&error);
+	kdata2_stats_record(t->d->database, KDATA2_STAT_SYNC_LIST, start);
+
+	if (error){
+		ON_ERR(t->d->database, error);
+		free(error);
+	}
 
 	return err;
 }
 
+/* add failed changes which are due to plan */
+static int prepare_retries_list(struct ddata_t *t)
+{
+	kdata2_t *d = t->d->database;
+	char SQL[BUFSIZ];
+	sqlite3_stmt *stmt;
+	long bucket = t->bucket;
+	int deleted = t->deleted, res, count = 0;
+
+	snprintf(SQL, BUFSIZ,
+			"SELECT item FROM %s WHERE download = 1 "
+			"AND next_try <= %ld;", RETRY, (long)t->start_of_update);
+	if (kdata2_sqlite3_prepare(d, SQL, &stmt))
+		return -1;
+
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *path = (const char *)sqlite3_column_text(stmt, 0);
+		const char *name;
+		struct ddata_node *node = NULL;
+		size_t len;
+		
+		if (path == NULL)
+			continue;
+		name = strrchr(path, '/');
+		if (name == NULL)
+			continue;
+		name++;
+
+		len = strlen("app:/" CHANGES "/");
+		if (strncmp(path, "app:/" CHANGES "/", len) == 0){
+			t->bucket = atol(path + len);
+			node = node_from_change(t, name);
+		} else {
+			t->bucket = 0;
+			t->deleted = 
+				strncmp(path, "app:/" DELETED "/", 
+						strlen("app:/" DELETED "/")) == 0;
+			node = node_from_filename(t, name);
+		}
+		if (node == NULL)
+			continue;
+
+		ON_DBG(d, STR("retry change: %s", path));
+		plan_add(t, node);
+		count++;
+	}
+	if (res != SQLITE_DONE)
+		ON_ERR(d, STR("sqlite3_step: %s", sqlite3_errmsg(d->db)));
+	sqlite3_finalize(stmt);
+
+	t->bucket = bucket;
+	t->deleted = deleted;
+
+	if (count)
+		ON_LOG(d, STR("retry %d failed changes", count));
+	return 0;
+}
+
 static int apply_updates_list(struct ddata_t *t)
 {
-	struct ddata_node *node = NULL;
+	struct ddata_node **nodes;
 	pphase phase = PPHASE_DOWNLOADING;
-	char SQL[BUFSIZ];
+	int i, count = 0;
 
 	if (t->deleted)
 		phase = PPHASE_DELETING;
@@ -426,22 +2051,22 @@ static int apply_updates_list(struct ddata_t *t)
 				t->d->current, 
 				t->d->total);
 
-	list_for_each(t->to_download, node)
-	{
-		if (node->deleted)
-			delete_node(node);
-		else
-			download_node(node);
-		free(node);
-	}
-	list_free(&t->to_download);
-	t->to_download = NULL;
+	nodes = plan_take(t, t->deleted, &count);
+	if (nodes == NULL)
+		return -1;
 
-	snprintf(SQL, BUFSIZ, 
-			"UPDATE _yandexdisk_updates SET "
-			"YANDEX_DISK_UPLOADED = %ld;",
-			t->start_of_update);
-	kdata2_sqlite3_exec(t->d->database, SQL);
+	if (t->deleted){
+		for (i = 0; i < count && !SYNC_CANCELLED(t->d); ) {
+			int k = count - i < APPLY_BATCH?count - i:APPLY_BATCH;
+			apply_nodes(t, &nodes[i], k, PPHASE_DELETING);
+			i += k;
+		}
+	} else 
+		download_nodes(t, nodes, count);
+
+	for (i = 0; i < count; ++i)
+		free(nodes[i]);
+	free(nodes);
 
 	return 0;
 }
@@ -450,7 +2075,7 @@ void download_from_yandex_disk(kdydm_t *d)
 {
 	int i, ret = 0, updates = 0;
 	struct ddata_t t;
-	char SQL[BUFSIZ], *last_update = NULL;
+	char SQL[BUFSIZ], *last_update = NULL, *staged = NULL;
 		
 	assert(d);
 	assert(d->database);
@@ -463,28 +2088,83 @@ void download_from_yandex_disk(kdydm_t *d)
 	d->total = 0;
 
 	if (d->progress)
-		d->progress(d->progressp, PPHASE_COUNTING, 0, 2);
+		d->progress(d->progressp, PPHASE_COUNTING, 0, 3);
 
 	// get timestamp of last update
 	snprintf(SQL, BUFSIZ, 
 			"SELECT YANDEX_DISK_UPLOADED FROM _yandexdisk_updates");
 	last_update = kdata2_get_string(d->database, SQL); 	
-	if (last_update)
+	if (last_update){
 		t.last_update = atol(last_update);
+		free(last_update);
+	}
+
+	// chunks of failed downloads
+	snprintf(SQL, BUFSIZ, "SELECT 1 FROM %s LIMIT 1", CHUNKS);
+	staged = kdata2_get_string(d->database, SQL); 	
+	if (staged){
+		t.staged = 1;
+		free(staged);
+	}
 	
-	// check for updates and deleted
+	// snapshots of compacted changes, then updates and
+	// deleted in buckets and in flat folders of older versions
+	apply_snapshots(&t);
+
+	d->current_table = 0;
+	prepare_changes_list(&t);
+	if (d->progress)
+		d->progress(d->progressp, PPHASE_COUNTING, 
+				++d->current_table, 3);
+
 	for (i = 0; i < 2; ++i) {
-		d->current_table = 0;
 		t.deleted = i;
 
 		prepare_updates_list(&t);
 
 		if (d->progress)
 			d->progress(d->progressp, PPHASE_COUNTING, 
-					++d->current_table, 2);
+					++d->current_table, 3);
+	}
+	prepare_retries_list(&t);
+	filter_deletes(&t);
 
+	for (i = 0; i < 2; ++i) {
+		t.deleted = i;
 		apply_updates_list(&t);
 	}
+	apply_free(&t);
+
+	// not applied changes are listed again on next sync
+	if (SYNC_CANCELLED(d)){
+		ON_LOG(d->database, "download is cancelled");
+	} else {
+		snprintf(SQL, BUFSIZ, 
+				"UPDATE _yandexdisk_updates SET "
+				"YANDEX_DISK_UPLOADED = %ld;",
+				t.start_of_update);
+		kdata2_sqlite3_exec(d->database, SQL);
+
+		// retried changes are applied, superseded or failed
+		// again (next try is later)
+		snprintf(SQL, BUFSIZ, 
+				"DELETE FROM %s WHERE download = 1 "
+				"AND next_try <= %ld;",
+				RETRY, (long)t.start_of_update);
+		kdata2_sqlite3_exec(d->database, SQL);
+		if (t.staged){
+			snprintf(SQL, BUFSIZ, 
+					"DELETE FROM %s WHERE NOT EXISTS "
+					"(SELECT 1 FROM %s WHERE download = 1);",
+					CHUNKS, RETRY);
+			kdata2_sqlite3_exec(d->database, SQL);
+		}
+	}
+
+	for (i = 0; i < BLOB_CACHE; ++i)
+		free(t.blobs[i].data);
+	uuidmap_free(&t.local);
+	plan_free(&t);
 
 	//for (i = 0; i < 2; ++i) {
 		//t.deleted = i;
@@ -1,26 +1,31 @@
 #include "internal.h"
 #include "yandexdisk.h"
 #include "cYandexDisk/alloc.h"
-#include "cYandexDisk/cYandexDisk.h"
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static void * thread(void *data);
+static void on_change(void *data, const char *tablename);
+static int transfer_progress(
+		void *data, double dltotal, double dlnow,
+		double ultotal, double ulnow);
 
 kdydm_t *
 yandex_disk_module_init(
 		kdata2_t      * database, 
-		const char    * access_token,
+		kdbackend_t   * backend,
 		int sec
 	  )
 {
 	kdydm_t *module;
 	
 	assert(database);
-	assert(access_token);
+	assert(backend);
 
 	module = NEW(kdydm_t);
 	if (module == NULL)
@@ -31,11 +36,34 @@ yandex_disk_module_init(
 		free(module);
 		return NULL;
 	}
+	if (pthread_mutex_init(&module->wake_mutex, NULL))
+	{
+		pthread_mutex_destroy(&module->mutex);
+		free(module);
+		return NULL;
+	}
+	if (pthread_cond_init(&module->wake, NULL))
+	{
+		pthread_mutex_destroy(&module->wake_mutex);
+		pthread_mutex_destroy(&module->mutex);
+		free(module);
+		return NULL;
+	}
 
 	module->database = database;
-	strncpy(module->access_token, access_token, 
-			sizeof(module->access_token));
+	module->backend = backend;
 	module->sec = sec;
+	module->upload_threads = YANDEX_DISK_UPLOAD_THREADS;
+	module->download_threads = YANDEX_DISK_DOWNLOAD_THREADS;
+	module->compact_age = 0;
+	module->json = 1;
+	module->debounce_ms = YANDEX_DISK_DEBOUNCE_MS;
+	module->idle_max = YANDEX_DISK_IDLE_MAX_SEC;
+	uuid_new(module->device);
+
+	// transfers are aborted when module is unloaded
+	backend->progressp = module;
+	backend->progress  = transfer_progress;
 
 	return module;
 }
@@ -57,6 +85,10 @@ int yandex_disk_module_start(kdydm_t *d)
 		ON_ERR(d->database, STR("can't create thread: %d", err));		
 		return err;
 	}
+	d->started = 1;
+
+	// local changes wake sync thread
+	kdata2_add_on_change(d->database, d, on_change);
 	
 	return 0;
 }
@@ -64,26 +96,41 @@ int yandex_disk_module_start(kdydm_t *d)
 void main_loop(kdydm_t *d)
 {
 	upload_to_yandex_disk(d);
-	download_from_yandex_disk(d);
+	if (!SYNC_CANCELLED(d))
+		download_from_yandex_disk(d);
+	if (!SYNC_CANCELLED(d))
+		compact_yandex_disk(d);
 }
 
-void * thread(void *data)
+static void prepare(kdydm_t *d)
 {
-	kdydm_t *d = data; 
 	char SQL[BUFSIZ];
 
 	assert(d);
 	assert(d->database);
+	assert(d->backend);
 
 	/* Create Yandex Disk database */
-	c_yandex_disk_mkdir(
-						d->access_token, 
+	d->backend->mkdir(
+						d->backend, 
 						STR("app:/%s", DELETED  ), 
 						NULL);
-	c_yandex_disk_mkdir(
-						d->access_token, 
+	d->backend->mkdir(
+						d->backend, 
 						STR("app:/%s", UPDATES), 
 						NULL);	
+	d->backend->mkdir(
+						d->backend, 
+						STR("app:/%s", BLOBS_DIR), 
+						NULL);	
+	d->backend->mkdir(
+						d->backend, 
+						STR("app:/%s", CHANGES), 
+						NULL);	
+	d->backend->mkdir(
+						d->backend, 
+						STR("app:/%s", SNAPSHOTS), 
+						NULL);	
 		
 	sprintf(SQL, 
 			"CREATE TABLE IF NOT EXISTS "
@@ -100,6 +147,40 @@ void * thread(void *data)
 				"ADD COLUMN 'YANDEX_DISK_UPLOADED' INT;");
 	kdata2_sqlite3_exec(d->database, SQL);
 
+	// versions of columns (see rowcodec.h)
+	sprintf(SQL, 
+				"ALTER TABLE _kdata2_updates "
+				"ADD COLUMN 'YANDEX_DISK_COLUMNS' BLOB;");
+	kdata2_sqlite3_exec(d->database, SQL);
+
+	// local change in the same second as upload has the
+	// same timestamp - setters count changes in seq, so
+	// clear mark of uploaded (downloaded rows keep seq)
+	sprintf(SQL,
+			"CREATE TRIGGER IF NOT EXISTS _yandexdisk_changed "
+			"AFTER UPDATE OF seq ON _kdata2_updates BEGIN "
+			"UPDATE _kdata2_updates SET YANDEX_DISK_UPLOADED = NULL "
+			"WHERE rowid = NEW.rowid; END;");
+	kdata2_sqlite3_exec(d->database, SQL);
+
+	sprintf(SQL, 
+			"CREATE TABLE IF NOT EXISTS "
+			"%s (hash TEXT PRIMARY KEY);", BLOBS);
+	kdata2_sqlite3_exec(d->database, SQL);
+
+	// failed transfers (see retry.h) and chunks of failed
+	// downloads
+	sprintf(SQL, 
+			"CREATE TABLE IF NOT EXISTS "
+			"%s (item TEXT PRIMARY KEY, download INT, "
+			"attempts INT, next_try INT);", RETRY);
+	kdata2_sqlite3_exec(d->database, SQL);
+
+	sprintf(SQL, 
+			"CREATE TABLE IF NOT EXISTS "
+			"%s (hash TEXT PRIMARY KEY, data BLOB);", CHUNKS);
+	kdata2_sqlite3_exec(d->database, SQL);
+
 	/* Create YD column in each table */
 	do {
 		kdata2_table_for_each(d->database) {
@@ -110,18 +191,139 @@ void * thread(void *data)
 			kdata2_sqlite3_exec(d->database, SQL);
 		}
 	} while (0);
+}
+
+/* Conception:
+ * Sync thread sleeps on condition variable. Setters of
+ * database signal it - cycle starts when no other changes are
+ * made for debounce time (but not later then update interval
+ * after first change), so edits are uploaded at once and
+ * series of edits in one cycle. Without local changes remote
+ * is checked after interval which is doubled after each cycle
+ * which downloaded nothing up to idle_max */
+
+static void _add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L){
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static int _ts_cmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec?-1:1;
+	if (a->tv_nsec != b->tv_nsec)
+		return a->tv_nsec < b->tv_nsec?-1:1;
+	return 0;
+}
+
+/* progress of backend transfer - nonzero aborts it */
+static int transfer_progress(
+		void *data, double dltotal, double dlnow,
+		double ultotal, double ulnow)
+{
+	kdydm_t *d = data;
+
+	if (SYNC_CANCELLED(d))
+		return 1;
+	if (d->file_progress)
+		return d->file_progress(d->file_progressp,
+				dltotal, dlnow, ultotal, ulnow);
+	return 0;
+}
+
+/* called in thread which changed database */
+static void on_change(void *data, const char *tablename)
+{
+	kdydm_t *d = data;
+
+	// rows applied by sync thread are not local changes
+	if (d->started && pthread_equal(pthread_self(), d->tid))
+		return;
+
+	pthread_mutex_lock(&d->wake_mutex);
+	clock_gettime(CLOCK_REALTIME, &d->last_change);
+	if (!d->changed)
+		d->first_change = d->last_change;
+	d->changed = 1;
+	pthread_cond_broadcast(&d->wake);
+	pthread_mutex_unlock(&d->wake_mutex);
+}
+
+/* wait sec seconds or local change - return 1 if woken by
+ * change or yandex_disk_sync_now */
+static int wait_for_trigger(kdydm_t *d, int sec)
+{
+	struct timespec poll, ts, now;
+	int triggered;
+
+	clock_gettime(CLOCK_REALTIME, &poll);
+	_add_ms(&poll, sec * 1000L);
+
+	pthread_mutex_lock(&d->wake_mutex);
+	while (d->do_update && !d->sync_now) {
+		ts = poll;
+		if (d->changed){
+			struct timespec quiet = d->last_change;
+			struct timespec limit = d->first_change;
+			_add_ms(&quiet, d->debounce_ms);
+			_add_ms(&limit, d->sec * 1000L);
+			if (_ts_cmp(&quiet, &ts) < 0)
+				ts = quiet;
+			if (_ts_cmp(&limit, &ts) < 0)
+				ts = limit;
+		}
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (_ts_cmp(&ts, &now) <= 0)
+			break;
+		pthread_cond_timedwait(&d->wake, &d->wake_mutex, &ts);
+	}
+	triggered = d->changed || d->sync_now;
+	d->changed = 0;
+	d->sync_now = 0;
+	pthread_mutex_unlock(&d->wake_mutex);
+
+	return triggered;
+}
+
+void * thread(void *data)
+{
+	kdydm_t *d = data; 
+	int interval, triggered = 1;
+
+	assert(d);
+	assert(d->database);
+
+	prepare(d);
+	interval = d->sec;
 	
 	// run main loop
 	while (d->do_update) {
 		ON_LOG(d->database, "updating data...");	
 		main_loop(d);
-#ifdef _WIN32
-			Sleep(d->sec*1000);
-#else
-			sleep(d->sec);
-#endif
+
+		// check remote less often while nothing changes
+		if (triggered || d->total || d->idle_max <= d->sec)
+			interval = d->sec;
+		else if (interval < d->idle_max){
+			interval *= 2;
+			if (interval > d->idle_max)
+				interval = d->idle_max;
+		}
+		ON_DBG(d->database, STR("next check in %d sec", interval));
+
+		triggered = wait_for_trigger(d, interval);
 	}
 
+	pthread_mutex_lock(&d->wake_mutex);
+	d->stopped = 1;
+	pthread_cond_broadcast(&d->wake);
+	pthread_mutex_unlock(&d->wake_mutex);
+
 	pthread_exit(0);
 }
 
@@ -132,31 +334,135 @@ kdydm_t * yandex_disk_module_load(
 		int (*progress)(
 			void *progressp, pphase phase, int current, int total)
 	  )
+{
+	kdydm_t *d;
+	kdbackend_t *backend;
+
+	assert(access_token);
+	
+	backend = yandex_disk_backend_new(access_token);
+	if (backend == NULL)
+		return NULL;
+
+	d = yandex_disk_module_load_with_backend(
+			database, backend, progressp, progress);
+	if (d == NULL)
+		kdata_backend_free(backend);
+
+	return d;
+}
+
+kdydm_t * yandex_disk_module_load_with_backend(
+		kdata2_t    * database, 
+		kdbackend_t * backend,
+		void *progressp,
+		int (*progress)(
+			void *progressp, pphase phase, int current, int total)
+	  )
 {
 	kdydm_t *d = yandex_disk_module_init(
-			database, access_token, YANDEX_DISK_UPDATE_SEC);
+			database, backend, YANDEX_DISK_UPDATE_SEC);
 	if (d)
 	{
 		d->progressp = progressp;
 		d->progress  = progress;
-		yandex_disk_module_start(d);
+		if (yandex_disk_module_start(d)){
+			pthread_cond_destroy(&d->wake);
+			pthread_mutex_destroy(&d->wake_mutex);
+			pthread_mutex_destroy(&d->mutex);
+			free(d);
+			return NULL;
+		}
 	}
 
 	return d;
 }
 
+kdydm_t * yandex_disk_module_new(
+		kdata2_t    * database, 
+		kdbackend_t * backend)
+{
+	return yandex_disk_module_init(
+			database, backend, YANDEX_DISK_UPDATE_SEC);
+}
 
-int yandex_disk_module_unload(kdydm_t *d)
+int yandex_disk_module_sync(kdydm_t *d)
 {
-	if (d)
-	{
-		d->do_update = 0;
-		pthread_join(d->tid, NULL);
-		free(d);
-		return 0;
+	if (d == NULL || d->started)
+		return -1;
+
+	if (!d->prepared){
+		prepare(d);
+		d->prepared = 1;
+	}
+	main_loop(d);
+
+	return 0;
+}
+
+int yandex_disk_sync_now(kdydm_t *d)
+{
+	if (d == NULL || !d->started)
+		return -1;
+
+	pthread_mutex_lock(&d->wake_mutex);
+	d->sync_now = 1;
+	pthread_cond_broadcast(&d->wake);
+	pthread_mutex_unlock(&d->wake_mutex);
+
+	return 0;
+}
+
+int yandex_disk_module_unload_timeout(kdydm_t *d, int ms)
+{
+	struct timespec deadline;
+	int stopped = 1;
+
+	if (d == NULL)
+		return -1;
+
+	// callbacks in other threads use module - wait for them
+	if (d->started)
+		kdata2_remove_on_change(d->database, d, on_change);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	_add_ms(&deadline, ms);
+
+	// stop cycle between items and abort transfers
+	pthread_mutex_lock(&d->wake_mutex);
+	d->do_update = 0;
+	__atomic_store_n(&d->cancel, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&d->wake);
+	if (d->started){
+		while (!d->stopped && ms >= 0) {
+			if (pthread_cond_timedwait(
+						&d->wake, &d->wake_mutex, &deadline) == ETIMEDOUT)
+				break;
+		}
+		stopped = d->stopped || ms < 0;
+	}
+	pthread_mutex_unlock(&d->wake_mutex);
+
+	if (!stopped){
+		ON_ERR(d->database, "sync thread is still running");
+		return 1;
 	}
 
-	return 1;
+	if (d->started)
+		pthread_join(d->tid, NULL);
+	kdata_backend_free(d->backend);
+	pthread_cond_destroy(&d->wake);
+	pthread_mutex_destroy(&d->wake_mutex);
+	pthread_mutex_destroy(&d->mutex);
+	free(d);
+	return 0;
+}
+
+int yandex_disk_module_unload(kdydm_t *d)
+{
+	if (d == NULL)
+		return 1;
+	return yandex_disk_module_unload_timeout(d, -1);
 }
 
 void yandex_disk_set_file_download_progress(
@@ -171,15 +477,102 @@ void yandex_disk_set_file_download_progress(
 		))
 {
 	assert(module);
+	// called from transfer_progress
 	module->file_progressp = file_progressp;
-	module->file_progressp = file_progress;
+	module->file_progress  = file_progress;
 }
 
 
 int yandex_disk_set_token(kdydm_t *d, const char *token)
+{
+	if (d == NULL || d->backend->set_token == NULL)
+		return 1;
+	return d->backend->set_token(d->backend, token);
+}
+
+int yandex_disk_set_upload_threads(kdydm_t *d, int threads)
+{
+	if (d == NULL)
+		return 1;
+	if (threads < 1)
+		threads = 1;
+	if (threads > YANDEX_DISK_UPLOAD_THREADS_MAX)
+		threads = YANDEX_DISK_UPLOAD_THREADS_MAX;
+	d->upload_threads = threads;
+	return 0;
+}
+
+int yandex_disk_set_download_threads(kdydm_t *d, int threads)
+{
+	if (d == NULL)
+		return 1;
+	if (threads < 1)
+		threads = 1;
+	if (threads > YANDEX_DISK_DOWNLOAD_THREADS_MAX)
+		threads = YANDEX_DISK_DOWNLOAD_THREADS_MAX;
+	d->download_threads = threads;
+	return 0;
+}
+
+int yandex_disk_set_bundle(kdydm_t *d, int bundle)
+{
+	if (d == NULL)
+		return 1;
+	d->bundle = bundle;
+	return 0;
+}
+
+int yandex_disk_set_compression(kdydm_t *d, int level)
+{
+	if (d == NULL)
+		return 1;
+	if (level < 0)
+		level = 0;
+	if (level > 9)
+		level = 9;
+	d->compression = level;
+	return 0;
+}
+
+int yandex_disk_set_json(kdydm_t *d, int json)
+{
+	if (d == NULL)
+		return 1;
+	d->json = json;
+	return 0;
+}
+
+int yandex_disk_set_compaction(kdydm_t *d, int age)
+{
+	if (d == NULL)
+		return 1;
+	if (age < 0)
+		age = 0;
+	// keep at least two buckets
+	if (age && age < 2 * CHANGES_BUCKET_SEC)
+		age = 2 * CHANGES_BUCKET_SEC;
+	d->compact_age = age;
+	return 0;
+}
+
+int yandex_disk_set_debounce(kdydm_t *d, int ms)
+{
+	if (d == NULL)
+		return 1;
+	if (ms < 0)
+		ms = 0;
+	pthread_mutex_lock(&d->wake_mutex);
+	d->debounce_ms = ms;
+	pthread_mutex_unlock(&d->wake_mutex);
+	return 0;
+}
+
+int yandex_disk_set_idle_backoff(kdydm_t *d, int max_sec)
 {
 	if (d == NULL)
 		return 1;
-	strncpy(d->access_token, token, sizeof(d->access_token));
+	if (max_sec < 0)
+		max_sec = 0;
+	d->idle_max = max_sec;
 	return 0;
 }
@@ -2,7 +2,7 @@
  * File              : internal.h
  * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
  * Date              : 21.04.2026
- * Last Modified Date: 06.05.2026
+ * Last Modified Date: 19.10.2026
  * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
  */
 /**
@@ -25,15 +25,21 @@
 #ifndef YANDEX_DISK_STRUCT_H
 #define YANDEX_DISK_STRUCT_H
 #include "../../kdata2.h"
-#include "cYandexDisk/log.h"
+#include "../../log.h"
 #include <pthread.h>
 #include "yandexdisk.h"
+#include "backend.h"
 #include "../../str.h"
 
 #define ON_ERR(ptr, msg) \
-	if (ptr->on_error) ptr->on_error(ptr->on_error_data, msg);
+	if (ptr->on_error && kdata2_log_enabled(ptr, KDATA2_LOG_ERROR)) \
+		kdata2_log(ptr, KDATA2_LOG_ERROR, msg);
 #define ON_LOG(ptr, msg) \
-	if (ptr->on_log) ptr->on_log(ptr->on_log_data, msg);
+	if (ptr->on_log && kdata2_log_enabled(ptr, KDATA2_LOG_INFO)) \
+		kdata2_log(ptr, KDATA2_LOG_INFO, msg);
+#define ON_DBG(ptr, msg) \
+	if (ptr->on_log && kdata2_log_enabled(ptr, KDATA2_LOG_DEBUG)) \
+		kdata2_log(ptr, KDATA2_LOG_DEBUG, msg);
 
 #ifdef _WIN32
 #include <windows.h>
@@ -50,15 +56,87 @@
 //#define DATABASE  "database"
 #define DELETED   "deleted"
 #define UPDATES   "updates"
+#define BUNDLE    "_bundle"        // table name of bundle files
+#define BLOBS     "_yandexdisk_blobs" // hashes of blobs on remote
+#define BLOBS_DIR "blobs"          // content-addressed blobs
+#define CHUNKS    "_yandexdisk_chunks" // chunks of failed downloads
+#define RETRY     "_yandexdisk_retry" // failed transfers
+#define CHANGES   "changes"        // time-bucketed changes
+#define MANIFEST  "manifest"       // last write time of bucket
+
+/* changes are stored in buckets by upload time -
+ * app:/changes/<bucket start>/<upload time>.<row
+ * timestamp>.<u|d>.<tablename>.<uuid>. Bucket start is 10
+ * digits - bucket names are sorted as numbers. Kind of
+ * update may be followed by hex bitmap of columns in row,
+ * kind of row is followed by CHANGE_DEVICE and first chars
+ * of id of device - changes of one row made on two devices
+ * in the same second do not overwrite each other */
+#define CHANGES_BUCKET_SEC 3600
+#define CHANGES_BUCKET(t) ((long)(t) / CHANGES_BUCKET_SEC * CHANGES_BUCKET_SEC)
+/* name of change is stamped before its file is visible -
+ * readers overlap last update by grace window (changes
+ * listed again are collapsed by planner and applied rows are
+ * not changed) */
+#define CHANGES_GRACE_SEC 300
+#define CHANGE_UPDATE 'u'
+#define CHANGE_DELETE 'd'
+#define CHANGE_DEVICE '-'
+
+/* compacted buckets - app:/snapshots/<cutoff>.<tablename>.
+ * <uuid> has all rows of table (and tombstones not older then
+ * YANDEX_DISK_TOMBSTONE_AGE) uploaded before cutoff. Made by
+ * device which holds lease */
+#define SNAPSHOTS "snapshots"
+#define LEASE     "compaction.lease"
+#define LEASE_SEC 600
+#define COMPACT_INTERVAL (24 * 3600)
+
+/* snapshot: header line, number of entries and high-water
+ * mark (all changes uploaded before it are in snapshot),
+ * index line for each entry - "deleted timestamp uuid offset
+ * length versions_length", empty line, then encoded rows,
+ * each followed by versions of its columns (see rowcodec.h) */
+#define SNAPSHOT_MAGIC "KDATA2SNAPSHOT 1\n"
+
+/* bundle: header line, number of entries, index line for
+ * each entry - "deleted timestamp tablename uuid offset
+ * length", empty line, then entries JSON (offsets from
+ * start of entries) */
+#define BUNDLE_MAGIC "KDATA2BUNDLE 1\n"
+
+#define YANDEX_DISK_UPLOAD_THREADS_MAX   64
+#define YANDEX_DISK_DOWNLOAD_THREADS_MAX 64
 
 struct kdata_yandex_disk_module{
 	kdata2_t *database;
-	char access_token[64];         // Yandex Disk access token
+	kdbackend_t *backend;          // remote storage
 	int do_update;                 // set to false to stop
+	int cancel;                    // stop sync between items
+	int stopped;                   // sync thread finished
 	int sec;
+	int upload_threads;            // concurrent uploads
+	int download_threads;          // concurrent downloads
+	int bundle;                    // upload changes in bundles
+	int compression;               // deflate level, 0 - off
+	int json;                      // upload rows as JSON
+	long bucket;                   // last created bucket
+	char device[37];               // id of module for lease
+	int compact_age;               // compact older changes
+	time_t compacted;              // last compaction check
 	time_t timestamp;
 	pthread_t tid;
+	int started;                   // thread is running
+	int prepared;                  // remote and tables prepared
 	pthread_mutex_t mutex;
+	pthread_mutex_t wake_mutex;    // guards trigger of sync thread
+	pthread_cond_t wake;
+	int changed;                   // local change after last cycle
+	struct timespec first_change;
+	struct timespec last_change;
+	int sync_now;                  // run cycle without waiting
+	int debounce_ms;
+	int idle_max;                  // max seconds between checks
 	int current;
 	int total;
 	int current_table;
@@ -76,7 +154,13 @@ struct kdata_yandex_disk_module{
 		);
 };
 
+/* unload cancels sync - loops check it between items, not
+ * uploaded rows stay unmarked and cursor of download is not
+ * moved */
+#define SYNC_CANCELLED(d) __atomic_load_n(&(d)->cancel, __ATOMIC_RELAXED)
+
 void upload_to_yandex_disk(struct kdata_yandex_disk_module *);
 void download_from_yandex_disk(struct kdata_yandex_disk_module *);
+void compact_yandex_disk(struct kdata_yandex_disk_module *);
 
 #endif /* ifndef YANDEX_DISK_STRUCT_H */
@@ -0,0 +1,117 @@
+/**
+ * File              : payload.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 18.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/*
+ * sync payload compression with zlib deflate
+ */
+
+#include "payload.h"
+#include "cYandexDisk/alloc.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+// do not trust sizes above this in headers
+#define PAYLOAD_MAX_SIZE ((uint64_t)1 << 32)
+
+static void _put_u64(unsigned char *p, uint64_t v)
+{
+	int i;
+	for (i = 0; i < 8; ++i)
+		p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t _get_u64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+	for (i = 0; i < 8; ++i)
+		v |= (uint64_t)p[i] << (8 * i);
+	return v;
+}
+
+void * payload_encode(
+		const void *data, size_t size, int level, size_t *out_size)
+{
+	unsigned char *out;
+	uLongf len = compressBound(size);
+
+	if (level < 1 || level > 9)
+		level = Z_DEFAULT_COMPRESSION;
+
+	out = MALLOC(PAYLOAD_HEADER_LEN + len);
+	if (out == NULL)
+		return NULL;
+
+	memcpy(out, PAYLOAD_MAGIC, 3);
+	out[3] = PAYLOAD_CODEC_DEFLATE;
+	_put_u64(out + 4, size);
+
+	if (compress2(out + PAYLOAD_HEADER_LEN, &len,
+				data, size, level) != Z_OK)
+	{
+		free(out);
+		return NULL;
+	}
+
+	*out_size = PAYLOAD_HEADER_LEN + len;
+	return out;
+}
+
+int payload_is_encoded(const void *data, size_t size)
+{
+	return data && size >= PAYLOAD_HEADER_LEN &&
+		memcmp(data, PAYLOAD_MAGIC, 3) == 0;
+}
+
+void * payload_decode(
+		const void *data, size_t size, size_t *out_size,
+		const char **error)
+{
+	const unsigned char *p = data;
+	unsigned char *out;
+	uint64_t original;
+	uLongf len;
+
+	if (!payload_is_encoded(data, size)){
+		*error = "not compressed payload";
+		return NULL;
+	}
+	if (p[3] != PAYLOAD_CODEC_DEFLATE){
+		*error = "unknown payload codec - update kdata2";
+		return NULL;
+	}
+
+	original = _get_u64(p + 4);
+	if (original >= PAYLOAD_MAX_SIZE){
+		*error = "broken payload header";
+		return NULL;
+	}
+
+	// +1 - NULL-terminate for text parsers
+	out = MALLOC(original + 1);
+	if (out == NULL){
+		*error = "can't allocate memory";
+		return NULL;
+	}
+
+	len = original;
+	if (uncompress(out, &len, p + PAYLOAD_HEADER_LEN,
+				size - PAYLOAD_HEADER_LEN) != Z_OK ||
+			len != original)
+	{
+		free(out);
+		*error = "can't decompress payload";
+		return NULL;
+	}
+	out[len] = 0;
+
+	*out_size = len;
+	return out;
+}
@@ -0,0 +1,45 @@
+/**
+ * File              : payload.h
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 18.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/* Sync payload encoding */
+
+/* Conception:
+ * Compressed payload starts with 12 bytes header: "KDZ",
+ * codec byte and size of data (64-bit little endian). Plain
+ * payloads (JSON or bundle) never start with "KDZ" - so
+ * reader detects compressed payloads by header and older
+ * readers fail to parse them as JSON */
+
+#ifndef YANDEX_DISK_PAYLOAD_H
+#define YANDEX_DISK_PAYLOAD_H
+
+#include <stddef.h>
+
+#define PAYLOAD_MAGIC      "KDZ"
+#define PAYLOAD_HEADER_LEN 12
+
+enum PAYLOAD_CODEC {
+	PAYLOAD_CODEC_NONE,
+	PAYLOAD_CODEC_DEFLATE,
+};
+
+/* compress data with level (1-9) - return allocated
+ * payload or NULL on error */
+void * payload_encode(
+		const void *data, size_t size, int level, size_t *out_size);
+
+/* return 1 if data is compressed payload */
+int payload_is_encoded(const void *data, size_t size);
+
+/* decompress payload to allocated NULL-terminated buffer -
+ * return NULL on error and set error message */
+void * payload_decode(
+		const void *data, size_t size, size_t *out_size,
+		const char **error);
+
+#endif /* ifndef YANDEX_DISK_PAYLOAD_H */
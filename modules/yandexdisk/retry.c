@@ -0,0 +1,35 @@
+/**
+ * File              : retry.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 19.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+#include "retry.h"
+#include "internal.h"
+
+/* delay doubles not more then 20 times - larger shift
+ * overflows */
+#define RETRY_SHIFT_MAX 20
+
+void retry_sql_failed(
+		struct str *s, const char *item, int download, time_t now)
+{
+	str_appendf(s,
+			"INSERT OR IGNORE INTO %s "
+			"(item, download, attempts, next_try) "
+			"VALUES ('%s', %d, 0, 0);",
+			RETRY, item, download);
+	str_appendf(s,
+			"UPDATE %s SET attempts = attempts + 1, "
+			"next_try = %ld + MIN(%d << MIN(attempts, %d), %d) "
+			"WHERE item = '%s';",
+			RETRY, (long)now, YANDEX_DISK_RETRY_SEC, RETRY_SHIFT_MAX,
+			YANDEX_DISK_RETRY_MAX_SEC, item);
+}
+
+void retry_sql_done(struct str *s, const char *item)
+{
+	str_appendf(s, "DELETE FROM %s WHERE item = '%s';", RETRY, item);
+}
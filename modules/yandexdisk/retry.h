@@ -0,0 +1,34 @@
+/**
+ * File              : retry.h
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 19.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/* Retries of failed transfers */
+
+/* Conception:
+ * Failed transfers are stored in _yandexdisk_retry table -
+ * uuid of row for upload or path of file for download with
+ * count of failed attempts and time of next try. Item is
+ * skipped until next try: delay is YANDEX_DISK_RETRY_SEC
+ * doubled with each failed attempt but not more then
+ * YANDEX_DISK_RETRY_MAX_SEC. Table is in database, so
+ * attempts are counted between runs of application. SQL is
+ * appended to transaction of caller */
+
+#ifndef YANDEX_DISK_RETRY_H
+#define YANDEX_DISK_RETRY_H
+
+#include "../../str.h"
+#include <time.h>
+
+/* append SQL to count failed attempt of item at time now */
+void retry_sql_failed(
+		struct str *s, const char *item, int download, time_t now);
+
+/* append SQL to remove item */
+void retry_sql_done(struct str *s, const char *item);
+
+#endif /* ifndef YANDEX_DISK_RETRY_H */
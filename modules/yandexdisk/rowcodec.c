@@ -0,0 +1,1722 @@
+/**
+ * File              : rowcodec.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/*
+ * binary row encoding - encoded from sqlite3_column_* and
+ * decoded to sqlite3_bind_* without intermediate copies
+ */
+
+#include "rowcodec.h"
+#include "chunker.h"
+#include "internal.h"
+#include "cYandexDisk/alloc.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct row_buf {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	int error;
+};
+
+/* decoded column value - points to encoded data */
+struct row_value {
+	int type;                      // enum KDATA2_TYPE
+	int64_t number;
+	double real;
+	const unsigned char *bytes;
+	size_t len;
+	const unsigned char *hash;     // blob reference
+	struct chunk *chunks;          // chunks of blob
+	int nchunks;
+	unsigned char *local;          // local blob with chunks
+	size_t local_len;
+};
+
+static int _reserve(struct row_buf *b, size_t len)
+{
+	unsigned char *p;
+	size_t size = b->size?b->size:256;
+
+	if (b->error)
+		return -1;
+	if (b->len + len <= b->size)
+		return 0;
+
+	while (size < b->len + len)
+		size *= 2;
+	p = realloc(b->data, size);
+	if (p == NULL){
+		b->error = 1;
+		return -1;
+	}
+	b->data = p;
+	b->size = size;
+	return 0;
+}
+
+static void _put_bytes(struct row_buf *b, const void *data, size_t len)
+{
+	if (len == 0 || _reserve(b, len))
+		return;
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void _put_varint(struct row_buf *b, uint64_t v)
+{
+	unsigned char tmp[10];
+	int n = 0;
+	do {
+		tmp[n] = v & 0x7f;
+		v >>= 7;
+		if (v)
+			tmp[n] |= 0x80;
+		n++;
+	} while (v);
+	_put_bytes(b, tmp, n);
+}
+
+static void _put_header(struct row_buf *b, int id, int type)
+{
+	unsigned char t = type;
+	_put_varint(b, id);
+	_put_bytes(b, &t, 1);
+}
+
+/* encode blob as list of chunks - return nonzero if chunk
+ * can't be referenced */
+static int _put_chunks(
+		struct row_buf *b, int id, const void *blob, size_t len,
+		void *user_data, row_blob_ref_t blob_ref)
+{
+	unsigned char hash[SHA256_LEN];
+	struct chunk *chunks;
+	int i, count;
+
+	chunks = chunker_split(blob, len, &count);
+	if (chunks == NULL)
+		return -1;
+
+	for (i = 0; i < count; ++i) {
+		if (blob_ref(user_data, chunks[i].hash, 
+					(const unsigned char *)blob + chunks[i].offset, 
+					chunks[i].len))
+		{
+			free(chunks);
+			return -1;
+		}
+	}
+
+	sha256(blob, len, hash);
+	_put_header(b, id, ROW_TYPE_CHUNKS);
+	_put_varint(b, len);
+	_put_bytes(b, hash, SHA256_LEN);
+	_put_varint(b, count);
+	for (i = 0; i < count; ++i) {
+		_put_varint(b, chunks[i].len);
+		_put_bytes(b, chunks[i].hash, SHA256_LEN);
+	}
+
+	free(chunks);
+	return 0;
+}
+
+static void _put_double(struct row_buf *b, double value)
+{
+	unsigned char tmp[8];
+	uint64_t v;
+	int i;
+	memcpy(&v, &value, 8);
+	for (i = 0; i < 8; ++i)
+		tmp[i] = (unsigned char)(v >> (8 * i));
+	_put_bytes(b, tmp, 8);
+}
+
+static int _get_varint(
+		const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+	int shift = 0;
+	*v = 0;
+	while (*p < end && shift < 64) {
+		unsigned char c = *(*p)++;
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0)
+			return 0;
+		shift += 7;
+	}
+	return -1;
+}
+
+static int _get_double(
+		const unsigned char **p, const unsigned char *end, double *value)
+{
+	uint64_t v = 0;
+	int i;
+	if (end - *p < 8)
+		return -1;
+	for (i = 0; i < 8; ++i)
+		v |= (uint64_t)(*p)[i] << (8 * i);
+	memcpy(value, &v, 8);
+	*p += 8;
+	return 0;
+}
+
+/* uuid and timestamp are not columns of row data */
+static int _is_service_column(struct kdata2_column *column)
+{
+	return column->columnname[0] == 0 ||
+		strcmp(column->columnname, UUIDCOLUMN) == 0 ||
+		strcmp(column->columnname, "timestamp") == 0;
+}
+
+void * row_encode_stmt(
+		struct kdata2_table *table, sqlite3_stmt *stmt,
+		int64_t columns, void *user_data, row_blob_ref_t blob_ref,
+		size_t *size)
+{
+	struct row_buf b;
+	int i, count = 0, num_cols;
+
+	memset(&b, 0, sizeof(b));
+	num_cols = sqlite3_column_count(stmt);
+
+	// columns are selected after uuid
+	for (i = 0; table->columns[i] && i + 1 < num_cols; ++i) {
+		if (_is_service_column(table->columns[i]) ||
+				!kdata2_column_in(columns, i) ||
+				sqlite3_column_type(stmt, i + 1) == SQLITE_NULL)
+			continue;
+		count++;
+	}
+
+	_put_bytes(&b, ROW_MAGIC, ROW_MAGIC_LEN);
+	_put_varint(&b, count);
+
+	for (i = 0; table->columns[i] && i + 1 < num_cols; ++i) {
+		int col = i + 1;
+		if (_is_service_column(table->columns[i]) ||
+				!kdata2_column_in(columns, i))
+			continue;
+
+		switch (sqlite3_column_type(stmt, col)) {
+			case SQLITE_INTEGER:
+				{
+					int64_t v = sqlite3_column_int64(stmt, col);
+					_put_header(&b, i, KDATA2_TYPE_NUMBER);
+					// zigzag - small negative numbers are short
+					_put_varint(&b, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+				}
+				break;
+			case SQLITE_FLOAT:
+				_put_header(&b, i, KDATA2_TYPE_FLOAT);
+				_put_double(&b, sqlite3_column_double(stmt, col));
+				break;
+			case SQLITE_TEXT:
+				{
+					const unsigned char *text =
+						sqlite3_column_text(stmt, col);
+					size_t len = sqlite3_column_bytes(stmt, col);
+					_put_header(&b, i, KDATA2_TYPE_TEXT);
+					_put_varint(&b, len);
+					_put_bytes(&b, text, len);
+				}
+				break;
+			case SQLITE_BLOB:
+				{
+					const void *blob = sqlite3_column_blob(stmt, col);
+					size_t len = sqlite3_column_bytes(stmt, col);
+					if (blob_ref && len >= ROW_BLOB_MIN &&
+							_put_chunks(&b, i, blob, len, 
+								user_data, blob_ref) == 0)
+						break;
+					_put_header(&b, i, KDATA2_TYPE_DATA);
+					_put_varint(&b, len);
+					_put_bytes(&b, blob, len);
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (b.error){
+		free(b.data);
+		return NULL;
+	}
+
+	*size = b.len;
+	return b.data;
+}
+
+static struct kdata2_table *
+_find_table(kdata2_t *d, const char *tablename);
+
+/* Conception:
+ * JSON row of older versions is encoded to binary row while
+ * it is scanned - there is no tree of JSON values, strings
+ * are unescaped and base64 of DATA is decoded right to row
+ * buffer, so memory is JSON and row. Count of values and
+ * length of string are known after they are written - space
+ * for varint is reserved and value is moved to it */
+
+/* replace reserved bytes at pos with varint */
+static void _set_varint(
+		struct row_buf *b, size_t pos, size_t reserved, uint64_t v)
+{
+	unsigned char tmp[10];
+	int n = 0;
+	if (b->error)
+		return;
+	do {
+		tmp[n] = v & 0x7f;
+		v >>= 7;
+		if (v)
+			tmp[n] |= 0x80;
+		n++;
+	} while (v);
+	memmove(b->data + pos + n, b->data + pos + reserved,
+			b->len - pos - reserved);
+	memcpy(b->data + pos, tmp, n);
+	b->len -= reserved - n;
+}
+
+static void _json_ws(const char **p, const char *end)
+{
+	while (*p < end && (**p == ' ' || **p == '\t' ||
+				**p == '\n' || **p == '\r'))
+		(*p)++;
+}
+
+static void _put_utf8(struct row_buf *b, uint32_t c)
+{
+	unsigned char tmp[4];
+	int n;
+	if (c < 0x80){
+		tmp[0] = c; n = 1;
+	} else if (c < 0x800){
+		tmp[0] = 0xc0 | (c >> 6);
+		tmp[1] = 0x80 | (c & 0x3f); n = 2;
+	} else if (c < 0x10000){
+		tmp[0] = 0xe0 | (c >> 12);
+		tmp[1] = 0x80 | ((c >> 6) & 0x3f);
+		tmp[2] = 0x80 | (c & 0x3f); n = 3;
+	} else {
+		tmp[0] = 0xf0 | (c >> 18);
+		tmp[1] = 0x80 | ((c >> 12) & 0x3f);
+		tmp[2] = 0x80 | ((c >> 6) & 0x3f);
+		tmp[3] = 0x80 | (c & 0x3f); n = 4;
+	}
+	_put_bytes(b, tmp, n);
+}
+
+static int _json_hex4(const char **p, const char *end, uint32_t *c)
+{
+	int i;
+	*c = 0;
+	if (end - *p < 4)
+		return -1;
+	for (i = 0; i < 4; ++i) {
+		char h = *(*p)++;
+		*c <<= 4;
+		if (h >= '0' && h <= '9')      *c |= h - '0';
+		else if (h >= 'a' && h <= 'f') *c |= h - 'a' + 10;
+		else if (h >= 'A' && h <= 'F') *c |= h - 'A' + 10;
+		else return -1;
+	}
+	return 0;
+}
+
+/* base64 decoder state - 4 letters are 3 bytes */
+struct b64 {
+	uint32_t bits;
+	int n;
+};
+
+static void _b64_put(struct row_buf *b, struct b64 *s, char c)
+{
+	int v;
+	if (c >= 'A' && c <= 'Z')      v = c - 'A';
+	else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+	else if (c >= '0' && c <= '9') v = c - '0' + 52;
+	else if (c == '+' || c == '-') v = 62;
+	else if (c == '/' || c == '_') v = 63;
+	else return; // padding
+	s->bits = s->bits << 6 | v;
+	if (++s->n == 4){
+		unsigned char tmp[3] = {
+			s->bits >> 16, s->bits >> 8, s->bits};
+		_put_bytes(b, tmp, 3);
+		s->bits = 0;
+		s->n = 0;
+	}
+}
+
+static void _b64_end(struct row_buf *b, struct b64 *s)
+{
+	unsigned char tmp[2];
+	if (s->n == 2){
+		tmp[0] = s->bits >> 4;
+		_put_bytes(b, tmp, 1);
+	} else if (s->n == 3){
+		tmp[0] = s->bits >> 10;
+		tmp[1] = s->bits >> 2;
+		_put_bytes(b, tmp, 2);
+	}
+}
+
+/* read JSON string at p (or skip it if b is NULL) to row
+ * buffer - decode base64 if b64 is set */
+static int _json_string(
+		const char **p, const char *end, struct row_buf *b,
+		struct b64 *b64)
+{
+	if (*p >= end || **p != '"')
+		return -1;
+	(*p)++;
+
+	while (*p < end && **p != '"') {
+		uint32_t c = (unsigned char)*(*p)++;
+		if (c == '\\'){
+			if (*p >= end)
+				return -1;
+			switch (*(*p)++) {
+				case 'b': c = '\b'; break;
+				case 'f': c = '\f'; break;
+				case 'n': c = '\n'; break;
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				case 'u':
+					if (_json_hex4(p, end, &c))
+						return -1;
+					// surrogate pair
+					if (c >= 0xd800 && c < 0xdc00 &&
+							end - *p >= 6 && (*p)[0] == '\\' &&
+							(*p)[1] == 'u')
+					{
+						uint32_t lo;
+						*p += 2;
+						if (_json_hex4(p, end, &lo))
+							return -1;
+						c = 0x10000 + ((c - 0xd800) << 10) +
+							(lo - 0xdc00);
+					}
+					if (b && b64)
+						_b64_put(b, b64, c);
+					else if (b)
+						_put_utf8(b, c);
+					continue;
+				default:
+					c = (unsigned char)(*p)[-1];
+					break;
+			}
+		}
+		if (b == NULL)
+			continue;
+		if (b64)
+			_b64_put(b, b64, c);
+		else {
+			unsigned char ch = c;
+			_put_bytes(b, &ch, 1);
+		}
+	}
+
+	if (*p >= end)
+		return -1;
+	(*p)++;
+	if (b && b64)
+		_b64_end(b, b64);
+	return 0;
+}
+
+/* copy number token to buf */
+static int _json_number(
+		const char **p, const char *end, char *buf, size_t size)
+{
+	size_t n = 0;
+	while (*p < end && n + 1 < size && **p &&
+			strchr("+-0123456789.eE", **p))
+		buf[n++] = *(*p)++;
+	buf[n] = 0;
+	return n?0:-1;
+}
+
+/* skip JSON value */
+static int _json_skip(const char **p, const char *end)
+{
+	int depth = 0;
+	char buf[64];
+
+	do {
+		_json_ws(p, end);
+		if (*p >= end)
+			return -1;
+		switch (**p) {
+			case '"':
+				if (_json_string(p, end, NULL, NULL))
+					return -1;
+				break;
+			case '{': case '[':
+				depth++;
+				(*p)++;
+				break;
+			case '}': case ']':
+				depth--;
+				(*p)++;
+				break;
+			case ',': case ':':
+				(*p)++;
+				break;
+			default:
+				if (**p && strchr("tfn", **p)){
+					while (*p < end && **p >= 'a' && **p <= 'z')
+						(*p)++;
+				} else if (_json_number(p, end, buf, sizeof(buf)))
+					return -1;
+				break;
+		}
+	} while (depth > 0);
+
+	return 0;
+}
+
+static int _json_literal(
+		const char **p, const char *end, const char *literal)
+{
+	size_t len = strlen(literal);
+	if ((size_t)(end - *p) < len || strncmp(*p, literal, len))
+		return 0;
+	*p += len;
+	return 1;
+}
+
+/* find column index of JSON key */
+static int _json_column(
+		struct kdata2_table *table, const char *key, size_t len)
+{
+	int i;
+	for (i = 0; table->columns[i]; ++i) {
+		struct kdata2_column *column = table->columns[i];
+		if (strlen(column->columnname) == len &&
+				memcmp(column->columnname, key, len) == 0)
+			return _is_service_column(column)?-1:i;
+	}
+	return -1;
+}
+
+/* encode JSON value of column */
+static int _json_value(
+		const char **p, const char *end, struct row_buf *b,
+		struct kdata2_column *column, int id, int *count)
+{
+	char buf[64] = "";
+	size_t pos;
+	double number = 0;
+
+	if (_json_literal(p, end, "null"))
+		return 0;
+
+	switch (column->type) {
+		case KDATA2_TYPE_NUMBER:
+		case KDATA2_TYPE_FLOAT:
+			if (_json_literal(p, end, "true"))
+				number = 1;
+			else if (_json_literal(p, end, "false"))
+				number = 0;
+			else if (_json_number(p, end, buf, sizeof(buf)) == 0)
+				number = strtod(buf, NULL);
+			else
+				return _json_skip(p, end);
+
+			if (column->type == KDATA2_TYPE_FLOAT){
+				_put_header(b, id, KDATA2_TYPE_FLOAT);
+				_put_double(b, number);
+			} else {
+				// integers are exact
+				int64_t v = (buf[0] == 0 || strpbrk(buf, ".eE"))?
+					(int64_t)number:strtoll(buf, NULL, 10);
+				_put_header(b, id, KDATA2_TYPE_NUMBER);
+				_put_varint(b, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+			}
+			(*count)++;
+			return 0;
+
+		case KDATA2_TYPE_TEXT:
+		case KDATA2_TYPE_DATA:
+			if (*p >= end || **p != '"')
+				return _json_skip(p, end);
+			_put_header(b, id, column->type);
+			pos = b->len;
+			if (_reserve(b, 10))
+				return -1;
+			b->len += 10;
+			{
+				struct b64 b64 = {0, 0};
+				if (_json_string(p, end, b,
+							column->type == KDATA2_TYPE_DATA?&b64:NULL))
+					return -1;
+			}
+			_set_varint(b, pos, 10, b->len - pos - 10);
+			(*count)++;
+			return 0;
+
+		default:
+			return _json_skip(p, end);
+	}
+}
+
+void * row_encode_json(
+		kdata2_t *d, const char *tablename,
+		const void *json, size_t json_size, size_t *size)
+{
+	struct kdata2_table *table;
+	struct row_buf b;
+	const char *p = json, *end = p + json_size;
+	size_t start;
+	int count = 0, err = 0;
+
+	table = _find_table(d, tablename);
+	if (table == NULL){
+		ON_ERR(d, STR("No table with name: %s", tablename));
+		return NULL;
+	}
+
+	memset(&b, 0, sizeof(b));
+	_put_bytes(&b, ROW_MAGIC, ROW_MAGIC_LEN);
+	start = b.len;
+	if (_reserve(&b, 10))
+		return NULL;
+	b.len += 10;
+
+	_json_ws(&p, end);
+	if (p >= end || *p++ != '{')
+		err = -1;
+
+	while (!err) {
+		const char *key;
+		int id;
+
+		_json_ws(&p, end);
+		if (p < end && *p == '}')
+			break;
+
+		// key has no escapes in column names
+		key = p + 1;
+		if (_json_string(&p, end, NULL, NULL)){
+			err = -1;
+			break;
+		}
+		id = _json_column(table, key, p - key - 1);
+
+		_json_ws(&p, end);
+		if (p >= end || *p++ != ':'){
+			err = -1;
+			break;
+		}
+		_json_ws(&p, end);
+
+		if (id < 0)
+			err = _json_skip(&p, end);
+		else
+			err = _json_value(&p, end, &b, table->columns[id],
+					id, &count);
+		if (err)
+			break;
+
+		_json_ws(&p, end);
+		if (p < end && *p == ',')
+			p++;
+		else if (p >= end || *p != '}')
+			err = -1;
+	}
+
+	_set_varint(&b, start, 10, count);
+	if (err || b.error){
+		free(b.data);
+		return NULL;
+	}
+
+	*size = b.len;
+	return b.data;
+}
+
+static int64_t _get_version(
+		const unsigned char *versions, size_t size, int i)
+{
+	uint64_t v = 0;
+	int k;
+	if (versions == NULL || (size_t)i * 8 + 8 > size)
+		return 0;
+	for (k = 0; k < 8; ++k)
+		v |= (uint64_t)versions[i * 8 + k] << (8 * k);
+	return v;
+}
+
+/* versions with columns set to remote versions (or to
+ * timestamp if remote is NULL) */
+static void _versions_sql(
+		struct str *s, const void *versions, size_t size,
+		int num_columns, int64_t columns, 
+		const int64_t *remote, time_t timestamp)
+{
+	static const char digits[] = "0123456789abcdef";
+	char hex[17];
+	int i, k;
+
+	str_append(s, "X'", 2);
+	for (i = 0; i < num_columns; ++i) {
+		uint64_t v = _get_version(versions, size, i);
+		if (kdata2_column_in(columns, i))
+			v = remote?remote[i]:timestamp;
+		for (k = 0; k < 8; ++k) {
+			unsigned char c = v >> (8 * k);
+			hex[k*2]   = digits[c >> 4];
+			hex[k*2+1] = digits[c & 0xf];
+		}
+		str_append(s, hex, 16);
+	}
+	str_append(s, "'", 1);
+}
+
+void row_versions_sql(
+		struct str *s, const void *versions, size_t size,
+		int num_columns, int64_t columns, time_t timestamp)
+{
+	_versions_sql(s, versions, size, num_columns, columns, 
+			NULL, timestamp);
+}
+
+int row_is_encoded(const void *data, size_t size)
+{
+	return data && size >= ROW_MAGIC_LEN &&
+		memcmp(data, ROW_MAGIC, ROW_MAGIC_LEN) == 0;
+}
+
+/* read chunk list of blob reference (blob reference is one
+ * chunk) */
+static int _get_chunks(
+		const unsigned char **p, const unsigned char *end,
+		int type, struct row_value *value)
+{
+	uint64_t i, count = 1, len, offset = 0;
+
+	if (type == ROW_TYPE_CHUNKS &&
+			(_get_varint(p, end, &count) || count == 0 ||
+			 count > (uint64_t)(end - *p) / (SHA256_LEN + 1)))
+		return -1;
+
+	value->chunks = MALLOC(count * sizeof(struct chunk));
+	if (value->chunks == NULL)
+		return -1;
+	value->nchunks = count;
+
+	if (type == ROW_TYPE_BLOB_REF){
+		value->chunks[0].offset = 0;
+		value->chunks[0].len = value->len;
+		memcpy(value->chunks[0].hash, value->hash, SHA256_LEN);
+		return 0;
+	}
+
+	for (i = 0; i < count; ++i) {
+		struct chunk *c = &value->chunks[i];
+		if (_get_varint(p, end, &len) || end - *p < SHA256_LEN ||
+				len > value->len - offset)
+			break;
+		c->offset = offset;
+		c->len = len;
+		memcpy(c->hash, *p, SHA256_LEN);
+		*p += SHA256_LEN;
+		offset += len;
+	}
+
+	if (i != count || offset != value->len){
+		free(value->chunks);
+		value->chunks = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* read encoded values to array of table columns */
+static int _decode(
+		const void *data, size_t size,
+		struct row_value *values, int num_columns)
+{
+	const unsigned char *p = data, *end = p + size;
+	uint64_t count, id, v;
+	unsigned char type;
+
+	if (!row_is_encoded(data, size))
+		return -1;
+	p += ROW_MAGIC_LEN;
+
+	if (_get_varint(&p, end, &count))
+		return -1;
+
+	while (count--) {
+		struct row_value value;
+		memset(&value, 0, sizeof(value));
+
+		if (_get_varint(&p, end, &id) || p >= end)
+			return -1;
+		type = *p++;
+		value.type = type;
+
+		switch (type) {
+			case KDATA2_TYPE_NUMBER:
+				if (_get_varint(&p, end, &v))
+					return -1;
+				value.number = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+				break;
+			case KDATA2_TYPE_FLOAT:
+				if (_get_double(&p, end, &value.real))
+					return -1;
+				break;
+			case KDATA2_TYPE_TEXT:
+			case KDATA2_TYPE_DATA:
+				if (_get_varint(&p, end, &v) ||
+						v > (uint64_t)(end - p))
+					return -1;
+				value.bytes = p;
+				value.len = v;
+				p += v;
+				break;
+			case ROW_TYPE_BLOB_REF:
+			case ROW_TYPE_CHUNKS:
+				if (_get_varint(&p, end, &v) || end - p < SHA256_LEN)
+					return -1;
+				value.type = KDATA2_TYPE_DATA;
+				value.hash = p;
+				value.len = v;
+				p += SHA256_LEN;
+				if (_get_chunks(&p, end, type, &value))
+					return -1;
+				break;
+			default:
+				// can't skip value of unknown type
+				return -1;
+		}
+
+		// skip columns which are not in this table definition
+		if (id < (uint64_t)num_columns){
+			free(values[id].chunks);
+			values[id] = value;
+		} else
+			free(value.chunks);
+	}
+
+	return 0;
+}
+
+static int _bind(sqlite3_stmt *stmt, int index, struct row_value *value)
+{
+	switch (value->type) {
+		case KDATA2_TYPE_NUMBER:
+			return sqlite3_bind_int64(stmt, index, value->number);
+		case KDATA2_TYPE_FLOAT:
+			return sqlite3_bind_double(stmt, index, value->real);
+		case KDATA2_TYPE_TEXT:
+			return sqlite3_bind_text(stmt, index,
+					(const char *)value->bytes, value->len,
+					SQLITE_STATIC);
+		case KDATA2_TYPE_DATA:
+			// chunks are written to blob after insert
+			if (value->chunks)
+				return sqlite3_bind_zeroblob64(stmt, index, 
+						value->len);
+			return sqlite3_bind_blob(stmt, index,
+					value->bytes, value->len,
+					SQLITE_STATIC);
+		default:
+			break;
+	}
+	return SQLITE_OK;
+}
+
+static struct kdata2_table *
+_find_table(kdata2_t *d, const char *tablename)
+{
+	do {
+		kdata2_table_for_each(d) {
+			if (strcmp(table->tablename, tablename) == 0)
+				return table;
+		}
+	} while(0);
+	return NULL;
+}
+
+static int _chunk_cmp(const void *a, const void *b)
+{
+	return memcmp(((struct chunk *)a)->hash, 
+			((struct chunk *)b)->hash, SHA256_LEN);
+}
+
+/* sorted chunks of local blob of value - NULL if no local
+ * blob */
+static struct chunk * _local_chunks(struct row_value *value, int *count)
+{
+	struct chunk *chunks = NULL;
+
+	*count = 0;
+	if (value->local && value->local_len){
+		chunks = chunker_split(value->local, value->local_len, count);
+		if (chunks)
+			qsort(chunks, *count, sizeof(struct chunk), _chunk_cmp);
+	}
+	return chunks;
+}
+
+/* chunk of local blob with hash and length of c */
+static struct chunk * _local_chunk(
+		struct chunk *chunks, int count, struct chunk *c)
+{
+	struct chunk *found = NULL;
+
+	if (chunks)
+		found = bsearch(c, chunks, count, 
+				sizeof(struct chunk), _chunk_cmp);
+	if (found && found->len == c->len)
+		return found;
+	return NULL;
+}
+
+/* Conception:
+ * Blob of chunks is not assembled in memory - row is
+ * written with zeroblob of blob size and chunks are written
+ * to it with sqlite3_blob one by one (from local blob of row
+ * or downloaded), so memory for blob is one chunk and local
+ * blob. Hash of blob is computed while writing */
+static int _write_blob(
+		kdata2_t *d, struct kdata2_table *table, int column,
+		sqlite3_int64 rowid, struct row_value *value,
+		void *user_data, row_blob_get_t blob_get)
+{
+	struct chunk *local_chunks = NULL;
+	sqlite3_blob *blob;
+	struct sha256 sha;
+	unsigned char hash[SHA256_LEN];
+	char hex[SHA256_LEN*2+1];
+	int i, nlocal = 0, downloaded = 0;
+
+	if (sqlite3_blob_open(d->db, "main", table->tablename,
+				table->columns[column]->columnname, rowid, 1,
+				&blob) != SQLITE_OK)
+	{
+		ON_ERR(d, STR("sqlite3_blob_open: %s", sqlite3_errmsg(d->db)));
+		return -1;
+	}
+
+	// old version of blob has most of chunks
+	local_chunks = _local_chunks(value, &nlocal);
+
+	sha256_init(&sha);
+	for (i = 0; i < value->nchunks; ++i) {
+		struct chunk *c = &value->chunks[i], *found;
+		const void *src;
+		void *data = NULL;
+
+		found = _local_chunk(local_chunks, nlocal, c);
+		if (found)
+			src = value->local + found->offset;
+		else {
+			sha256_hex(c->hash, hex);
+			data = blob_get?blob_get(user_data, c->hash, c->len):NULL;
+			if (data == NULL){
+				ON_ERR(d, STR("can't get blob: %s", hex));
+				break;
+			}
+			sha256(data, c->len, hash);
+			if (memcmp(hash, c->hash, SHA256_LEN)){
+				ON_ERR(d, STR("broken blob: %s", hex));
+				free(data);
+				break;
+			}
+			src = data;
+			downloaded++;
+		}
+
+		// chunks follow each other
+		sha256_update(&sha, src, c->len);
+		if (sqlite3_blob_write(blob, src, c->len, c->offset) !=
+				SQLITE_OK)
+		{
+			ON_ERR(d, STR("sqlite3_blob_write: %s",
+						sqlite3_errmsg(d->db)));
+			free(data);
+			break;
+		}
+		free(data);
+	}
+	free(local_chunks);
+	sqlite3_blob_close(blob);
+
+	if (i != value->nchunks)
+		return -1;
+
+	sha256_final(&sha, hash);
+	if (memcmp(hash, value->hash, SHA256_LEN)){
+		ON_ERR(d, "broken blob: chunks do not match blob hash");
+		return -1;
+	}
+
+	ON_DBG(d, STR("blob of %d chunks: %d downloaded",
+				value->nchunks, downloaded));
+	return 0;
+}
+
+/* write blobs of chunks to row with uuid */
+static int _write_blobs(
+		kdata2_t *d, struct kdata2_table *table, const char *uuid,
+		struct row_value *values, int num_columns,
+		void *user_data, row_blob_get_t blob_get)
+{
+	char SQL[BUFSIZ];
+	sqlite3_stmt *stmt;
+	sqlite3_int64 rowid = 0;
+	int i, found;
+
+	for (i = 0; i < num_columns; ++i)
+		if (values[i].chunks && values[i].type == KDATA2_TYPE_DATA)
+			break;
+	if (i == num_columns)
+		return 0;
+
+	snprintf(SQL, BUFSIZ,
+			"SELECT rowid FROM '%s' WHERE %s = ?",
+			table->tablename, UUIDCOLUMN);
+	if (kdata2_sqlite3_prepare(d, SQL, &stmt))
+		return -1;
+	sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_STATIC);
+	found = sqlite3_step(stmt) == SQLITE_ROW;
+	if (found)
+		rowid = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	if (!found){
+		ON_ERR(d, STR("no row for blob: %s", uuid));
+		return -1;
+	}
+
+	for (; i < num_columns; ++i) {
+		if (values[i].chunks == NULL ||
+				values[i].type != KDATA2_TYPE_DATA ||
+				_is_service_column(table->columns[i]))
+			continue;
+		if (_write_blob(d, table, i, rowid, &values[i],
+					user_data, blob_get))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* drop referenced blobs which are same as local and keep
+ * local blobs of others - they have most of chunks */
+static int _resolve_blobs(
+		kdata2_t *d, struct kdata2_table *table, const char *uuid,
+		struct row_value *values, int num_columns)
+{
+	char SQL[BUFSIZ];
+	int i;
+
+	for (i = 0; i < num_columns; ++i) {
+		struct row_value *value = &values[i];
+		const unsigned char *local = NULL;
+		size_t local_len = 0;
+		sqlite3_stmt *stmt;
+
+		if (value->chunks == NULL || _is_service_column(table->columns[i]))
+			continue;
+
+		snprintf(SQL, BUFSIZ,
+				"SELECT \"%s\" FROM '%s' WHERE %s = ?",
+				table->columns[i]->columnname, 
+				table->tablename, UUIDCOLUMN);
+		if (kdata2_sqlite3_prepare(d, SQL, &stmt))
+			return -1;
+		sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_STATIC);
+
+		if (sqlite3_step(stmt) == SQLITE_ROW &&
+				sqlite3_column_type(stmt, 0) == SQLITE_BLOB)
+		{
+			local = sqlite3_column_blob(stmt, 0);
+			local_len = sqlite3_column_bytes(stmt, 0);
+		}
+
+		if (local && local_len == value->len){
+			unsigned char hash[SHA256_LEN];
+			sha256(local, local_len, hash);
+			if (memcmp(hash, value->hash, SHA256_LEN) == 0){
+				ON_DBG(d, "blob is up to date");
+				// keep local value
+				value->type = KDATA2_TYPE_NULL;
+				sqlite3_finalize(stmt);
+				continue;
+			}
+		}
+
+		// chunks of local blob are written after update
+		if (local && local_len){
+			value->local = MALLOC(local_len);
+			if (value->local == NULL){
+				ON_ERR(d, "can't allocate memory");
+				sqlite3_finalize(stmt);
+				return -1;
+			}
+			memcpy(value->local, local, local_len);
+			value->local_len = local_len;
+		}
+		sqlite3_finalize(stmt);
+	}
+
+	return 0;
+}
+
+/* chunks of applied row are on remote - do not upload them
+ * again when row is changed */
+static void _remember_blobs(
+		kdata2_t *d, struct row_value *values, int num_columns)
+{
+	char SQL[BUFSIZ], hex[SHA256_LEN*2+1];
+	int i, k;
+
+	for (i = 0; i < num_columns; ++i) {
+		for (k = 0; k < values[i].nchunks; ++k) {
+			sha256_hex(values[i].chunks[k].hash, hex);
+			snprintf(SQL, BUFSIZ,
+					"INSERT OR IGNORE INTO %s (hash) VALUES ('%s');",
+					BLOBS, hex);
+			kdata2_sqlite3_exec(d, SQL);
+		}
+	}
+}
+
+/* local state of row to compare with remote columns */
+struct row_local {
+	int exists;                    // row is in table
+	time_t timestamp;              // time of last local change
+	int deleted;
+	int pending;                   // has not uploaded changes
+	int64_t columns;               // not uploaded columns
+	unsigned char *versions;       // column versions
+	size_t versions_size;
+};
+
+static int _local_state(
+		kdata2_t *d, const char *tablename, const char *uuid,
+		struct row_local *l)
+{
+	char SQL[BUFSIZ];
+	sqlite3_stmt *stmt;
+
+	memset(l, 0, sizeof(*l));
+
+	snprintf(SQL, BUFSIZ,
+			"SELECT 1 FROM '%s' WHERE %s = ?",
+			tablename, UUIDCOLUMN);
+	if (kdata2_sqlite3_prepare(d, SQL, &stmt))
+		return -1;
+	sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_STATIC);
+	l->exists = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_finalize(stmt);
+
+	if (kdata2_sqlite3_prepare(d,
+				"SELECT timestamp, deleted, "
+				"YANDEX_DISK_UPLOADED IS NULL OR "
+				"YANDEX_DISK_UPLOADED != timestamp, "
+				"COALESCE(columns, -1), YANDEX_DISK_COLUMNS "
+				"FROM _kdata2_updates WHERE uuid = ?", &stmt))
+		return -1;
+	sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW){
+		const void *versions = sqlite3_column_blob(stmt, 4);
+		l->timestamp = sqlite3_column_int64(stmt, 0);
+		l->deleted = sqlite3_column_int(stmt, 1);
+		l->pending = sqlite3_column_int(stmt, 2);
+		l->columns = sqlite3_column_int64(stmt, 3);
+		l->versions_size = sqlite3_column_bytes(stmt, 4);
+		if (versions && l->versions_size){
+			l->versions = MALLOC(l->versions_size);
+			if (l->versions)
+				memcpy(l->versions, versions, l->versions_size);
+			else
+				l->versions_size = 0;
+		}
+	}
+	sqlite3_finalize(stmt);
+	return 0;
+}
+
+/* timestamp of local value of column */
+static time_t _local_version(struct row_local *l, int i)
+{
+	time_t v = _get_version(l->versions, l->versions_size, i);
+	// not uploaded change is not older then last change
+	if (l->pending && kdata2_column_in(l->columns, i) &&
+			l->timestamp > v)
+		v = l->timestamp;
+	return v;
+}
+
+static int _cmp_int(int64_t a, int64_t b)
+{
+	return a < b?-1:a > b;
+}
+
+/* Conception:
+ * Versions are seconds - two devices may change one column
+ * in the same second. Values with equal versions are ordered
+ * by type, then by number or by bytes of text, blobs are
+ * ordered by sha256 (it is known for blob of chunks without
+ * data) - greater value wins on each device, so devices
+ * converge */
+static int _tie_wins(
+		kdata2_t *d, struct kdata2_table *table, const char *uuid,
+		int i, struct row_value *value)
+{
+	char SQL[BUFSIZ];
+	sqlite3_stmt *stmt;
+	int type = KDATA2_TYPE_NULL, cmp = 1;
+
+	snprintf(SQL, BUFSIZ,
+			"SELECT \"%s\" FROM '%s' WHERE %s = ?",
+			table->columns[i]->columnname, 
+			table->tablename, UUIDCOLUMN);
+	if (kdata2_sqlite3_prepare(d, SQL, &stmt))
+		return 0;
+	sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) != SQLITE_ROW){
+		sqlite3_finalize(stmt);
+		return 1;
+	}
+
+	switch (sqlite3_column_type(stmt, 0)) {
+		case SQLITE_INTEGER: type = KDATA2_TYPE_NUMBER; break;
+		case SQLITE_FLOAT:   type = KDATA2_TYPE_FLOAT;  break;
+		case SQLITE_TEXT:    type = KDATA2_TYPE_TEXT;   break;
+		case SQLITE_BLOB:    type = KDATA2_TYPE_DATA;   break;
+		default: break;
+	}
+
+	if (type != value->type)
+		cmp = _cmp_int(value->type, type);
+	else if (type == KDATA2_TYPE_NUMBER)
+		cmp = _cmp_int(value->number, sqlite3_column_int64(stmt, 0));
+	else if (type == KDATA2_TYPE_FLOAT){
+		double local = sqlite3_column_double(stmt, 0);
+		cmp = value->real < local?-1:value->real > local;
+	} else if (type == KDATA2_TYPE_TEXT){
+		const void *local = sqlite3_column_text(stmt, 0);
+		size_t len = sqlite3_column_bytes(stmt, 0);
+		cmp = memcmp(value->bytes, local, 
+				value->len < len?value->len:len);
+		if (cmp == 0)
+			cmp = _cmp_int(value->len, len);
+	} else if (type == KDATA2_TYPE_DATA){
+		unsigned char hash[SHA256_LEN], local[SHA256_LEN];
+		if (value->hash)
+			memcpy(hash, value->hash, SHA256_LEN);
+		else
+			sha256(value->bytes, value->len, hash);
+		sha256(sqlite3_column_blob(stmt, 0), 
+				sqlite3_column_bytes(stmt, 0), local);
+		cmp = memcmp(hash, local, SHA256_LEN);
+	}
+	sqlite3_finalize(stmt);
+
+	return cmp > 0;
+}
+
+/* drop remote columns which are not newer then local -
+ * return bitmap of columns to apply. Remote versions of
+ * columns are row timestamp if not set */
+static int64_t _filter_values(
+		kdata2_t *d, struct kdata2_table *table, const char *uuid,
+		struct row_local *l,
+		time_t timestamp, const void *versions, size_t versions_size,
+		struct row_value *values, int64_t *remote, int num_columns)
+{
+	int64_t columns = 0;
+	time_t local;
+	int i;
+
+	for (i = 0; i < num_columns; ++i) {
+		struct row_value *value = &values[i];
+		remote[i] = _get_version(versions, versions_size, i);
+		if (remote[i] == 0)
+			remote[i] = timestamp;
+		if (value->type == KDATA2_TYPE_NULL ||
+				_is_service_column(table->columns[i]))
+			continue;
+		local = _local_version(l, i);
+		if (remote[i] > local || (remote[i] == local && l->exists &&
+					_tie_wins(d, table, uuid, i, value)))
+		{
+			columns |= kdata2_column_bit(i);
+			continue;
+		}
+		free(value->chunks);
+		memset(value, 0, sizeof(*value));
+	}
+
+	return columns;
+}
+
+static void _free_values(struct row_value *values, int num_columns)
+{
+	int i;
+	for (i = 0; i < num_columns; ++i) {
+		free(values[i].chunks);
+		free(values[i].local);
+	}
+	free(values);
+}
+
+/* update columns with one statement - not set values are
+ * bound as NULL and COALESCE keeps local value (as JSON
+ * without key) */
+static int _update(
+		kdata2_t *d, struct kdata2_table *table, const char *uuid,
+		time_t timestamp, struct row_value *values, int num_columns)
+{
+	sqlite3_stmt *stmt;
+	struct str s;
+	int i, res = 0;
+
+	if (str_init(&s)){
+		ON_ERR(d, "can't allocate memory");
+		return -1;
+	}
+
+	str_appendf(&s, "UPDATE '%s' SET ", table->tablename);
+	for (i = 0; i < num_columns; ++i) {
+		const char *name = table->columns[i]->columnname;
+		if (_is_service_column(table->columns[i]))
+			continue;
+		str_appendf(&s, "\"%s\" = COALESCE(?%d, \"%s\"), ",
+				name, i + 1, name);
+	}
+	str_appendf(&s,
+			"timestamp = MAX(COALESCE(timestamp, 0), ?%d), "
+			"YANDEX_DISK_UPLOADED = 1 "
+			"WHERE %s = ?%d",
+			num_columns + 1, UUIDCOLUMN, num_columns + 2);
+
+	if (kdata2_sqlite3_prepare(d, s.str, &stmt)){
+		free(s.str);
+		return -1;
+	}
+	free(s.str);
+
+	for (i = 0; i < num_columns; ++i) {
+		if (_is_service_column(table->columns[i]))
+			continue;
+		if (_bind(stmt, i + 1, &values[i]) != SQLITE_OK){
+			res = -1;
+			break;
+		}
+	}
+	if (res == 0){
+		sqlite3_bind_int64(stmt, num_columns + 1, timestamp);
+		sqlite3_bind_text(stmt, num_columns + 2, uuid, -1,
+				SQLITE_STATIC);
+		if (sqlite3_step(stmt) != SQLITE_DONE)
+			res = -1;
+	}
+	if (res){
+		ON_ERR(d, STR("can't update row: %s: %s",
+					uuid, sqlite3_errmsg(d->db)));
+	}
+
+	sqlite3_finalize(stmt);
+	return res;
+}
+
+int row_apply(
+		kdata2_t *d, const char *tablename, const char *uuid,
+		time_t timestamp, const void *data, size_t size,
+		const void *versions, size_t versions_size,
+		void *user_data, row_blob_get_t blob_get)
+{
+	struct kdata2_table *table;
+	struct row_value *values;
+	struct row_local local;
+	struct str s;
+	char SQL[BUFSIZ];
+	int64_t columns, *remote;
+	int num_columns = 0, res;
+
+	table = _find_table(d, tablename);
+	if (table == NULL){
+		ON_ERR(d, STR("No table with name: %s", tablename));
+		return -1;
+	}
+
+	while (table->columns[num_columns])
+		num_columns++;
+
+	values = MALLOC(num_columns * sizeof(struct row_value) + 1);
+	remote = MALLOC(num_columns * sizeof(int64_t) + 1);
+	if (values == NULL || remote == NULL){
+		ON_ERR(d, "can't allocate memory");
+		free(values);
+		free(remote);
+		return -1;
+	}
+	memset(values, 0, num_columns * sizeof(struct row_value));
+
+	if (_decode(data, size, values, num_columns)){
+		ON_ERR(d, STR("broken row data for uuid: %s", uuid));
+		_free_values(values, num_columns);
+		free(remote);
+		return -1;
+	}
+
+	if (_local_state(d, tablename, uuid, &local)){
+		_free_values(values, num_columns);
+		free(remote);
+		return -1;
+	}
+
+	// deleted later on this device
+	if (local.deleted && local.timestamp >= timestamp){
+		ON_DBG(d, STR("row is deleted: %s", uuid));
+		free(local.versions);
+		_free_values(values, num_columns);
+		free(remote);
+		return 0;
+	}
+
+	columns = _filter_values(d, table, uuid, &local, timestamp, 
+			versions, versions_size, values, remote, num_columns);
+	if (columns == 0 && local.exists){
+		ON_DBG(d, STR("row is up to date: %s", uuid));
+		free(local.versions);
+		_free_values(values, num_columns);
+		free(remote);
+		return 0;
+	}
+
+	if (_resolve_blobs(d, table, uuid, values, num_columns) || 
+			str_init(&s))
+	{
+		free(local.versions);
+		_free_values(values, num_columns);
+		free(remote);
+		return -1;
+	}
+
+	// applied columns are not uploaded back; if no local
+	// changes left - row is up to date with remote
+	str_appendf(&s,
+			"INSERT INTO _kdata2_updates (uuid, columns) "
+			"SELECT '%s', 0 "
+			"WHERE NOT EXISTS (SELECT 1 FROM _kdata2_updates WHERE uuid = '%s'); "
+			"UPDATE _kdata2_updates SET columns = columns & ~%lld, "
+			"YANDEX_DISK_COLUMNS = ",
+			uuid, uuid, (long long)columns);
+	_versions_sql(&s, local.versions, local.versions_size,
+			num_columns, columns, remote, timestamp);
+	str_appendf(&s,
+			" WHERE uuid = '%s'; "
+			"UPDATE _kdata2_updates SET "
+			"timestamp = MAX(COALESCE(timestamp, 0), %ld), "
+			"YANDEX_DISK_UPLOADED = MAX(COALESCE(timestamp, 0), %ld), "
+			"tablename = '%s', deleted = 0 "
+			"WHERE uuid = '%s' AND (columns = 0 OR "
+			"YANDEX_DISK_UPLOADED = timestamp);",
+			uuid, (long)timestamp, (long)timestamp, tablename, uuid);
+	free(local.versions);
+	free(remote);
+
+	// insert, update, blobs and changelog in one savepoint -
+	// works inside of transaction too
+	kdata2_sqlite3_exec(d, "SAVEPOINT row_apply;");
+
+	snprintf(SQL, BUFSIZ,
+			"INSERT INTO '%s' (%s) "
+			"SELECT '%s' "
+			"WHERE NOT EXISTS (SELECT 1 FROM '%s' WHERE %s = '%s');",
+			tablename, UUIDCOLUMN,
+			uuid,
+			tablename, UUIDCOLUMN, uuid);
+	res = kdata2_sqlite3_exec(d, SQL);
+
+	if (res == 0)
+		res = _update(d, table, uuid, timestamp, values, num_columns);
+
+	if (res == 0)
+		res = _write_blobs(d, table, uuid, values, num_columns,
+				user_data, blob_get);
+
+	if (res == 0)
+		res = kdata2_sqlite3_exec(d, s.str);
+	free(s.str);
+
+	if (res == 0)
+		_remember_blobs(d, values, num_columns);
+
+	if (res)
+		kdata2_sqlite3_exec(d,
+				"ROLLBACK TO row_apply; RELEASE row_apply;");
+	else
+		kdata2_sqlite3_exec(d, "RELEASE row_apply;");
+
+	_free_values(values, num_columns);
+	return res;
+}
+
+int row_prefetch(
+		kdata2_t *d, const char *tablename, const char *uuid,
+		time_t timestamp, const void *data, size_t size,
+		const void *versions, size_t versions_size,
+		void *user_data, row_blob_fetch_t blob_fetch)
+{
+	struct kdata2_table *table;
+	struct row_value *values;
+	struct row_local local;
+	int64_t *remote;
+	int i, k, num_columns = 0, chunked = 0, res = 0;
+
+	// JSON rows of older versions have no chunks
+	if (!row_is_encoded(data, size))
+		return 0;
+
+	table = _find_table(d, tablename);
+	if (table == NULL){
+		ON_ERR(d, STR("No table with name: %s", tablename));
+		return -1;
+	}
+
+	while (table->columns[num_columns])
+		num_columns++;
+
+	values = MALLOC(num_columns * sizeof(struct row_value) + 1);
+	remote = MALLOC(num_columns * sizeof(int64_t) + 1);
+	if (values == NULL || remote == NULL){
+		ON_ERR(d, "can't allocate memory");
+		free(values);
+		free(remote);
+		return -1;
+	}
+	memset(values, 0, num_columns * sizeof(struct row_value));
+
+	if (_decode(data, size, values, num_columns)){
+		ON_ERR(d, STR("broken row data for uuid: %s", uuid));
+		_free_values(values, num_columns);
+		free(remote);
+		return -1;
+	}
+
+	for (i = 0; i < num_columns; ++i)
+		if (values[i].chunks)
+			chunked = 1;
+	if (!chunked){
+		_free_values(values, num_columns);
+		free(remote);
+		return 0;
+	}
+
+	// same columns and local blobs as in row_apply
+	if (_local_state(d, tablename, uuid, &local)){
+		_free_values(values, num_columns);
+		free(remote);
+		return -1;
+	}
+	if (local.deleted && local.timestamp >= timestamp)
+		chunked = 0;
+	else {
+		_filter_values(d, table, uuid, &local, timestamp, 
+				versions, versions_size, values, remote, num_columns);
+		res = _resolve_blobs(d, table, uuid, values, num_columns);
+	}
+	free(local.versions);
+	free(remote);
+
+	for (i = 0; i < num_columns && chunked && res == 0; ++i) {
+		struct row_value *value = &values[i];
+		struct chunk *local_chunks;
+		int nlocal;
+
+		if (value->chunks == NULL ||
+				value->type != KDATA2_TYPE_DATA ||
+				_is_service_column(table->columns[i]))
+			continue;
+
+		local_chunks = _local_chunks(value, &nlocal);
+		for (k = 0; k < value->nchunks; ++k) {
+			struct chunk *c = &value->chunks[k];
+			if (_local_chunk(local_chunks, nlocal, c))
+				continue;
+			if (blob_fetch(user_data, c->hash, c->len)){
+				res = -1;
+				break;
+			}
+		}
+		free(local_chunks);
+	}
+
+	_free_values(values, num_columns);
+	return res;
+}
+
+/* Conception:
+ * Empty table is loaded from snapshot without reading local
+ * state - rows and changelog are inserted with two prepared
+ * statements and versions of columns are stored as in
+ * snapshot. Caller runs loader in one transaction */
+struct row_loader {
+	kdata2_t *d;
+	struct kdata2_table *table;
+	int num_columns;
+	unsigned char *versions;
+	sqlite3_stmt *insert;
+	sqlite3_stmt *changelog;
+};
+
+void row_loader_free(struct row_loader *l)
+{
+	if (l == NULL)
+		return;
+	sqlite3_finalize(l->insert);
+	sqlite3_finalize(l->changelog);
+	free(l->versions);
+	free(l);
+}
+
+struct row_loader * row_loader_new(kdata2_t *d, const char *tablename)
+{
+	struct row_loader *l;
+	struct str s;
+	int i, res;
+
+	l = NEW(struct row_loader);
+	if (l == NULL){
+		ON_ERR(d, "can't allocate memory");
+		return NULL;
+	}
+	l->d = d;
+	l->table = _find_table(d, tablename);
+	if (l->table == NULL){
+		ON_ERR(d, STR("No table with name: %s", tablename));
+		free(l);
+		return NULL;
+	}
+	while (l->table->columns[l->num_columns])
+		l->num_columns++;
+
+	l->versions = MALLOC(l->num_columns * 8 + 1);
+	if (l->versions == NULL || str_init(&s)){
+		ON_ERR(d, "can't allocate memory");
+		row_loader_free(l);
+		return NULL;
+	}
+
+	// ?1 - uuid, ?2.. - columns, then timestamp
+	str_appendf(&s, "INSERT INTO '%s' (%s, ", tablename, UUIDCOLUMN);
+	for (i = 0; i < l->num_columns; ++i) {
+		if (_is_service_column(l->table->columns[i]))
+			continue;
+		str_appendf(&s, "\"%s\", ", l->table->columns[i]->columnname);
+	}
+	str_appendf(&s, "timestamp, YANDEX_DISK_UPLOADED) VALUES (?1, ");
+	for (i = 0; i < l->num_columns; ++i) {
+		if (_is_service_column(l->table->columns[i]))
+			continue;
+		str_appendf(&s, "?%d, ", i + 2);
+	}
+	str_appendf(&s, "?%d, 1);", l->num_columns + 2);
+
+	res = kdata2_sqlite3_prepare(d, s.str, &l->insert);
+	free(s.str);
+	if (res == 0)
+		res = kdata2_sqlite3_prepare(d,
+				"INSERT INTO _kdata2_updates (uuid, tablename, "
+				"timestamp, deleted, columns, YANDEX_DISK_UPLOADED, "
+				"YANDEX_DISK_COLUMNS) VALUES (?1, ?2, ?3, 0, 0, ?3, ?4);",
+				&l->changelog);
+	if (res){
+		row_loader_free(l);
+		return NULL;
+	}
+
+	return l;
+}
+
+int row_loader_add(
+		struct row_loader *l, const char *uuid, time_t timestamp,
+		const void *data, size_t size,
+		const void *versions, size_t versions_size,
+		void *user_data, row_blob_get_t blob_get)
+{
+	struct row_value *values;
+	int i, k, res = 0;
+
+	values = MALLOC(l->num_columns * sizeof(struct row_value) + 1);
+	if (values == NULL){
+		ON_ERR(l->d, "can't allocate memory");
+		return -1;
+	}
+	memset(values, 0, l->num_columns * sizeof(struct row_value));
+
+	if (_decode(data, size, values, l->num_columns)){
+		ON_ERR(l->d, STR("broken row data for uuid: %s", uuid));
+		_free_values(values, l->num_columns);
+		return -1;
+	}
+
+	sqlite3_reset(l->insert);
+	sqlite3_clear_bindings(l->insert);
+	sqlite3_bind_text(l->insert, 1, uuid, -1, SQLITE_STATIC);
+	for (i = 0; i < l->num_columns && res == 0; ++i) {
+		struct row_value *value = &values[i];
+		uint64_t v;
+
+		// versions of all columns - 0 is timestamp of row
+		v = _get_version(versions, versions_size, i);
+		if (v == 0)
+			v = timestamp;
+		for (k = 0; k < 8; ++k)
+			l->versions[i * 8 + k] = v >> (8 * k);
+
+		if (_is_service_column(l->table->columns[i]))
+			continue;
+		if (_bind(l->insert, i + 2, value) != SQLITE_OK)
+			res = -1;
+	}
+	sqlite3_bind_int64(l->insert, l->num_columns + 2, timestamp);
+
+	if (res == 0 && sqlite3_step(l->insert) != SQLITE_DONE)
+		res = -1;
+
+	if (res == 0)
+		res = _write_blobs(l->d, l->table, uuid, values, 
+				l->num_columns, user_data, blob_get);
+
+	if (res == 0){
+		sqlite3_reset(l->changelog);
+		sqlite3_bind_text(l->changelog, 1, uuid, -1, SQLITE_STATIC);
+		sqlite3_bind_text(l->changelog, 2, l->table->tablename, -1,
+				SQLITE_STATIC);
+		sqlite3_bind_int64(l->changelog, 3, timestamp);
+		sqlite3_bind_blob(l->changelog, 4, l->versions,
+				l->num_columns * 8, SQLITE_STATIC);
+		if (sqlite3_step(l->changelog) != SQLITE_DONE)
+			res = -1;
+	}
+
+	if (res){
+		ON_ERR(l->d, STR("can't insert row: %s: %s",
+					uuid, sqlite3_errmsg(l->d->db)));
+	} else
+		_remember_blobs(l->d, values, l->num_columns);
+
+	_free_values(values, l->num_columns);
+	return res;
+}
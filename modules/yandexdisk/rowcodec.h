@@ -0,0 +1,144 @@
+/**
+ * File              : rowcodec.h
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/* Binary row encoding */
+
+/* Conception:
+ * Row is encoded with 4 bytes header "KDB" and version
+ * byte, number of columns (varint) and for each not NULL
+ * column: column id (index of column in kdata2_table
+ * definition, varint), type byte (enum KDATA2_TYPE) and
+ * value:
+ * NUMBER - zigzag varint
+ * FLOAT  - 8 bytes of IEEE double (little endian)
+ * TEXT   - length (varint) and bytes
+ * DATA   - length (varint) and bytes
+ * CHUNKS - length (varint), SHA-256 of blob, number of
+ *          chunks (varint) and for each chunk length (varint)
+ *          and SHA-256 - DATA of ROW_BLOB_MIN bytes and more
+ *          is split to content-defined chunks (see chunker.h)
+ *          stored as content-addressed objects
+ *          (app:/blobs/<hex hash>). Chunk is uploaded once and
+ *          downloaded only if local blob has no chunk with
+ *          its hash
+ * BLOB_REF - length (varint) and SHA-256 of blob stored as
+ *          one object (read only)
+ * uuid and timestamp of row are not encoded - they are in
+ * file name (or bundle index). Columns with unknown ids
+ * (added on other device) are skipped by reader. Row may
+ * have only changed columns - absent columns are not
+ * changed by reader.
+ * Column versions - timestamp of last uploaded or applied
+ * value of each column (8 bytes little endian for each
+ * column of table definition) are stored in
+ * YANDEX_DISK_COLUMNS of _kdata2_updates. Column of remote
+ * row is applied only if it is newer then local version of
+ * column (and local not uploaded change) - devices which
+ * changed different columns of one row converge */
+
+#ifndef YANDEX_DISK_ROWCODEC_H
+#define YANDEX_DISK_ROWCODEC_H
+
+#include "../../kdata2.h"
+#include "../../str.h"
+#include "sha256.h"
+#include <stddef.h>
+#include <time.h>
+
+#define ROW_MAGIC     "KDB\1"
+#define ROW_MAGIC_LEN 4
+
+#define ROW_TYPE_BLOB_REF 0x83
+#define ROW_TYPE_CHUNKS   0x84
+#define ROW_BLOB_MIN      (4 * 1024)
+
+/* called for each chunk of DATA of ROW_BLOB_MIN bytes and
+ * more - return 0 to encode blob as chunks (chunk will be
+ * uploaded by caller) or nonzero to encode blob in row */
+typedef int (*row_blob_ref_t)(
+		void *user_data, const unsigned char hash[SHA256_LEN],
+		const void *data, size_t size);
+
+/* return allocated chunk (blob) with hash or NULL on error */
+typedef void * (*row_blob_get_t)(
+		void *user_data, const unsigned char hash[SHA256_LEN],
+		size_t size);
+
+/* called for each chunk which is needed to apply row -
+ * return 0 if chunk is fetched */
+typedef int (*row_blob_fetch_t)(
+		void *user_data, const unsigned char hash[SHA256_LEN],
+		size_t size);
+
+/* encode row of kdata2_sql_select_table_request statement
+ * (uuid, columns, timestamp) - only columns with bits in
+ * columns bitmap (-1 for all). Return allocated buffer or
+ * NULL on error; set blob_ref to NULL to encode all blobs in
+ * row */
+void * row_encode_stmt(
+		struct kdata2_table *table, sqlite3_stmt *stmt,
+		int64_t columns, void *user_data, row_blob_ref_t blob_ref,
+		size_t *size);
+
+/* encode JSON row of older versions of module (keys are
+ * column names, DATA in base64) - return allocated buffer or
+ * NULL on error */
+void * row_encode_json(
+		kdata2_t *d, const char *tablename,
+		const void *json, size_t json_size, size_t *size);
+
+/* append to s column versions of table with num_columns
+ * with columns set to timestamp as SQL blob literal */
+void row_versions_sql(
+		struct str *s, const void *versions, size_t size,
+		int num_columns, int64_t columns, time_t timestamp);
+
+/* return 1 if data is binary row */
+int row_is_encoded(const void *data, size_t size);
+
+/* insert or update row with uuid in table with columns of
+ * encoded data which are newer then local - versions of
+ * remote columns are timestamp of row if versions is NULL
+ * (or version of column is 0). Chunks which are not in local
+ * blob are downloaded with blob_get. Return 0 on success */
+int row_apply(
+		kdata2_t *d, const char *tablename, const char *uuid,
+		time_t timestamp, const void *data, size_t size,
+		const void *versions, size_t versions_size,
+		void *user_data, row_blob_get_t blob_get);
+
+/* fetch chunks which row_apply (or row_loader_add for
+ * empty table) with the same arguments downloads - to
+ * download them before transaction. Return 0 if all chunks
+ * are fetched */
+int row_prefetch(
+		kdata2_t *d, const char *tablename, const char *uuid,
+		time_t timestamp, const void *data, size_t size,
+		const void *versions, size_t versions_size,
+		void *user_data, row_blob_fetch_t blob_fetch);
+
+/* insert rows to empty table (bootstrap from snapshot) with
+ * prepared statements - local rows are not checked, so run
+ * it in transaction and only for table without rows and
+ * changes */
+struct row_loader;
+
+/* return NULL on error */
+struct row_loader * row_loader_new(kdata2_t *d, const char *tablename);
+
+/* insert encoded row - arguments are as for row_apply. Return
+ * 0 on success */
+int row_loader_add(
+		struct row_loader *l, const char *uuid, time_t timestamp,
+		const void *data, size_t size,
+		const void *versions, size_t versions_size,
+		void *user_data, row_blob_get_t blob_get);
+
+void row_loader_free(struct row_loader *l);
+
+#endif /* ifndef YANDEX_DISK_ROWCODEC_H */
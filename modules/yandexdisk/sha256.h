@@ -0,0 +1,36 @@
+/**
+ * File              : sha256.h
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 18.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/* SHA-256 (FIPS 180-4) to name content-addressed blobs */
+
+#ifndef YANDEX_DISK_SHA256_H
+#define YANDEX_DISK_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t len;                  // bytes hashed
+	unsigned char buf[64];
+	size_t buf_len;
+};
+
+void sha256_init(struct sha256 *s);
+void sha256_update(struct sha256 *s, const void *data, size_t len);
+void sha256_final(struct sha256 *s, unsigned char hash[SHA256_LEN]);
+
+/* hash data in one call */
+void sha256(const void *data, size_t len, unsigned char hash[SHA256_LEN]);
+
+/* lowercase hex string of hash */
+void sha256_hex(const unsigned char hash[SHA256_LEN], char hex[SHA256_LEN*2+1]);
+
+#endif /* ifndef YANDEX_DISK_SHA256_H */
@@ -1,328 +1,1025 @@
 #include "internal.h"
 #include "base64.h"
+#include "payload.h"
+#include "retry.h"
+#include "rowcodec.h"
+#include "sha256.h"
 #include "yandexdisk.h"
 #include "../../kdata2.h"
 #include "../../str.h"
-#include "cYandexDisk/cYandexDisk.h"
+#include "cYandexDisk/alloc.h"
 #include "cYandexDisk/cJSON.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+/* Conception:
+ * Rows for upload are encoded (see rowcodec.h) and collected
+ * to batch (not more then UPLOAD_BATCH rows or
+ * UPLOAD_BATCH_BYTES of data) - select statement is
+ * finalized before upload. Batch is uploaded by
+ * upload_threads workers - uploads are latency-bound, so
+ * concurrent transfers hide round-trip time. When all
+ * workers finished uploaded rows are marked in one
+ * savepoint. Failed rows stay unmarked and are counted in
+ * retry table (see retry.h) - they are not selected until
+ * next try, so flaky link is not hammered with the same
+ * rows. Rows which are not uploaded because sync is
+ * cancelled and selected rows which give no upload (no table
+ * or row, row is not encoded) are skipped with OFFSET (rows
+ * are ordered by rowid) - selection stops when no rows are
+ * selected.
+ * Large blobs are split to content-defined chunks uploaded
+ * as content-addressed objects (app:/blobs/<sha256>) before
+ * rows which reference them - hashes of chunks on remote are
+ * stored in _yandexdisk_blobs table, so only changed chunks
+ * are uploaded when blob or other columns of row change.
+ * Hashes of uploaded chunks are stored even if row failed -
+ * upload of large blob is resumed from chunks which are not
+ * uploaded yet.
+ * Changed rows are uploaded with columns changed since last
+ * upload only (bitmap in _kdata2_updates) - bits are cleared
+ * when row is uploaded if it was not changed again (count of
+ * changes of row is the same as when it was selected).
+ * Files of batch are named with time when its blobs are
+ * uploaded and put to bucket of this time (see internal.h) -
+ * manifest of bucket is written after files, so readers
+ * which see manifest see files too. Rows are uploaded after
+ * the name is stamped - readers list files with names not
+ * older then last update minus CHANGES_GRACE_SEC */
+
+#define UPLOAD_BATCH       256
+#define UPLOAD_BATCH_BYTES (16 * 1024 * 1024)
+
+struct upload_blob {
+	char hash[SHA256_LEN*2+1];     // hex
+	void *data;
+	size_t size;
+	int res;
+	struct upload_blob *next;
+};
+
+struct upload_job {
+	char tablename[128];
+	char uuid[37];
+	time_t timestamp;              // row timestamp
+	int deleted;
+	int update;                    // row from _kdata2_updates
+	time_t update_timestamp;       // timestamp in _kdata2_updates
+	int64_t update_seq;            // changes count in _kdata2_updates
+	int64_t columns;               // encoded columns
+	char *versions;                // SQL of new column versions
+	void *data;                    // encoded row
+	size_t size;
+	struct upload_blob *blobs;     // upload before row
+	int res;
+};
+
+struct upload_batch {
+	kdydm_t *d;
+	time_t uploaded;               // upload time of batch
+	struct upload_job jobs[UPLOAD_BATCH];
+	int count;
+	size_t bytes;
+	struct upload_blob **blobs;    // blobs of all jobs
+	int nblobs;
+	int next;                      // next job (blob) for worker
+	int failed;                    // skipped rows in this sync
+	int selected;                  // rows of select for batch
+};
+
 struct udata_t {
 	kdydm_t *d;
+	struct upload_batch *batch;
+	struct kdata2_table *table;
 	char *tablename;
 	char *uuid;
 	time_t timestamp;
 	int deleted;
-	int uploaded;
+	int update;
+	int64_t seq;                   // changes count of row
+	int64_t columns;               // changed columns
+	const void *versions;          // column versions
+	size_t versions_size;
+	struct upload_blob *blobs;     // blobs of encoded row
 };
 
-static int upload_json(
-		kdydm_t *d, 
-		const char *tablename, 
+static void free_blobs(struct upload_blob *blob)
+{
+	while (blob) {
+		struct upload_blob *next = blob->next;
+		free(blob->data);
+		free(blob);
+		blob = next;
+	}
+}
+
+/* add job to batch - takes data, versions and blobs. Return
+ * 1 if batch is full */
+static int batch_add(
+		struct upload_batch *b,
+		const char *tablename,
 		const char *uuid,
 		time_t timestamp,
 		int deleted,
-		char *json)
+		int update,
+		time_t update_timestamp,
+		int64_t update_seq,
+		int64_t columns,
+		char *versions,
+		void *data,
+		size_t size,
+		struct upload_blob *blobs)
+{
+	struct upload_job *job = &b->jobs[b->count++];
+	struct upload_blob *blob;
+
+	strncpy(job->tablename, tablename, sizeof(job->tablename) - 1);
+	job->tablename[sizeof(job->tablename) - 1] = 0;
+	strncpy(job->uuid, uuid, sizeof(job->uuid) - 1);
+	job->uuid[sizeof(job->uuid) - 1] = 0;
+	job->timestamp        = timestamp;
+	job->deleted          = deleted;
+	job->update           = update;
+	job->update_timestamp = update_timestamp;
+	job->update_seq       = update_seq;
+	job->columns          = columns;
+	job->versions         = versions;
+	job->data             = data;
+	job->size             = size;
+	job->blobs            = blobs;
+	job->res              = -1;
+
+	b->bytes += size;
+	for (blob = blobs; blob; blob = blob->next)
+		b->bytes += blob->size;
+
+	return b->count >= UPLOAD_BATCH ||
+		b->bytes >= UPLOAD_BATCH_BYTES;
+}
+
+/* put data to backend - compressed if compression is on */
+static int put_payload(
+		kdydm_t *d, const char *path, 
+		const void *data, size_t size, char **error)
+{
+	void *payload = NULL;
+	size_t payload_size;
+	int res;
+
+	if (d->compression){
+		payload = payload_encode(
+				data, size, d->compression, &payload_size);
+		// upload not compressed on error
+		if (payload){
+			data = payload;
+			size = payload_size;
+		}
+	}
+
+	res = d->backend->put(d->backend, path, data, size, error);
+	free(payload);
+	return res;
+}
+
+/* called from worker threads */
+static int upload_row(struct upload_batch *b, struct upload_job *job)
 {
+	kdydm_t *d = b->d;
 	int res = 0;
-	char path[BUFSIZ];
+	char path[BUFSIZ], kind[40], *error = NULL;
+	uint64_t start;
 
-	if (d->progress)
-		d->progress(
-				d->progressp, 
-				PPHASE_UPLOADING, 
-				d->current++, 
-				d->total);
+	// bitmap of columns in row lets other devices skip
+	// changes which are superseded by newer
+	if (job->deleted)
+		snprintf(kind, sizeof(kind), "%c%c%.8s", CHANGE_DELETE,
+				CHANGE_DEVICE, d->device);
+	else
+		snprintf(kind, sizeof(kind), "%c%llx%c%.8s", CHANGE_UPDATE,
+				(unsigned long long)job->columns, 
+				CHANGE_DEVICE, d->device);
+
+	// flat folders of older versions
+	if (d->json)
+		snprintf(path, BUFSIZ, "app:/%s/%ld.%s.%s",
+				job->deleted?DELETED:UPDATES,
+				job->timestamp, job->tablename, job->uuid);
+	else
+		snprintf(path, BUFSIZ, "app:/%s/%010ld/%ld.%ld.%s.%s.%s",
+				CHANGES, CHANGES_BUCKET(b->uploaded), 
+				(long)b->uploaded, job->timestamp, kind,
+				job->tablename, job->uuid);
 
-	sprintf(path, "app:/%s/%ld.%s.%s", 
-			deleted?DELETED:UPDATES, 
-			timestamp, tablename, uuid);
-	
-	ON_LOG(d->database, STR("upload json to path: %s", 
+	ON_DBG(d->database, STR("upload row to path: %s",
 		   path));
-	res =  c_yandex_disk_upload_data(
-			d->access_token, 
-			json, 
-			strlen(json), 
-			path, 
-			false, 
-			true, 
-			NULL, 
-			NULL, 
-			d->file_progressp, 
-			d->file_progress);
+	start = kdata2_stats_now();
+	res = put_payload(
+			d,
+			path,
+			job->data,
+			job->size,
+			&error);
+	kdata2_stats_record(d->database, KDATA2_STAT_SYNC_UPLOAD, start);
 
 	if (res){
-		ON_ERR(d->database, STR("can't upload json to path: %s", 
-				 path));
+		ON_ERR(d->database, STR("can't upload row to path: %s: %s",
+				 path, error?error:""));
 	}
+	free(error);
 
-	if (d->progress)
+	if (d->progress){
+		pthread_mutex_lock(&d->mutex);
 		d->progress(
-				d->progressp, 
-				PPHASE_UPLOADING, 
-				d->current, 
+				d->progressp,
+				PPHASE_UPLOADING,
+				++d->current,
 				d->total);
+		pthread_mutex_unlock(&d->mutex);
+	}
 
 	return res;
 }
 
-static int for_each_row_in_all_columns(
-				void *user_data,
-				int	num_cols,
-				enum KDATA2_TYPE types[],
-				const char *columns[], 
-				void *values[],
-				size_t sizes[]
-				)
+/* upload blob (chunk) - called from worker threads */
+static int upload_blob(kdydm_t *d, struct upload_blob *blob)
 {
+	char path[BUFSIZ], *error = NULL;
+	uint64_t start;
+	int res;
+
+	snprintf(path, BUFSIZ, "app:/%s/%s", BLOBS_DIR, blob->hash);
+
+	// uploaded from other device
+	if (d->backend->exists && 
+			d->backend->exists(d->backend, path) == 1)
+	{
+		ON_DBG(d->database, STR("blob exists: %s", path));
+		return 0;
+	}
+
+	ON_DBG(d->database, STR("upload blob to path: %s", path));
+	start = kdata2_stats_now();
+	res = d->backend->put(
+			d->backend, path, blob->data, blob->size, &error);
+	kdata2_stats_record(d->database, KDATA2_STAT_SYNC_UPLOAD, start);
+
+	if (res){
+		ON_ERR(d->database, STR("can't upload blob to path: %s: %s",
+				 path, error?error:""));
+	}
+	free(error);
+
+	return res;
+}
+
+static void * blob_worker(void *data)
+{
+	struct upload_batch *b = data;
 	int i;
-	time_t timestamp = 0;
-	struct udata_t *t = user_data;
-	char *json = NULL, *uuid = NULL;
-	cJSON *object = NULL;
-	
-	assert(t);
-	assert(t->d);
-	assert(t->d->database);
-	assert(values);
-	
-	if (values[0] == NULL || values[num_cols-1] == NULL)
+
+	while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED))
+			< b->nblobs)
 	{
-		ON_ERR(t->d->database, "broken table row data");
-		return 1;
+		struct upload_blob *blob = b->blobs[i];
+		if (SYNC_CANCELLED(b->d)){
+			blob->res = -1;
+			continue;
+		}
+		blob->res = upload_blob(b->d, blob);
 	}
-	
-	ON_LOG(t->d->database, STR("%s '%s' table data with uuid: %s", 
-				t->deleted?"deleting":"uploading",
-		    t->tablename, values[0]));
 
-	object = cJSON_CreateObject();
-	if (object == NULL){
-		ON_ERR(t->d->database, "can't init JSON");
-		return 1;
+	return NULL;
+}
+
+static void * row_worker(void *data)
+{
+	struct upload_batch *b = data;
+	int i;
+
+	while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED))
+			< b->count)
+	{
+		struct upload_job *job = &b->jobs[i];
+		// not uploaded rows are left for next sync
+		if (SYNC_CANCELLED(b->d))
+			job->res = -1;
+		// job with not uploaded blobs fails
+		if (job->res == 0)
+			job->res = upload_row(b, job);
+	}
+
+	return NULL;
+}
+
+/* run worker for count items in upload_threads threads -
+ * current thread is one of workers */
+static void run_workers(
+		struct upload_batch *b, void *(*worker)(void *), int count)
+{
+	pthread_t tids[YANDEX_DISK_UPLOAD_THREADS_MAX];
+	int i, nthreads = b->d->upload_threads, started = 0;
+
+	if (nthreads > count)
+		nthreads = count;
+	if (nthreads > YANDEX_DISK_UPLOAD_THREADS_MAX)
+		nthreads = YANDEX_DISK_UPLOAD_THREADS_MAX;
+
+	b->next = 0;
+	for (i = 0; i < nthreads - 1; ++i) {
+		if (pthread_create(&tids[i], NULL, worker, b))
+			break;
+		started++;
+	}
+	worker(b);
+	for (i = 0; i < started; ++i)
+		pthread_join(tids[i], NULL);
+}
+
+/* upload blobs of all jobs concurrently - chunks of one large
+ * blob are uploaded in parallel too. Job fails if any of its
+ * blobs failed */
+static void upload_blobs(struct upload_batch *b)
+{
+	struct upload_blob *blob;
+	int i, n = 0;
+
+	for (i = 0; i < b->count; ++i) {
+		for (blob = b->jobs[i].blobs; blob; blob = blob->next)
+			n++;
+	}
+	if (n == 0)
+		return;
+
+	b->blobs = MALLOC(n * sizeof(struct upload_blob *));
+	if (b->blobs == NULL){
+		ON_ERR(b->d->database, "can't allocate memory");
+		for (i = 0; i < b->count; ++i) {
+			for (blob = b->jobs[i].blobs; blob; blob = blob->next)
+				blob->res = -1;
+			if (b->jobs[i].blobs)
+				b->jobs[i].res = -1;
+		}
+		return;
+	}
+
+	b->nblobs = 0;
+	for (i = 0; i < b->count; ++i) {
+		for (blob = b->jobs[i].blobs; blob; blob = blob->next)
+			b->blobs[b->nblobs++] = blob;
 	}
-	
-	for (i=0; i<num_cols; ++i) {
-		cJSON *item = NULL;
-		char *base64 = NULL;
-		size_t length = 0;
 
-		if (values[i] == NULL)
+	run_workers(b, blob_worker, b->nblobs);
+
+	for (i = 0; i < b->count; ++i) {
+		for (blob = b->jobs[i].blobs; blob; blob = blob->next) {
+			if (blob->res)
+				b->jobs[i].res = -1;
+		}
+	}
+
+	free(b->blobs);
+	b->blobs = NULL;
+	b->nblobs = 0;
+}
+
+/* upload jobs with uploaded blobs (res == 0) as one
+ * bundle file */
+static void upload_bundle(struct upload_batch *b)
+{
+	kdydm_t *d = b->d;
+	char path[BUFSIZ], uuid[37], *error = NULL;
+	size_t offset = 0;
+	uint64_t start;
+	struct str s;
+	int i, res, count = 0;
+
+	for (i = 0; i < b->count; ++i) {
+		if (SYNC_CANCELLED(d))
+			b->jobs[i].res = -1;
+		if (b->jobs[i].res == 0)
+			count++;
+	}
+	if (count == 0)
+		return;
+
+	if (str_init(&s)){
+		ON_ERR(d->database, "can't allocate memory");
+		for (i = 0; i < b->count; ++i)
+			b->jobs[i].res = -1;
+		return;
+	}
+
+	str_append(&s, BUNDLE_MAGIC, strlen(BUNDLE_MAGIC));
+	str_appendf(&s, "%d\n", count);
+	for (i = 0; i < b->count; ++i) {
+		struct upload_job *job = &b->jobs[i];
+		if (job->res)
 			continue;
-		
-		switch (types[i]) {
-			case KDATA2_TYPE_NUMBER:
-				item = cJSON_CreateNumber(*(long *)(values[i]));
+		str_appendf(&s, "%d %ld %s %s %zu %zu\n",
+				job->deleted, job->timestamp, 
+				job->tablename, job->uuid, offset, job->size);
+		offset += job->size;
+	}
+	str_append(&s, "\n", 1);
+	for (i = 0; i < b->count; ++i) {
+		if (b->jobs[i].res == 0)
+			str_append(&s, b->jobs[i].data, b->jobs[i].size);
+	}
+
+	// bundle is named with upload time - rows in bundle may
+	// be older then last update of other devices
+	uuid_new(uuid);
+	if (d->json)
+		snprintf(path, BUFSIZ, "app:/%s/%ld.%s.%s",
+				UPDATES, (long)b->uploaded, BUNDLE, uuid);
+	else
+		snprintf(path, BUFSIZ, "app:/%s/%010ld/%ld.%ld.%c.%s.%s",
+				CHANGES, CHANGES_BUCKET(b->uploaded), 
+				(long)b->uploaded, (long)b->uploaded,
+				CHANGE_UPDATE, BUNDLE, uuid);
+
+	ON_DBG(d->database, STR("upload bundle of %d rows to path: %s",
+				count, path));
+	start = kdata2_stats_now();
+	res = put_payload(d, path, s.str, s.len, &error);
+	kdata2_stats_record(d->database, KDATA2_STAT_SYNC_UPLOAD, start);
+	free(s.str);
+
+	if (res){
+		ON_ERR(d->database, STR("can't upload bundle to path: %s: %s",
+				 path, error?error:""));
+	}
+	free(error);
+
+	for (i = 0; i < b->count; ++i) {
+		if (b->jobs[i].res == 0)
+			b->jobs[i].res = res;
+	}
+
+	if (d->progress){
+		d->current += b->count;
+		d->progress(
+				d->progressp,
+				PPHASE_UPLOADING,
+				d->current,
+				d->total);
+	}
+}
+
+/* create folder of bucket once */
+static void prepare_bucket(kdydm_t *d, long bucket)
+{
+	char path[BUFSIZ], *error = NULL;
+
+	if (d->bucket == bucket)
+		return;
+
+	snprintf(path, BUFSIZ, "app:/%s/%010ld", CHANGES, bucket);
+	// error if folder exists
+	if (d->backend->mkdir(d->backend, path, &error)){
+		ON_DBG(d->database, STR("mkdir: %s: %s", 
+					path, error?error:""));
+	}
+	free(error);
+	d->bucket = bucket;
+}
+
+/* write time to manifest of bucket - readers do not list
+ * buckets with manifest older then their last update */
+static void write_manifest(kdydm_t *d, long bucket)
+{
+	char path[BUFSIZ], data[32], *error = NULL;
+	int len;
+
+	len = snprintf(data, sizeof(data), "%ld\n", (long)time(NULL));
+	snprintf(path, BUFSIZ, "app:/%s/%010ld/%s", 
+			CHANGES, bucket, MANIFEST);
+	if (d->backend->put(d->backend, path, data, len, &error)){
+		ON_ERR(d->database, STR("can't write manifest: %s: %s",
+					path, error?error:""));
+	}
+	free(error);
+}
+
+/* upload jobs concurrently (or as bundle) and mark uploaded
+ * rows in one savepoint */
+static void upload_batch(struct upload_batch *b)
+{
+	kdydm_t *d = b->d;
+	int i, uploaded = 0, failed = 0, cancelled;
+	struct upload_blob *blob;
+	struct str s;
+
+	if (b->count == 0)
+		return;
+
+	for (i = 0; i < b->count; ++i)
+		b->jobs[i].res = 0;
+
+	// rows are uploaded when all blobs are uploaded - readers
+	// never see row without blobs
+	upload_blobs(b);
+
+	// name is stamped after blobs - time of upload of rows
+	// is covered by grace window of readers
+	b->uploaded = time(NULL);
+	if (!d->json)
+		prepare_bucket(d, CHANGES_BUCKET(b->uploaded));
+
+	if (d->bundle)
+		upload_bundle(b);
+	else
+		run_workers(b, row_worker, b->count);
+
+	// mark uploaded, count failed attempts - rows of cancelled
+	// sync are not failed
+	cancelled = SYNC_CANCELLED(d);
+	if (str_init(&s) == 0){
+		str_appendf(&s, "SAVEPOINT upload_mark;");
+		for (i = 0; i < b->count; ++i) {
+			struct upload_job *job = &b->jobs[i];
+			// chunks are not uploaded again when row is retried
+			for (blob = job->blobs; blob; blob = blob->next)
+				if (blob->res == 0)
+					str_appendf(&s,
+							"INSERT OR IGNORE INTO %s (hash) "
+							"VALUES ('%s');",
+							BLOBS, blob->hash);
+			if (job->res){
+				if (cancelled)
+					b->failed++;
+				else {
+					retry_sql_failed(&s, job->uuid, 0, b->uploaded);
+					failed++;
+				}
+				continue;
+			}
+			uploaded++;
+			retry_sql_done(&s, job->uuid);
+			if (!job->deleted)
+				str_appendf(&s,
+						"UPDATE '%s' SET YANDEX_DISK_UPLOADED = 1 "
+						"WHERE %s = '%s';",
+						job->tablename, UUIDCOLUMN, job->uuid);
+			if (job->update){
+				// row changed after select (in any second) stays
+				// not uploaded with all columns set
+				str_appendf(&s,
+						"UPDATE _kdata2_updates "
+						"SET YANDEX_DISK_UPLOADED = CASE "
+						"WHEN COALESCE(seq, 0) = %lld THEN %ld END, "
+						"columns = CASE WHEN COALESCE(seq, 0) = %lld "
+						"THEN COALESCE(columns, -1) & ~%lld "
+						"ELSE columns END",
+						(long long)job->update_seq, job->update_timestamp,
+						(long long)job->update_seq, (long long)job->columns);
+				if (job->versions)
+					str_appendf(&s, ", YANDEX_DISK_COLUMNS = %s",
+							job->versions);
+				str_appendf(&s, " WHERE uuid = '%s';", job->uuid);
+			}
+		}
+		str_appendf(&s, "RELEASE upload_mark;");
+		// rows are selected again if they are not marked -
+		// savepoint nests in transaction of application
+		if (uploaded || failed){
+			kdata2_do_in_database_lock(d->database)
+			{
+				if (kdata2_sqlite3_exec(d->database, s.str)){
+					kdata2_sqlite3_exec(d->database,
+							"ROLLBACK TO upload_mark; "
+							"RELEASE upload_mark;");
+					b->failed += uploaded + failed;
+				}
+			}
+		}
+		free(s.str);
+		if (uploaded && !d->json)
+			write_manifest(d, CHANGES_BUCKET(b->uploaded));
+	} else {
+		ON_ERR(d->database, "can't allocate memory");
+		b->failed += b->count;
+	}
+
+	ON_LOG(d->database, STR("uploaded %d of %d rows, %d failed",
+				uploaded, b->count, failed));
+
+	for (i = 0; i < b->count; ++i) {
+		free(b->jobs[i].data);
+		free(b->jobs[i].versions);
+		free_blobs(b->jobs[i].blobs);
+	}
+	b->count = 0;
+	b->bytes = 0;
+}
+
+/* JSON for older versions of module */
+static char * row_json_stmt(sqlite3_stmt *stmt, size_t *size)
+{
+	int i, num_cols = sqlite3_column_count(stmt);
+	char *json;
+	cJSON *object;
+
+	object = cJSON_CreateObject();
+	if (object == NULL)
+		return NULL;
+
+	for (i = 0; i < num_cols; ++i) {
+		cJSON *item = NULL;
+
+		switch (sqlite3_column_type(stmt, i)) {
+			case SQLITE_INTEGER:
+				item = cJSON_CreateNumber(
+						sqlite3_column_int64(stmt, i));
 				break;
-			case KDATA2_TYPE_FLOAT:
-				item = cJSON_CreateNumber(*(double *)(values[i]));
+			case SQLITE_FLOAT:
+				item = cJSON_CreateNumber(
+						sqlite3_column_double(stmt, i));
 				break;
-			case KDATA2_TYPE_TEXT:
-				item = cJSON_CreateString((char *)(values[i]));
+			case SQLITE_TEXT:
+				item = cJSON_CreateString(
+						(const char *)sqlite3_column_text(stmt, i));
 				break;
-			case KDATA2_TYPE_DATA:
-			{
-				base64 = base64_encode((unsigned char *)(values[i]), sizes[i], &length);
-				if (base64){
-					item = cJSON_CreateString(base64);
-					free(base64);
+			case SQLITE_BLOB:
+				{
+					size_t length = 0;
+					char *base64 = base64_encode(
+							sqlite3_column_blob(stmt, i), 
+							sqlite3_column_bytes(stmt, i), 
+							&length);
+					if (base64){
+						item = cJSON_CreateString(base64);
+						free(base64);
+					}
 				}
-				break;			
-			}
+				break;
 			default:
 				break;
 		}
 		if (item)
-			cJSON_AddItemToObject(object, columns[i], item);
-	}
-			
-	uuid      =  (char *)(values[0]);
-	timestamp = *(long *)(values[i-1]);
-	//ON_LOG(t->d->database, cJSON_Print(json));
-	
-	json = cJSON_Print(object);
-	if (upload_json(t->d, 
-				t->tablename, 
-				uuid, 
+			cJSON_AddItemToObject(object, 
+					sqlite3_column_name(stmt, i), item);
+	}
+
+	json = cJSON_PrintUnformatted(object);
+	cJSON_Delete(object);
+	if (json)
+		*size = strlen(json);
+	return json;
+}
+
+/* chunk of large blob of encoded row - add it to upload if
+ * remote has no chunk with hash */
+static int blob_ref(
+		void *user_data, const unsigned char hash[SHA256_LEN],
+		const void *data, size_t size)
+{
+	struct udata_t *t = user_data;
+	struct upload_blob *blob;
+	char SQL[BUFSIZ], hex[SHA256_LEN*2+1], *known;
+
+	sha256_hex(hash, hex);
+	snprintf(SQL, BUFSIZ,
+			"SELECT 1 FROM %s WHERE hash = '%s';", BLOBS, hex);
+	known = kdata2_get_string(t->d->database, SQL);
+	if (known){
+		free(known);
+		return 0;
+	}
+
+	// same chunk in row
+	for (blob = t->blobs; blob; blob = blob->next) {
+		if (strcmp(blob->hash, hex) == 0)
+			return 0;
+	}
+
+	blob = NEW(struct upload_blob);
+	if (blob == NULL)
+		return 1;
+	blob->data = MALLOC(size);
+	if (blob->data == NULL){
+		free(blob);
+		return 1;
+	}
+	memcpy(blob->data, data, size);
+	strcpy(blob->hash, hex);
+	blob->size = size;
+	blob->next = t->blobs;
+	t->blobs = blob;
+
+	return 0;
+}
+
+/* encode row of select table request and add to batch.
+ * Return 1 to stop */
+static int add_row(struct udata_t *t, sqlite3_stmt *stmt)
+{
+	int num_cols = sqlite3_column_count(stmt);
+	int64_t columns = t->columns;
+	const char *uuid;
+	char *versions = NULL;
+	time_t timestamp;
+	void *data;
+	size_t size = 0;
+	struct str s;
+
+	// rows of _kdata2_updates are counted
+	if (!t->update)
+		t->batch->selected++;
+
+	uuid = (const char *)sqlite3_column_text(stmt, 0);
+	if (uuid == NULL || 
+			sqlite3_column_type(stmt, num_cols - 1) == SQLITE_NULL)
+	{
+		ON_ERR(t->d->database, "broken table row data");
+		return 0;
+	}
+	timestamp = sqlite3_column_int64(stmt, num_cols - 1);
+
+	ON_DBG(t->d->database, STR("%s '%s' table data with uuid: %s",
+				t->deleted?"deleting":"uploading",
+		    t->tablename, uuid));
+
+	// JSON has all columns
+	if (t->d->json)
+		columns = -1;
+
+	t->blobs = NULL;
+	if (t->d->json)
+		data = row_json_stmt(stmt, &size);
+	else
+		data = row_encode_stmt(t->table, stmt, columns, 
+				t, blob_ref, &size);
+	if (data == NULL){
+		ON_ERR(t->d->database, "can't encode row");
+		free_blobs(t->blobs);
+		return 1;
+	}
+
+	// uploaded columns have version of row
+	if (t->update && str_init(&s) == 0){
+		int num_columns = 0;
+		while (t->table->columns[num_columns])
+			num_columns++;
+		row_versions_sql(&s, t->versions, t->versions_size,
+				num_columns, columns, timestamp);
+		versions = s.str;
+	}
+
+	return batch_add(t->batch,
+				t->tablename,
+				uuid,
 				timestamp,
 				t->deleted,
-				json))
-	{
-		// on error
-		ON_LOG(t->d->database, "can't upload data");
-	} else {
-		// set as uploaded
-		char SQL[BUFSIZ];
-		ON_LOG(t->d->database, "data uploaded!");
-		sprintf(SQL, 
-				"UPDATE '%s' SET YANDEX_DISK_UPLOADED = 1 "
-				"WHERE %s = '%s';", 
-				t->tablename, UUIDCOLUMN, uuid);
-		kdata2_sqlite3_exec(t->d->database, SQL);
-		t->uploaded = 1;
-	}
-
-	cJSON_free(object);
-	free(json);
-	
-	return 0;
+				t->update,
+				t->timestamp,
+				t->seq,
+				columns,
+				versions,
+				data,
+				size,
+				t->blobs);
+}
+
+/* add rows of select table request to batch until it is
+ * full - statement is finalized before upload */
+static void add_rows(struct udata_t *t, const char *sql)
+{
+	sqlite3_stmt *stmt;
+	int res;
+
+	if (kdata2_sqlite3_prepare(t->d->database, sql, &stmt))
+		return;
+
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (add_row(t, stmt))
+			break;
+	}
+	if (res != SQLITE_ROW && res != SQLITE_DONE){
+		ON_ERR(t->d->database, STR("sqlite3_step: %s",
+					sqlite3_errmsg(t->d->database->db)));
+	}
+
+	sqlite3_finalize(stmt);
+}
+
+/* table definition with name */
+static struct kdata2_table * find_table(
+		kdydm_t *d, const char *tablename)
+{
+	do {
+		kdata2_table_for_each(d->database) {
+			if (strcmp(table->tablename, tablename) == 0)
+				return table;
+		}
+	} while(0);
+	return NULL;
 }
 
 static int for_each_row_in_kdata2_updates(
 				void *user_data,
 				int	num_cols,
 				enum KDATA2_TYPE types[],
-				const char *columns[], 
+				const char *columns[],
 				void *values[],
 				size_t sizes[]
 				)
 {
-	char SQL[BUFSIZ], *request = NULL;
-	kdydm_t *d = user_data;
+	char *request = NULL;
+	struct upload_batch *b = user_data;
+	kdydm_t *d = b->d;
 	struct udata_t t;
 	struct str s;
 
 	assert(d);
 	assert(d->database);
 
-	if (values == NULL || num_cols < 5)
+	b->selected++;
+	if (values == NULL || num_cols < 7 ||
+			!values[0] || !values[1] || !values[2] || !values[3])
 	{
 		ON_ERR(d->database, "corrupted data");
 		return 0;
 	}
 
-	if (str_init(&s)){
-		ON_ERR(d->database, "can't allocate memory");
-		return 0;
-	}
 	t.d = d;
+	t.batch = b;
+	t.table = NULL;
 	t.tablename = values[0];
 	t.uuid = values[1];
 	t.timestamp = *(long *)values[2];
-	t.deleted = *(long *)values[4];
-	t.uploaded = 0;
+	t.deleted = *(long *)values[3];
+	t.update = 1;
+	// NULL bitmap (older versions) - all columns
+	t.columns = -1;
+	if (values[4] && types[4] == KDATA2_TYPE_NUMBER)
+		t.columns = *(long *)values[4];
+	t.seq = 0;
+	if (values[6] && types[6] == KDATA2_TYPE_NUMBER)
+		t.seq = *(long *)values[6];
+	t.versions = NULL;
+	t.versions_size = 0;
+	if (values[5] && types[5] == KDATA2_TYPE_DATA){
+		t.versions = values[5];
+		t.versions_size = sizes[5];
+	}
 
 	if (t.deleted)
 	{
-		char *json = "0";
-		if (upload_json(t.d, 
-					t.tablename, 
-					t.uuid, 
+		char *data = strdup("0");
+		if (data == NULL){
+			ON_ERR(d->database, "can't allocate memory");
+			return 1;
+		}
+		return batch_add(b,
+					t.tablename,
+					t.uuid,
 					t.timestamp,
 					t.deleted,
-					json))
-		{
-			// on error
-			ON_LOG(t.d->database, "can't delete data");
-		} else {
-			t.uploaded = 1;
-		}
-		goto get_updates_end;
+					t.update,
+					t.timestamp,
+					t.seq,
+					-1,
+					NULL,
+					data,
+					1,
+					NULL);
+	}
+
+	t.table = find_table(d, t.tablename);
+	if (t.table == NULL){
+		ON_ERR(d->database, STR("No table with name: %s", t.tablename));
+		return 0;
+	}
+
+	/* get row from table and add to batch */
+	if (str_init(&s)){
+		ON_ERR(d->database, "can't allocate memory");
+		return 1;
 	}
 
-	/* get row from table and upload to YD */
 	request = kdata2_sql_select_table_request(
 				t.d->database, t.tablename);
-	if (request == NULL)
+	if (request == NULL){
+		free(s.str);
 		return 0;
+	}
 
 	str_append(&s, request, strlen(request));
 	free(request);
-	
-	str_appendf(&s, "WHERE %s = '%s'", 
+
+	str_appendf(&s, "WHERE %s = '%s'",
 			UUIDCOLUMN, t.uuid);
-	kdata2_get(d->database, s.str, 
-			&t, for_each_row_in_all_columns);
+	add_rows(&t, s.str);
 	free(s.str);
-	
-get_updates_end:
-	if (t.uploaded) {
-		// remove from _kdata2_updates
-		sprintf(SQL, "UPDATE _kdata2_updates "
-				"SET YANDEX_DISK_UPLOADED = %ld "
-				"WHERE uuid = '%s'", t.timestamp, t.uuid);
-		kdata2_sqlite3_exec(d->database, SQL);
-	}
-	
-	return 0;
+
+	return b->count >= UPLOAD_BATCH ||
+		b->bytes >= UPLOAD_BATCH_BYTES;
 }
 
 void upload_to_yandex_disk(kdydm_t *d)
 {
 	char SQL[BUFSIZ], *count = NULL, *request = NULL;
+	struct upload_batch *b;
+	uint64_t start;
 
 	assert(d);
 	assert(d->database);
 
+	b = NEW(struct upload_batch);
+	if (b == NULL){
+		ON_ERR(d->database, "can't allocate memory");
+		return;
+	}
+	b->d = d;
+
 	// updates in _kdata2_updates table
 	d->current = 0;
 	d->total = 0;
 	if (d->progress)
 		d->progress(d->progressp, PPHASE_COUNTING, 0, 1);
 
-	sprintf(SQL, 
+	sprintf(SQL,
 			"SELECT COUNT(*) FROM _kdata2_updates "
 			"WHERE (YANDEX_DISK_UPLOADED IS NULL "
 			"OR YANDEX_DISK_UPLOADED != timestamp)");
+	start = kdata2_stats_now();
 	count = kdata2_get_string(d->database, SQL);
-	d->total = atoi(count);
+	kdata2_stats_record(d->database, KDATA2_STAT_SYNC_COUNT, start);
+	d->total = count?atoi(count):0;
 	free(count);
 	if (d->progress)
 		d->progress(d->progressp, PPHASE_COUNTING, 1, 1);
 
-	ON_LOG(d->database, 
+	ON_LOG(d->database,
 			STR("Found %d new rows for upload", d->total));
-	
-	if (d->total){
-		sprintf(SQL, 
-				"SELECT * FROM _kdata2_updates "
+
+	while (d->total && !SYNC_CANCELLED(d)){
+		sprintf(SQL,
+				"SELECT tablename, uuid, timestamp, deleted, "
+				"columns, YANDEX_DISK_COLUMNS, seq FROM _kdata2_updates "
 				"WHERE (YANDEX_DISK_UPLOADED IS NULL "
-				"OR YANDEX_DISK_UPLOADED != timestamp)");
-		kdata2_get(d->database, SQL, 
-				d, for_each_row_in_kdata2_updates);
+				"OR YANDEX_DISK_UPLOADED != timestamp) "
+				"AND uuid NOT IN "
+				"(SELECT item FROM %s WHERE next_try > %ld) "
+				"ORDER BY rowid LIMIT %d OFFSET %d",
+				RETRY, (long)time(NULL), UPLOAD_BATCH, b->failed);
+		b->selected = 0;
+		kdata2_get(d->database, SQL,
+				b, for_each_row_in_kdata2_updates);
+		if (b->selected == 0)
+			break;
+		b->failed += b->selected - b->count;
+		upload_batch(b);
 	}
-	
+
 	// new records in all tables
 	d->current = 0;
 	d->total_tables = kdata2_count_tables(d->database);
 	do {
 		kdata2_table_for_each(d->database) {
 			struct udata_t t;
-			struct str s;
 
-			if (str_init(&s)){
-		    ON_ERR(d->database, "allocation error");	
-				continue;
-			}
-	
 			t.d = d;
+			t.batch = b;
+			t.table = table;
 			t.tablename = table->tablename;
+			t.uuid = NULL;
+			t.timestamp = 0;
 			t.deleted = 0;
-			t.uploaded = 0;
+			t.update = 0;
+			t.seq = 0;
+			t.columns = -1;
+			t.versions = NULL;
+			t.versions_size = 0;
+
+			b->failed = 0;
 
 			d->current = 0;
 			d->total = 0;
 			if (d->progress)
-				d->progress(d->progressp, PPHASE_COUNTING, 
+				d->progress(d->progressp, PPHASE_COUNTING,
 						d->current_table++, d->total_tables);
 
 			snprintf(SQL, BUFSIZ,
 				"SELECT COUNT(*) FROM '%s' "
 				"WHERE (YANDEX_DISK_UPLOADED IS NULL "
 				"OR YANDEX_DISK_UPLOADED = 0) ", table->tablename);
+			start = kdata2_stats_now();
 			count = kdata2_get_string(d->database, SQL);
-			d->total = atoi(count);
+			kdata2_stats_record(d->database, KDATA2_STAT_SYNC_COUNT, start);
+			d->total = count?atoi(count):0;
 			free(count);
-			ON_LOG(d->database, 
+			ON_LOG(d->database,
 				STR("Found %d new rows for upload", d->total));
 
-			if (d->total == 0)
+			if (d->total == 0 || SYNC_CANCELLED(d))
 				continue;
-			
+
 			request = kdata2_sql_select_table_request(
 						d->database, table->tablename);
 			if (request == NULL)
@@ -331,16 +1028,35 @@ void upload_to_yandex_disk(kdydm_t *d)
 				continue;
 			}
 
-			str_append(&s, request, strlen(request));
-			free(request);
+			for (;;) {
+				struct str s;
+				if (str_init(&s)){
+					ON_ERR(d->database, "allocation error");
+					break;
+				}
+				str_append(&s, request, strlen(request));
+				str_appendf(&s,
+						"WHERE (YANDEX_DISK_UPLOADED IS NULL "
+						"OR YANDEX_DISK_UPLOADED = 0) "
+						"AND %s NOT IN "
+						"(SELECT item FROM %s WHERE next_try > %ld) "
+						"ORDER BY rowid LIMIT %d OFFSET %d;",
+						UUIDCOLUMN, RETRY, (long)time(NULL),
+						UPLOAD_BATCH, b->failed);
 
-			str_appendf(&s,
-					"WHERE (YANDEX_DISK_UPLOADED IS NULL "
-					"OR YANDEX_DISK_UPLOADED = 0);");
-				
-			kdata2_get(d->database, s.str, 
-					&t, for_each_row_in_all_columns);
-			free(s.str);
+				b->selected = 0;
+				add_rows(&t, s.str);
+				free(s.str);
+				if (b->selected == 0)
+					break;
+				b->failed += b->selected - b->count;
+				upload_batch(b);
+				if (SYNC_CANCELLED(d))
+					break;
+			}
+			free(request);
 		}
 	 } while(0);
+
+	free(b);
 }
@@ -0,0 +1,113 @@
+/**
+ * File              : uuidmap.c
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+#include "uuidmap.h"
+#include "cYandexDisk/alloc.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UUIDMAP_MIN 64
+
+/* FNV-1a */
+static size_t _hash(const char *uuid)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while (*uuid) {
+		h ^= (unsigned char)*uuid++;
+		h *= 0x100000001b3ULL;
+	}
+	return (size_t)(h ^ (h >> 32));
+}
+
+static struct uuidmap_entry * _find(
+		struct uuidmap_entry *entries, size_t size, const char *uuid)
+{
+	size_t i = _hash(uuid) & (size - 1);
+	while (entries[i].uuid[0] && strcmp(entries[i].uuid, uuid))
+		i = (i + 1) & (size - 1);
+	return &entries[i];
+}
+
+/* key is empty or does not fit entry - truncated keys of
+ * different rows would be equal */
+static int _invalid(const char *uuid)
+{
+	struct uuidmap_entry e;
+	return uuid == NULL || uuid[0] == 0 ||
+		memchr(uuid, 0, sizeof(e.uuid)) == NULL;
+}
+
+/* keep map not more then half full */
+static int _grow(struct uuidmap *m)
+{
+	struct uuidmap_entry *entries;
+	size_t i, size = m->size?m->size * 2:UUIDMAP_MIN;
+
+	entries = MALLOC(size * sizeof(struct uuidmap_entry));
+	if (entries == NULL)
+		return -1;
+	memset(entries, 0, size * sizeof(struct uuidmap_entry));
+
+	for (i = 0; i < m->size; ++i) {
+		if (m->entries[i].uuid[0] == 0)
+			continue;
+		*_find(entries, size, m->entries[i].uuid) = m->entries[i];
+	}
+
+	free(m->entries);
+	m->entries = entries;
+	m->size = size;
+	return 0;
+}
+
+struct uuidmap_entry * uuidmap_get(
+		struct uuidmap *m, const char *uuid)
+{
+	struct uuidmap_entry *e;
+	if (m->count == 0 || _invalid(uuid))
+		return NULL;
+	e = _find(m->entries, m->size, uuid);
+	return e->uuid[0]?e:NULL;
+}
+
+struct uuidmap_entry * uuidmap_put(
+		struct uuidmap *m, const char *uuid)
+{
+	struct uuidmap_entry *e;
+
+	if (_invalid(uuid))
+		return NULL;
+
+	if ((m->count + 1) * 2 > m->size && _grow(m))
+		return NULL;
+
+	e = _find(m->entries, m->size, uuid);
+	if (e->uuid[0] == 0){
+		strcpy(e->uuid, uuid);
+		e->value = 0;
+		e->data = NULL;
+		m->count++;
+	}
+	return e;
+}
+
+void uuidmap_clear(struct uuidmap *m)
+{
+	if (m->entries && m->count)
+		memset(m->entries, 0, m->size * sizeof(struct uuidmap_entry));
+	m->count = 0;
+}
+
+void uuidmap_free(struct uuidmap *m)
+{
+	free(m->entries);
+	m->entries = NULL;
+	m->size = 0;
+	m->count = 0;
+}
@@ -0,0 +1,50 @@
+/**
+ * File              : uuidmap.h
+ * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
+ * Date              : 18.10.2026
+ * Last Modified Date: 19.10.2026
+ * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
+ */
+
+/* Hash map of rows by uuid */
+
+/* Conception:
+ * Sync planner looks up rows by uuid many times for one
+ * listing - uuids are unique for all tables (as in
+ * _kdata2_updates), so uuid is the key. Map is open
+ * addressing table with linear probing, entries are stored
+ * in it and are not removed - map is cleared at once */
+
+#ifndef YANDEX_DISK_UUIDMAP_H
+#define YANDEX_DISK_UUIDMAP_H
+
+#include <stddef.h>
+
+struct uuidmap_entry {
+	char uuid[37];                 // empty for free slot
+	long value;
+	void *data;
+};
+
+struct uuidmap {
+	struct uuidmap_entry *entries;
+	size_t size;                   // power of 2 or 0
+	size_t count;
+};
+
+/* return entry of uuid or NULL */
+struct uuidmap_entry * uuidmap_get(
+		struct uuidmap *m, const char *uuid);
+
+/* return entry of uuid and add it with zero value and data
+ * if not exists - NULL on memory error or if uuid is empty or
+ * longer then 36 chars */
+struct uuidmap_entry * uuidmap_put(
+		struct uuidmap *m, const char *uuid);
+
+/* remove all entries */
+void uuidmap_clear(struct uuidmap *m);
+
+void uuidmap_free(struct uuidmap *m);
+
+#endif /* ifndef YANDEX_DISK_UUIDMAP_H */
@@ -2,7 +2,7 @@
  * File              : yandexdisk.h
  * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
  * Date              : 21.04.2026
- * Last Modified Date: 27.04.2026
+ * Last Modified Date: 19.10.2026
  * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
  */
 
@@ -35,12 +35,24 @@
  * data
  * 3. Periodicaly select all tables and rows where timestamp
  * != YANDEX_DISK_UPLOADED - then upload them as JSON to
- * yandex disk and save with name "timestamp-tablename-uuid"
- * 4. Then list files in yandex disk sorted with DECS order
- * - and select files where timestamp > then last downloaded
- *  update - add them to download list
+ * yandex disk and save with name "timestamp.tablename.uuid"
+ * (or binary encoded to folder of hour of upload with name
+ * "uploaded.timestamp.kind.tablename.uuid", then write time
+ * to manifest of folder - see yandex_disk_set_json)
+ * 4. Then list folders newer then last downloaded update,
+ * read their manifests and list files of changed folders
+ * sorted with DECS order - and select files uploaded after
+ * last downloaded update (overlapped by grace window, names
+ * are stamped before files are visible) - add them to
+ * download list
  * 5. Foreach in download list - find row in database and
- * check timestamp. Download JSON and apply changes 
+ * check timestamp. Download row and apply changes 
+ * 6. If compaction is set, once a day one of devices folds
+ * changes older then compaction age to snapshot of each table and removes them.
+ * Devices which did not download removed changes apply
+ * snapshot first (in short savepoints, empty tables are
+ * loaded without checking local rows) and continue from its
+ * high-water mark - new device does not list old changes
  */
 
 /*
@@ -51,6 +63,7 @@
 #ifndef YANDEX_DISK_H
 #define YANDEX_DISK_H
 #include "../../kdata2.h"
+#include "backend.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -66,6 +79,14 @@ extern "C" {
 
 
 #define YANDEX_DISK_UPDATE_SEC 10
+#define YANDEX_DISK_DEBOUNCE_MS 500
+#define YANDEX_DISK_IDLE_MAX_SEC 300
+#define YANDEX_DISK_UPLOAD_THREADS 8
+#define YANDEX_DISK_DOWNLOAD_THREADS 8
+#define YANDEX_DISK_COMPACT_AGE (7 * 24 * 3600)
+#define YANDEX_DISK_TOMBSTONE_AGE (30 * 24 * 3600)
+#define YANDEX_DISK_RETRY_SEC 30
+#define YANDEX_DISK_RETRY_MAX_SEC (6 * 3600)
 
 typedef struct kdata_yandex_disk_module kdydm_t;
 
@@ -86,13 +107,107 @@ yandex_disk_module_load(
 			void *progressp, pphase phase, int current, int total)
 	  );
 
+/* load module with other remote storage backend (see
+ * backend.h) - module frees backend on unload */
+kdydm_t EXPORTDLL *
+yandex_disk_module_load_with_backend(
+		kdata2_t      * database, 
+		kdbackend_t   * backend,
+		void *progressp,
+		int (*progress)(
+			void *progressp, pphase phase, int current, int total)
+	  );
+
+/* create module without sync thread - run sync with
+ * yandex_disk_module_sync (for tests and benchmarks) and
+ * free with yandex_disk_module_unload */
+kdydm_t EXPORTDLL *
+yandex_disk_module_new(
+		kdata2_t      * database, 
+		kdbackend_t   * backend);
+
+/* run one upload/download cycle in current thread */
+int EXPORTDLL
+yandex_disk_module_sync(kdydm_t *module);
+
+/* wake sync thread to run cycle now - return -1 if module
+ * has no sync thread */
+int EXPORTDLL
+yandex_disk_sync_now(kdydm_t *module);
+
+/* stop sync thread and free module - running sync is
+ * cancelled between rows and transfers are aborted */
 int EXPORTDLL
 yandex_disk_module_unload(kdydm_t *module);
 
+/* as yandex_disk_module_unload but wait for sync thread not
+ * longer then ms milliseconds - return 1 if thread is still
+ * running (module is not freed, call unload again) */
+int EXPORTDLL
+yandex_disk_module_unload_timeout(kdydm_t *module, int ms);
+
 
 int EXPORTDLL
 yandex_disk_set_token(kdydm_t *, const char *token);
 
+/* set number of concurrent uploads (default
+ * YANDEX_DISK_UPLOAD_THREADS) */
+int EXPORTDLL
+yandex_disk_set_upload_threads(kdydm_t *, int threads);
+
+/* upload all changes of upload batch (up to 256 rows) as
+ * one bundle file instead of file for each row. Bundles are
+ * downloaded and applied by this version of module only -
+ * turn on when all devices are updated */
+int EXPORTDLL
+yandex_disk_set_bundle(kdydm_t *, int bundle);
+
+/* compress uploaded data with deflate level (1-9), 0 - do
+ * not compress. Compressed data is downloaded by this
+ * version of module only - turn on when all devices are
+ * updated */
+int EXPORTDLL
+yandex_disk_set_compression(kdydm_t *, int level);
+
+/* upload rows as JSON with base64 encoded data to flat
+ * app:/updates and app:/deleted folders, as older versions
+ * of module do (default 1). Set 0 to upload binary encoded
+ * rows (see rowcodec.h) - they are read by this version of
+ * module only, turn off when all devices are updated. Both
+ * formats and layouts are downloaded */
+int EXPORTDLL
+yandex_disk_set_json(kdydm_t *, int json);
+
+/* sync thread runs cycle after local change when no other
+ * changes are made for debounce milliseconds (default
+ * YANDEX_DISK_DEBOUNCE_MS), but not later then update
+ * interval after first change */
+int EXPORTDLL
+yandex_disk_set_debounce(kdydm_t *, int ms);
+
+/* while nothing changes sync thread doubles interval of
+ * remote checks up to max_sec (default
+ * YANDEX_DISK_IDLE_MAX_SEC) - set to 0 to check remote each
+ * update interval */
+int EXPORTDLL
+yandex_disk_set_idle_backoff(kdydm_t *, int max_sec);
+
+/* fold changes older then age seconds (YANDEX_DISK_COMPACT_AGE
+ * is suggested) to table snapshots and remove buckets which
+ * changes are in snapshots, 0 (default) - do not compact on
+ * this device. Flat folders of JSON mode are not compacted.
+ * Devices which are offline longer then
+ * YANDEX_DISK_TOMBSTONE_AGE may keep rows deleted on other
+ * devices */
+int EXPORTDLL
+yandex_disk_set_compaction(kdydm_t *, int age);
+
+/* set number of concurrent downloads (default
+ * YANDEX_DISK_DOWNLOAD_THREADS) - downloaded files are
+ * applied by one thread in order of timestamp */
+int EXPORTDLL
+yandex_disk_set_download_threads(kdydm_t *, int threads);
+
 void EXPORTDLL
 yandex_disk_set_file_download_progress(
 		kdydm_t *module,
@@ -2,15 +2,24 @@
  * File              : test.c
  * Author            : Igor V. Sementsov <ig.kuzm@gmail.com>
  * Date              : 14.03.2023
- * Last Modified Date: 07.06.2026
+ * Last Modified Date: 19.10.2026
  * Last Modified By  : Igor V. Sementsov <ig.kuzm@gmail.com>
  */
 
 #include "kdata2.h"
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "modules/yandexdisk/yandexdisk.h"
+#include "modules/yandexdisk/backend.h"
+#include "modules/yandexdisk/chunker.h"
+#include "modules/yandexdisk/internal.h"
+#include "modules/yandexdisk/retry.h"
+#include "modules/yandexdisk/rowcodec.h"
+#include "modules/yandexdisk/uuidmap.h"
 #include "modules/yclients/cYclients/cYclients.h"
 
 
@@ -92,10 +101,692 @@ int companies_cb(void *userdata, const CYCCompany *company)
 }
 
 
+/* Sync tests - run with argument "sync". Devices are
+ * databases in current directory synced with local backend
+ * (folder REMOTE), return nonzero if any check failed */
+#define REMOTE "kdata2_test.remote"
+
+static int failed = 0;
+
+static void check(int ok, const char *what)
+{
+	printf("%s...\t%s\n", what, ok?"OK":"\x1B[31mFAILED\x1B[0m");
+	if (!ok)
+		failed++;
+}
+
+static kdata2_t * test_open(const char *filepath)
+{
+	struct kdata2_table *t;
+	kdata2_t *d;
+
+	unlink(filepath);
+	kdata2_table_init(&t, "items",
+			KDATA2_TYPE_NUMBER, "n",
+			KDATA2_TYPE_TEXT,   "s",
+			KDATA2_TYPE_FLOAT,  "f",
+			KDATA2_TYPE_DATA,   "b",
+			NULL);
+	if (kdata2_init(&d, filepath, NULL, on_err, NULL, NULL, t, NULL))
+		return NULL;
+	kdata2_set_log_level(d, KDATA2_LOG_ERROR);
+	return d;
+}
+
+/* return result of query or empty string */
+static char * test_get(kdata2_t *d, const char *sql)
+{
+	static char buf[4][BUFSIZ];
+	static int n = 0;
+	char *res = kdata2_get_string(d, sql), *out = buf[n++ % 4];
+	snprintf(out, BUFSIZ, "%s", res?res:"");
+	free(res);
+	return out;
+}
+
+/* one sync cycle of device - backend may fail uploads,
+ * binary rows are uploaded to buckets unless test_binary is
+ * 0 (default of module), changes are compacted if
+ * test_compact_age is set */
+static int (*test_put)(kdbackend_t *, const char *,
+		const void *, size_t, char **);
+static int test_put_fails = 0;
+static int test_binary = 1;
+static int test_compact_age = 0;
+
+static int test_failing_put(kdbackend_t *b, const char *path,
+		const void *data, size_t size, char **error)
+{
+	if (test_put_fails && strstr(path, CHANGES "/")){
+		if (error)
+			*error = strdup("test: upload failed");
+		return -1;
+	}
+	return test_put(b, path, data, size, error);
+}
+
+static void test_sync_device(kdata2_t *d)
+{
+	kdbackend_t *backend = local_backend_new(REMOTE, 0, 0);
+	kdydm_t *module;
+
+	if (backend == NULL)
+		return;
+	test_put = backend->put;
+	backend->put = test_failing_put;
+	module = yandex_disk_module_new(d, backend);
+	if (module){
+		if (test_binary)
+			yandex_disk_set_json(module, 0);
+		yandex_disk_set_compaction(module, test_compact_age);
+		yandex_disk_module_sync(module);
+		yandex_disk_module_unload(module);
+	}
+}
+
+static int test_remove_cb(void *user_data, const char *name);
+
+static void test_remove(kdbackend_t *backend, const char *path)
+{
+	void *p[2] = {backend, (void *)path};
+	backend->list_sorted(backend, path, p, test_remove_cb, NULL);
+	backend->remove(backend, path, NULL);
+}
+
+static int test_remove_cb(void *user_data, const char *name)
+{
+	void **p = user_data;
+	char path[BUFSIZ];
+	snprintf(path, BUFSIZ, "%s/%s", (char *)p[1], name);
+	test_remove(p[0], path);
+	return 0;
+}
+
+static void test_remote_clean(void)
+{
+	kdbackend_t *backend = local_backend_new(REMOTE, 0, 0);
+	if (backend == NULL)
+		return;
+	test_remove(backend, "app:/");
+	kdata_backend_free(backend);
+}
+
+/* number of files in folder of remote */
+static int test_count_files(const char *folder)
+{
+	char path[BUFSIZ];
+	struct dirent *entry;
+	int count = 0;
+	DIR *dir;
+
+	snprintf(path, BUFSIZ, "%s/%s", REMOTE, folder);
+	dir = opendir(path);
+	while (dir && (entry = readdir(dir)))
+		if (entry->d_name[0] != '.')
+			count++;
+	if (dir)
+		closedir(dir);
+	return count;
+}
+
+/* deterministic bytes */
+static void test_fill(unsigned char *data, size_t size, unsigned seed)
+{
+	size_t i;
+	for (i = 0; i < size; ++i) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+}
+
+static void test_count_change(void *data, const char *tablename)
+{
+	(*(int *)data)++;
+}
+
+static void test_listeners(void)
+{
+	kdata2_t *a = test_open("kdata2_test_a.db");
+	int first = 0, second = 0;
+
+	if (!a){
+		check(0, "listeners: open database");
+		return;
+	}
+
+	kdata2_add_on_change(a, &first, test_count_change);
+	kdata2_add_on_change(a, &second, test_count_change);
+	free(kdata2_set_number_for_uuid(a, "items", "n", 1, NULL));
+	check(first == 1 && second == 1, "listeners: each listener is called");
+
+	check(kdata2_remove_on_change(a, &first, test_count_change) == 0,
+			"listeners: listener is removed");
+	free(kdata2_set_number_for_uuid(a, "items", "n", 2, NULL));
+	check(first == 1 && second == 2,
+			"listeners: removed listener is not called");
+	check(kdata2_remove_on_change(a, &first, test_count_change) == -1,
+			"listeners: unknown listener is not removed");
+	kdata2_remove_on_change(a, &second, test_count_change);
+
+	kdata2_close(a);
+}
+
+static void test_uuidmap(void)
+{
+	struct uuidmap m = {NULL, 0, 0};
+	const char *uuid = "00000000-0000-0000-0000-000000000001";
+	char longer[64];
+
+	snprintf(longer, sizeof(longer), "%sx", uuid);
+	check(uuidmap_put(&m, uuid) != NULL &&
+			uuidmap_get(&m, uuid) != NULL,
+			"uuidmap: uuid is added");
+	check(uuidmap_put(&m, longer) == NULL &&
+			uuidmap_get(&m, longer) == NULL && m.count == 1,
+			"uuidmap: longer key is rejected");
+	uuidmap_free(&m);
+}
+
+static void test_codec(void)
+{
+	kdata2_t *a = test_open("kdata2_test_a.db");
+	kdata2_t *b = test_open("kdata2_test_b.db");
+	unsigned char blob[100000];
+	char SQL[BUFSIZ], *uuid, *request;
+	sqlite3_stmt *stmt;
+	void *data = NULL;
+	size_t size = 0;
+
+	if (!a || !b){
+		check(0, "codec: open databases");
+		return;
+	}
+	test_remote_clean();
+	test_sync_device(b); // columns of module
+
+	test_fill(blob, sizeof(blob), 1);
+	uuid = kdata2_set_number_for_uuid(a, "items", "n", 
+			-1234567890123LL, NULL);
+	kdata2_set_text_for_uuid(a, "items", "s", "h\xc3\xa9llo \"q\"", uuid);
+	kdata2_set_float_for_uuid(a, "items", "f", -2.5, uuid);
+	kdata2_set_data_for_uuid(a, "items", "b", blob, sizeof(blob), uuid);
+
+	request = kdata2_sql_select_table_request(a, "items");
+	snprintf(SQL, BUFSIZ, "%sWHERE %s = '%s'", request, UUIDCOLUMN, uuid);
+	free(request);
+	if (kdata2_sqlite3_prepare(a, SQL, &stmt) == 0){
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			data = row_encode_stmt(a->tables[0], stmt, -1, 
+					NULL, NULL, &size);
+		sqlite3_finalize(stmt);
+	}
+	check(data && row_is_encoded(data, size), "codec: encode row");
+
+	check(data && row_apply(b, "items", uuid, time(NULL), data, size,
+				NULL, 0, NULL, NULL) == 0, "codec: apply row");
+	snprintf(SQL, BUFSIZ, 
+			"SELECT n || '|' || s || '|' || f || '|' || hex(b) "
+			"FROM items WHERE %s = '%s'", UUIDCOLUMN, uuid);
+	check(strcmp(test_get(a, SQL), test_get(b, SQL)) == 0,
+			"codec: decoded row is the same");
+
+	free(data);
+	free(uuid);
+	kdata2_close(a);
+	kdata2_close(b);
+}
+
+/* devices change one column in the same second - each
+ * device applies row of other one */
+static void test_tie(void)
+{
+	kdata2_t *d[2];
+	char SQL[BUFSIZ], *uuid, *request;
+	sqlite3_stmt *stmt;
+	void *data[2] = {NULL, NULL};
+	size_t size[2] = {0, 0};
+	time_t now = time(NULL);
+	int i;
+
+	d[0] = test_open("kdata2_test_a.db");
+	d[1] = test_open("kdata2_test_b.db");
+	if (!d[0] || !d[1]){
+		check(0, "codec: open databases");
+		return;
+	}
+	test_remote_clean();
+
+	uuid = kdata2_set_text_for_uuid(d[0], "items", "s", "aaa", NULL);
+	kdata2_set_text_for_uuid(d[1], "items", "s", "bbb", uuid);
+	request = kdata2_sql_select_table_request(d[0], "items");
+	for (i = 0; i < 2; ++i) {
+		test_sync_device(d[i]); // columns of module
+		snprintf(SQL, BUFSIZ, 
+				"UPDATE _kdata2_updates SET timestamp = %ld, "
+				"YANDEX_DISK_UPLOADED = NULL WHERE uuid = '%s'",
+				(long)now, uuid);
+		kdata2_sqlite3_exec(d[i], SQL);
+		snprintf(SQL, BUFSIZ, "%sWHERE %s = '%s'", 
+				request, UUIDCOLUMN, uuid);
+		if (kdata2_sqlite3_prepare(d[i], SQL, &stmt) == 0){
+			if (sqlite3_step(stmt) == SQLITE_ROW)
+				data[i] = row_encode_stmt(d[i]->tables[0], stmt, -1, 
+						NULL, NULL, &size[i]);
+			sqlite3_finalize(stmt);
+		}
+	}
+	free(request);
+
+	for (i = 0; i < 2; ++i) 
+		if (data[!i])
+			row_apply(d[i], "items", uuid, now, 
+					data[!i], size[!i], NULL, 0, NULL, NULL);
+	snprintf(SQL, BUFSIZ, "SELECT s FROM items "
+			"WHERE %s = '%s'", UUIDCOLUMN, uuid);
+	check(data[0] && data[1] && 
+			strcmp(test_get(d[0], SQL), test_get(d[1], SQL)) == 0,
+			"codec: devices converge on equal versions");
+
+	for (i = 0; i < 2; ++i) {
+		free(data[i]);
+		kdata2_close(d[i]);
+	}
+	free(uuid);
+}
+
+static void test_chunker(void)
+{
+	size_t size = 1024 * 1024, offset = 0;
+	unsigned char *data = malloc(size + 10), hash[SHA256_LEN];
+	struct chunk *chunks, *edited;
+	int i, k, count = 0, nedited = 0, bounds = 1, shared = 0;
+
+	if (data == NULL)
+		return;
+	test_fill(data, size, 2);
+
+	chunks = chunker_split(data, size, &count);
+	for (i = 0; chunks && i < count; ++i) {
+		sha256(data + chunks[i].offset, chunks[i].len, hash);
+		if (chunks[i].offset != offset ||
+				chunks[i].len > CHUNK_MAX ||
+				(chunks[i].len < CHUNK_MIN && i != count - 1) ||
+				memcmp(hash, chunks[i].hash, SHA256_LEN))
+			bounds = 0;
+		offset += chunks[i].len;
+	}
+	check(chunks && count > 1 && bounds && offset == size,
+			"chunker: chunks cover blob within bounds");
+
+	// insert bytes in the middle - only chunks around change
+	memmove(data + size/2 + 10, data + size/2, size/2);
+	memset(data + size/2, 'x', 10);
+	edited = chunker_split(data, size + 10, &nedited);
+	for (i = 0; chunks && edited && i < nedited; ++i)
+		for (k = 0; k < count; ++k)
+			if (memcmp(edited[i].hash, chunks[k].hash, SHA256_LEN) == 0){
+				shared++;
+				break;
+			}
+	check(edited && shared >= count - 2, 
+			"chunker: edit changes chunks around it");
+	free(edited);
+
+	// no boundaries in uniform data - chunks of max size
+	memset(data, 0, size);
+	free(chunks);
+	chunks = chunker_split(data, size, &count);
+	check(chunks && count == (int)(size / CHUNK_MAX) &&
+			chunks[0].len == CHUNK_MAX, "chunker: max chunk size");
+
+	free(chunks);
+	free(data);
+}
+
+static void test_retry(void)
+{
+	kdata2_t *a, *b;
+	char SQL[BUFSIZ], expected[32], *uuid;
+	struct str s;
+	int i;
+
+	test_remote_clean();
+	a = test_open("kdata2_test_a.db");
+	b = test_open("kdata2_test_b.db");
+	if (!a || !b){
+		check(0, "retry: open databases");
+		return;
+	}
+	test_sync_device(a); // tables of module
+
+	// delay doubles with each attempt up to max
+	for (i = 0; i < 3; ++i) {
+		str_init(&s);
+		retry_sql_failed(&s, "item", 1, 1000);
+		kdata2_sqlite3_exec(a, s.str);
+		free(s.str);
+	}
+	snprintf(SQL, BUFSIZ, 
+			"SELECT attempts || ' ' || next_try FROM %s "
+			"WHERE item = 'item'", RETRY);
+	snprintf(expected, sizeof(expected), "3 %d", 
+			1000 + (YANDEX_DISK_RETRY_SEC << 2));
+	check(strcmp(test_get(a, SQL), expected) == 0, 
+			"retry: backoff doubles");
+	for (i = 0; i < 30; ++i) {
+		str_init(&s);
+		retry_sql_failed(&s, "item", 1, 1000);
+		kdata2_sqlite3_exec(a, s.str);
+		free(s.str);
+	}
+	snprintf(SQL, BUFSIZ, 
+			"SELECT next_try FROM %s WHERE item = 'item'", RETRY);
+	check(atol(test_get(a, SQL)) == 1000 + YANDEX_DISK_RETRY_MAX_SEC,
+			"retry: backoff is limited");
+	str_init(&s);
+	retry_sql_done(&s, "item");
+	kdata2_sqlite3_exec(a, s.str);
+	free(s.str);
+
+	// failed upload waits for next try
+	uuid = kdata2_set_text_for_uuid(a, "items", "s", "retried", NULL);
+	test_put_fails = 1;
+	test_sync_device(a);
+	test_put_fails = 0;
+	snprintf(SQL, BUFSIZ, 
+			"SELECT COUNT(*) FROM %s WHERE item = '%s' "
+			"AND next_try > %ld", RETRY, uuid, (long)time(NULL));
+	check(atoi(test_get(a, SQL)) == 1, "retry: failed upload is counted");
+	test_sync_device(a);
+	test_sync_device(b);
+	check(atoi(test_get(b, "SELECT COUNT(*) FROM items")) == 0,
+			"retry: upload is not retried before next try");
+
+	snprintf(SQL, BUFSIZ, "UPDATE %s SET next_try = 0", RETRY);
+	kdata2_sqlite3_exec(a, SQL);
+	test_sync_device(a);
+	test_sync_device(b);
+	check(strcmp(test_get(b, "SELECT s FROM items"), "retried") == 0,
+			"retry: upload is retried");
+	snprintf(SQL, BUFSIZ, "SELECT COUNT(*) FROM %s", RETRY);
+	check(atoi(test_get(a, SQL)) == 0, "retry: uploaded row is removed");
+
+	free(uuid);
+	kdata2_close(a);
+	kdata2_close(b);
+}
+
+/* devices of older versions read JSON rows in flat
+ * folders */
+static void test_json(void)
+{
+	kdata2_t *a, *b;
+	unsigned char blob[100000];
+	char *uuid;
+	const char *sql = "SELECT COUNT(*) || ' ' || SUM(n) || ' ' || "
+		"SUM(length(b)) || ' ' || hex(MAX(b)) FROM items";
+	int i;
+
+	test_remote_clean();
+	a = test_open("kdata2_test_a.db");
+	b = test_open("kdata2_test_b.db");
+	if (!a || !b){
+		check(0, "json: open databases");
+		return;
+	}
+
+	test_fill(blob, sizeof(blob), 7);
+	for (i = 0; i < 5; ++i)
+		free(kdata2_set_number_for_uuid(a, "items", "n", i, NULL));
+	uuid = kdata2_set_number_for_uuid(a, "items", "n", 5, NULL);
+	kdata2_set_data_for_uuid(a, "items", "b", blob, sizeof(blob), uuid);
+	free(uuid);
+
+	test_binary = 0;
+	test_sync_device(a);
+	test_sync_device(b);
+	test_binary = 1;
+
+	check(test_count_files(UPDATES) == 6 && 
+			test_count_files(CHANGES) == 0,
+			"json: rows are uploaded as JSON by default");
+	check(strcmp(test_get(a, sql), test_get(b, sql)) == 0,
+			"json: rows and blobs are downloaded");
+
+	kdata2_close(a);
+	kdata2_close(b);
+}
+
+static void test_two_devices(void)
+{
+	kdata2_t *a, *b;
+	unsigned char blob[300000];
+	char SQL[BUFSIZ], *uuids[20], *uuid;
+	int i;
+
+	test_remote_clean();
+	a = test_open("kdata2_test_a.db");
+	b = test_open("kdata2_test_b.db");
+	if (!a || !b){
+		check(0, "sync: open databases");
+		return;
+	}
+
+	for (i = 0; i < 20; ++i) {
+		uuids[i] = kdata2_set_number_for_uuid(a, "items", "n", i, NULL);
+		kdata2_set_text_for_uuid(a, "items", "s", "row", uuids[i]);
+		kdata2_set_float_for_uuid(a, "items", "f", i * 0.5, uuids[i]);
+		kdata2_set_data_for_uuid(a, "items", "b", "\1\0\3", 3, uuids[i]);
+	}
+	// large blob of two rows
+	test_fill(blob, sizeof(blob), 3);
+	kdata2_set_data_for_uuid(a, "items", "b", blob, sizeof(blob), uuids[0]);
+	kdata2_set_data_for_uuid(a, "items", "b", blob, sizeof(blob), uuids[1]);
+	test_sync_device(a);
+	test_sync_device(b);
+
+	snprintf(SQL, BUFSIZ, 
+			"SELECT COUNT(*) || ' ' || SUM(n) || ' ' || SUM(f) || ' ' || "
+			"SUM(length(b)) || ' ' || hex(MAX(b)) FROM items");
+	check(strcmp(test_get(a, SQL), test_get(b, SQL)) == 0,
+			"sync: rows and blobs are downloaded");
+	free(chunker_split(blob, sizeof(blob), &i));
+	check(test_count_files(BLOBS_DIR) == i, 
+			"sync: chunks of blob are uploaded once");
+
+	for (i = 0; i < 5; ++i)
+		kdata2_remove_for_uuid(a, "items", uuids[i]);
+	test_sync_device(a);
+	test_sync_device(b);
+	check(atoi(test_get(b, "SELECT COUNT(*) FROM items")) == 15,
+			"sync: deletes are downloaded");
+
+	// devices change different columns of one row (newer
+	// then versions of columns) in the same second
+	sleep(1);
+	kdata2_set_text_for_uuid(a, "items", "s", "from a", uuids[10]);
+	kdata2_set_number_for_uuid(b, "items", "n", 77, uuids[10]);
+	test_sync_device(a);
+	test_sync_device(b);
+	test_sync_device(a);
+	snprintf(SQL, BUFSIZ, "SELECT s || ' ' || n FROM items "
+			"WHERE %s = '%s'", UUIDCOLUMN, uuids[10]);
+	check(strcmp(test_get(a, SQL), "from a 77") == 0 &&
+			strcmp(test_get(b, SQL), "from a 77") == 0,
+			"sync: columns of both devices are merged");
+
+	// devices change one column in the same second - change
+	// of b is uploaded in the same second as change of a
+	// which wins
+	kdata2_set_text_for_uuid(a, "items", "s", "bbb", uuids[11]);
+	kdata2_set_text_for_uuid(b, "items", "s", "aaa", uuids[11]);
+	test_sync_device(a);
+	test_sync_device(b);
+	test_sync_device(a);
+	snprintf(SQL, BUFSIZ, "SELECT s FROM items "
+			"WHERE %s = '%s'", UUIDCOLUMN, uuids[11]);
+	check(strcmp(test_get(a, SQL), test_get(b, SQL)) == 0,
+			"sync: devices converge on equal versions");
+
+	// change file which name is stamped before last download
+	// of other device is visible later
+	test_sync_device(b);
+	uuid = kdata2_set_text_for_uuid(a, "items", "s", "late", NULL);
+	sleep(2);
+	do {
+		char dirpath[BUFSIZ], from[BUFSIZ], to[BUFSIZ];
+		struct dirent *entry;
+		long bucket = CHANGES_BUCKET(time(NULL)),
+				 stamp = time(NULL) - 60;
+		DIR *dir;
+
+		test_sync_device(a);
+		snprintf(dirpath, BUFSIZ, "%s/%s/%010ld", REMOTE, CHANGES, bucket);
+		dir = opendir(dirpath);
+		while (dir && (entry = readdir(dir))) {
+			if (strstr(entry->d_name, uuid) == NULL)
+				continue;
+			snprintf(from, BUFSIZ, "%s/%s", dirpath, entry->d_name);
+			snprintf(to, BUFSIZ, "%s/%ld%s", dirpath, 
+					stamp > bucket?stamp:bucket,
+					strchr(entry->d_name, '.'));
+			rename(from, to);
+		}
+		if (dir)
+			closedir(dir);
+	} while (0);
+	test_sync_device(b);
+	snprintf(SQL, BUFSIZ, "SELECT COUNT(*) FROM items "
+			"WHERE %s = '%s'", UUIDCOLUMN, uuid);
+	check(atoi(test_get(b, SQL)) == 1,
+			"sync: reader overlaps last download");
+	free(uuid);
+
+	for (i = 0; i < 20; ++i)
+		free(uuids[i]);
+	kdata2_close(a);
+	kdata2_close(b);
+}
+
+static void test_snapshot(void)
+{
+	kdata2_t *a, *c;
+	unsigned char blob[300000];
+	char from[BUFSIZ], to[BUFSIZ], *uuid;
+	const char *sql = "SELECT COUNT(*) || ' ' || SUM(n) || ' ' || "
+		"SUM(length(b)) || ' ' || hex(MAX(b)) FROM items";
+	long bucket;
+	DIR *dir;
+	struct dirent *entry;
+	int i;
+
+	test_remote_clean();
+	a = test_open("kdata2_test_a.db");
+	c = test_open("kdata2_test_c.db");
+	if (!a || !c){
+		check(0, "snapshot: open databases");
+		return;
+	}
+
+	for (i = 0; i < 30; ++i)
+		free(kdata2_set_number_for_uuid(a, "items", "n", i, NULL));
+	// chunks are fetched before snapshot is applied
+	test_fill(blob, sizeof(blob), 5);
+	uuid = kdata2_set_number_for_uuid(a, "items", "n", 30, NULL);
+	kdata2_set_data_for_uuid(a, "items", "b", blob, sizeof(blob), uuid);
+	free(uuid);
+	test_sync_device(a);
+
+	// changes are older then compaction age
+	bucket = CHANGES_BUCKET(time(NULL));
+	snprintf(from, BUFSIZ, "%s/%s/%010ld", REMOTE, CHANGES, bucket);
+	snprintf(to, BUFSIZ, "%s/%s/%010ld", REMOTE, CHANGES, 
+			CHANGES_BUCKET(bucket - 10 * 24 * 3600));
+	rename(from, to);
+
+	// changes of table which is not in local database have no
+	// snapshot
+	snprintf(from, BUFSIZ, "%s/%s/%010ld", REMOTE, CHANGES,
+			CHANGES_BUCKET(bucket - 9 * 24 * 3600));
+	mkdir(from, 0755);
+	snprintf(to, BUFSIZ, "%s/%ld.%ld.u-00000000.other.%s",
+			from, bucket - 9 * 24 * 3600, bucket - 9 * 24 * 3600,
+			"00000000-0000-0000-0000-000000000000");
+	fclose(fopen(to, "w"));
+
+	// flat folders are read by devices in JSON mode
+	sleep(1);
+	free(kdata2_set_number_for_uuid(a, "items", "n", 100, NULL));
+	test_binary = 0;
+	test_sync_device(a);
+	test_binary = 1;
+	snprintf(from, BUFSIZ, "%s/%s", REMOTE, UPDATES);
+	dir = opendir(from);
+	while (dir && (entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(from, BUFSIZ, "%s/%s/%s", 
+				REMOTE, UPDATES, entry->d_name);
+		snprintf(to, BUFSIZ, "%s/%s/%ld%s", REMOTE, UPDATES,
+				bucket - 10 * 24 * 3600, strchr(entry->d_name, '.'));
+		rename(from, to);
+		break;
+	}
+	if (dir)
+		closedir(dir);
+	check(test_count_files(SNAPSHOTS) == 0,
+			"snapshot: compaction is off by default");
+
+	test_compact_age = YANDEX_DISK_COMPACT_AGE;
+	sleep(1);
+	test_sync_device(a);
+	test_sync_device(a);
+	test_compact_age = 0;
+
+	check(test_count_files(SNAPSHOTS) > 0 &&
+			test_count_files(CHANGES) == 1,
+			"snapshot: changes are compacted");
+	check(test_count_files(UPDATES) == 1,
+			"snapshot: flat folders are not compacted");
+
+	test_sync_device(c);
+	check(strcmp(test_get(a, sql), test_get(c, sql)) == 0 &&
+			atoi(test_get(c, "SELECT COUNT(*) FROM items")) == 32,
+			"snapshot: new device is loaded from snapshot");
+
+	kdata2_close(a);
+	kdata2_close(c);
+}
+
+static int test_sync(void)
+{
+	test_listeners();
+	test_uuidmap();
+	test_codec();
+	test_tie();
+	test_chunker();
+	test_json();
+	test_two_devices();
+	test_snapshot();
+	test_retry();
+
+	test_remote_clean();
+	unlink("kdata2_test_a.db");
+	unlink("kdata2_test_b.db");
+	unlink("kdata2_test_c.db");
+
+	printf("%d checks failed\n", failed);
+	return failed?1:0;
+}
+
+
 int main(int argc, char *argv[])
 {
 	printf("kdata2 test start...\n");
 
+	if (argc > 1 && strcmp(argv[1], "sync") == 0)
+		return test_sync();
+
 	char secret[16], login[32], password[32];
 	int company_id;
 	